@@ -1,7 +1,61 @@
 #include <GLEW/glew.h>
 #include <GLFW/glfw3.h>
-#include <GL/GLU.h>
+#include <GL/glu.h>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
+#include <chrono>
+#include <cfloat>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Headless rendering creates its context through EGL (Mesa, including llvmpipe, on Linux)
+#ifdef __linux__
+#define SCENE_HAS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// SSE is part of x86-64; AVX2 kernels are compiled for it per function and picked at run time
+#if defined(__x86_64__) || defined(_M_X64)
+#define SCENE_HAS_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SCENE_TARGET_AVX2
+#else
+#define SCENE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 // GLM Mathematics
 #include <glm/glm.hpp>
@@ -43,7 +97,7 @@ void PrintShaderLinkingError(int prog)
 	if (len > 0)
 	{
 		log = (char*)malloc(len);
-		glGetShaderInfoLog(prog, len, &chWritten, log);
+		glGetProgramInfoLog(prog, len, &chWritten, log);
 		cout << "Shader Linking Error: " << log << endl;
 		free(log);
 	}
@@ -78,6 +132,10 @@ glm::mat4 viewMatrix;
 // Initialize FOV
 GLfloat fov = 45.0f;
 
+// Clip planes of both projections, which the light clusters and benchmarks share
+const GLfloat NEAR_PLANE = 0.1f;
+const GLfloat FAR_PLANE = 100.0f;
+
 // Declare World Center
 glm::vec3 worldCenter = glm::vec3(0.0f, 0.0f, 0.0f);
 
@@ -98,6 +156,10 @@ glm::vec3 getTarget();
 // Camera transformation prototype
 void TransformCamera();
 
+// Simulation tick prototypes
+void ProcessInputTick(double tickEnd);
+void ApplyCursorMotion();
+
 // Boolean for keys and mouse buttons
 bool keys[1024], mouseButtons[3];
 
@@ -106,12 +168,30 @@ bool isPanning = false;
 bool isOrbiting = false;
 
 bool isOrtho = false;
+const GLfloat orthoHalfHeight = 8.0f;	// World units above and below the view center in ortho mode, enough for the shelf unit
 bool firstLoop = true;
 
+// Ways of submitting the scene, cycled with I
+enum RenderPath
+{
+	RENDER_PER_OBJECT,	// One uniform upload and draw per placement
+	RENDER_INSTANCED,	// One instanced draw per shared mesh
+	RENDER_INDIRECT		// One multi-draw indirect call for the whole scene
+};
+RenderPath renderPath = RENDER_INDIRECT;
+bool indirectSupported = false;
+
+// What draws the frame: the GL context, or the tile rasterizer on the job workers (headless only)
+enum RenderBackend
+{
+	RENDER_BACKEND_GL,
+	RENDER_BACKEND_SOFTWARE
+};
+RenderBackend renderBackend = RENDER_BACKEND_GL;
+
 // Radius, Pitch, and Yaw
 GLfloat radius = 3.0f, rawYaw = 0.0f, rawPitch = 0.0f, degYaw, degPitch;
 
-GLfloat deltaTime = 0.0f, lastFrame = 0.0f;
 GLfloat lastX = width / 2, lastY = height / 2, xChange, yChange;
 
 bool firstMouseMove = true; // Detect initial mouse movement
@@ -119,505 +199,5326 @@ bool firstMouseMove = true; // Detect initial mouse movement
 void initCamera();
 void targetFollowsCursor();
 
-// Draw Primitive(s)
-void draw()
-{
-	// Cube drawing starts here
-	GLenum mode = GL_TRIANGLES;
-	GLsizei cubeIndices = 6;
-	glDrawElements(mode, cubeIndices, GL_UNSIGNED_BYTE, nullptr);
-}
+/* Input Queue Definitions */
 
-// Create and Compile Shaders
-static GLuint CompileShader(const string& source, GLuint shaderType)
+// GLFW callbacks only push timestamped events into a single-producer/single-consumer ring. The
+// simulation drains it once per fixed tick, keeping just the last cursor position and summed scroll,
+// so a flood of mouse events costs one copy each and one camera update per tick.
+const GLuint INPUT_QUEUE_CAPACITY = 4096;	// Power of two
+const double SIMULATION_TICK_SECONDS = 1.0 / 60.0;	// Camera speeds are per tick, tuned at 60 Hz
+const GLuint MAX_TICKS_PER_FRAME = 8;
+
+enum InputEventType
 {
-	// Create Shader object
-	GLuint shaderID = glCreateShader(shaderType);
-	const char* src = source.c_str();
+	INPUT_KEY,
+	INPUT_MOUSE_BUTTON,
+	INPUT_CURSOR,
+	INPUT_SCROLL
+};
 
-	// Attach source code to Shader object
-	glShaderSource(shaderID, 1, &src, nullptr);
+struct InputEvent
+{
+	double time;	// glfwGetTime() when the callback ran
+	GLuint type;
+	int code;		// Key or mouse button
+	int action;		// GLFW_PRESS or GLFW_RELEASE
+	double x, y;	// Cursor position or scroll offset
+};
+
+// Only the producer writes tail and only the consumer writes head
+struct InputQueue
+{
+	InputEvent events[INPUT_QUEUE_CAPACITY];
+	atomic<uint32_t> head{ 0 };
+	atomic<uint32_t> tail{ 0 };
+	uint32_t dropped = 0;	// Events lost to a full ring, producer side
+};
 
-	// Compile Shader
-	glCompileShader(shaderID);
+InputQueue inputQueue;
 
-	/* Shader Linking Error Check */
-	GLint linked;
-	IsOpenGLError();
-	glGetProgramiv(shaderID, GL_LINK_STATUS, &linked);
-	if (linked != 1)
+// Producer side, called from the GLFW callbacks
+void PushInputEvent(InputQueue& queue, GLuint type, int code, int action, double x, double y)
+{
+	uint32_t tail = queue.tail.load(memory_order_relaxed);
+	if (tail - queue.head.load(memory_order_acquire) == INPUT_QUEUE_CAPACITY)
 	{
-		cout << "Shader Linking Failed!" << endl;
-		PrintShaderLinkingError(shaderID);
+		queue.dropped++;
+		return;
 	}
-	/* End here */
-
-	// Return ID of Compiled shader
-	return shaderID;
-
+	InputEvent event = { glfwGetTime(), type, code, action, x, y };
+	queue.events[tail % INPUT_QUEUE_CAPACITY] = event;
+	queue.tail.store(tail + 1, memory_order_release);
 }
 
-// Create Program Object
-static GLuint CreateShaderProgram(const string& vertexShader, const string& fragmentShader)
+// Consumer side: take the oldest event if it happened before the given time
+bool PopInputEvent(InputQueue& queue, double before, InputEvent& event)
 {
-	// Compile vertex shader
-	GLuint vertexShaderComp = CompileShader(vertexShader, GL_VERTEX_SHADER);
-
-	// Compile fragment shader
-	GLuint fragmentShaderComp = CompileShader(fragmentShader, GL_FRAGMENT_SHADER);
+	uint32_t head = queue.head.load(memory_order_relaxed);
+	if (head == queue.tail.load(memory_order_acquire))
+		return false;
+	const InputEvent& next = queue.events[head % INPUT_QUEUE_CAPACITY];
+	if (next.time > before)
+		return false;
+	event = next;
+	queue.head.store(head + 1, memory_order_release);
+	return true;
+}
 
-	// Create program object
-	GLuint shaderProgram = glCreateProgram();
+// What the renderer needs of the camera. The simulation keeps the state before and after its latest
+// tick and frames draw a blend of the two, so motion is smooth at any frame rate.
+struct CameraState
+{
+	glm::vec3 position;
+	glm::vec3 front;
+};
 
-	// Attach vertex and fragment shaders to program object
-	glAttachShader(shaderProgram, vertexShaderComp);
-	glAttachShader(shaderProgram, fragmentShaderComp);
+CameraState previousCamera;		// Camera before the latest tick
 
-	// Link shaders to create executable
-	glLinkProgram(shaderProgram);
+CameraState CurrentCamera()
+{
+	CameraState camera = { cameraPosition, cameraFront };
+	return camera;
+}
 
-	/* Shader Linking Error Check */
-	GLint linked;
-	IsOpenGLError();
-	glGetProgramiv(shaderProgram, GL_LINK_STATUS, &linked);
-	if (linked != 1)
-	{
-		cout << "Shader Linking Failed!" << endl;
-		PrintShaderLinkingError(shaderProgram);
-	}
-	/* End here */
+CameraState InterpolateCamera(const CameraState& from, const CameraState& to, GLfloat alpha)
+{
+	CameraState camera = { glm::mix(from.position, to.position, alpha), glm::mix(from.front, to.front, alpha) };
+	return camera;
+}
 
-	// Delete compiled vertex and fragment shaders
-	glDeleteShader(vertexShaderComp);
-	glDeleteShader(fragmentShaderComp);
+/* Input Queue Definitions End Here */
 
-	// Return Shader Program
-	return shaderProgram;
+/* Job System Definitions */
 
-}
+// Work-stealing scheduler. Every worker owns a deque: it pushes and pops jobs at the back, and an idle
+// worker steals from the front of someone else's. The thread that calls ParallelFor acts as worker 0
+// and runs jobs while it waits, so GL calls never leave the context thread.
+const GLuint JOB_MAX_WORKERS = 64;
 
+struct Job
+{
+	function<void()> work;
+	atomic<GLuint>* pending;	// Decremented once work returns
+};
 
-int main(void)
+struct JobDeque
 {
-	GLFWwindow* window;
+	mutex lock;
+	deque<Job> jobs;
+};
 
-	/* Initialize the library */
-	if (!glfwInit())
-		return -1;
+struct JobSystem
+{
+	GLuint workerCount = 1;		// Including the calling thread
+	JobDeque deques[JOB_MAX_WORKERS];
+	vector<thread> threads;
+	mutex sleepLock;			// Guards sleeping workers against missed wakeups
+	condition_variable wake;
+	atomic<GLuint> queued{ 0 };
+	bool quit = false;
+};
+
+JobSystem sceneJobs;
+GLuint jobThreadCount = 0;		// 0 uses every core
+thread_local GLuint jobWorkerIndex = 0;
+
+void PushJob(JobSystem& jobs, const Job& job)
+{
+	{
+		lock_guard<mutex> guard(jobs.deques[jobWorkerIndex].lock);
+		jobs.deques[jobWorkerIndex].jobs.push_back(job);
+	}
+	jobs.queued.fetch_add(1);
+	lock_guard<mutex> guard(jobs.sleepLock);
+	jobs.wake.notify_one();
+}
 
-	/* Create a windowed mode window and its OpenGL context */
-	window = glfwCreateWindow(width, height, "Tyler Pruitt Project Milestone", NULL, NULL);
-	if (!window)
+// Run one job from this worker's deque, or steal one. Returns false when every deque was empty.
+bool RunOneJob(JobSystem& jobs)
+{
+	Job job;
+	bool found = false;
+	for (GLuint i = 0; i < jobs.workerCount && !found; i++)
 	{
-		glfwTerminate();
-		return -1;
+		GLuint victim = (jobWorkerIndex + i) % jobs.workerCount;
+		JobDeque& queue = jobs.deques[victim];
+		lock_guard<mutex> guard(queue.lock);
+		if (queue.jobs.empty())
+			continue;
+		if (i == 0)
+		{
+			job = queue.jobs.back();	// Own work, newest first while it is still in cache
+			queue.jobs.pop_back();
+		}
+		else
+		{
+			job = queue.jobs.front();	// Stolen work, oldest first, which is usually the biggest piece
+			queue.jobs.pop_front();
+		}
+		found = true;
 	}
+	if (!found)
+		return false;
 
-	// Set input callback functions
-	glfwSetKeyCallback(window, key_callback);
-	glfwSetCursorPosCallback(window, cursor_position_callback);
-	glfwSetMouseButtonCallback(window, mouse_button_callback);
-	glfwSetScrollCallback(window, scroll_callback);
+	jobs.queued.fetch_sub(1);
+	job.work();
+	job.pending->fetch_sub(1, memory_order_release);
+	return true;
+}
 
-	/* Make the window's context current */
-	glfwMakeContextCurrent(window);
+void JobWorkerMain(JobSystem& jobs, GLuint index)
+{
+	jobWorkerIndex = index;
+	for (;;)
+	{
+		if (RunOneJob(jobs))
+			continue;
+		unique_lock<mutex> guard(jobs.sleepLock);
+		jobs.wake.wait(guard, [&jobs] { return jobs.queued.load() > 0 || jobs.quit; });
+		if (jobs.quit && jobs.queued.load() == 0)
+			return;
+	}
+}
 
-	// Initialize GLEW
-	if (glewInit() != GLEW_OK)
-		cout << "Error!" << endl;
+// Help with queued jobs until pending reaches zero
+void WaitForJobs(JobSystem& jobs, atomic<GLuint>& pending)
+{
+	while (pending.load(memory_order_acquire) > 0)
+		if (!RunOneJob(jobs))
+			this_thread::yield();
+}
 
-	GLfloat brickRectangleVerticesTB[] = {	// Top Bottom
+// Start threadCount - 1 worker threads next to the calling one; 0 means one per core
+void StartJobSystem(JobSystem& jobs, GLuint threadCount)
+{
+	if (threadCount == 0)
+		threadCount = max(1u, thread::hardware_concurrency());
+	jobs.workerCount = min(threadCount, JOB_MAX_WORKERS);
+	jobs.quit = false;
+	for (GLuint i = 1; i < jobs.workerCount; i++)
+		jobs.threads.push_back(thread(JobWorkerMain, ref(jobs), i));
+}
 
-		// Triangle 1
-		-1.5, -1.0, 0.0, // index 0
-		0.82, 0.71, 0.55, // Tan
+void StopJobSystem(JobSystem& jobs)
+{
+	{
+		lock_guard<mutex> guard(jobs.sleepLock);
+		jobs.quit = true;
+	}
+	jobs.wake.notify_all();
+	for (size_t i = 0; i < jobs.threads.size(); i++)
+		jobs.threads[i].join();
+	jobs.threads.clear();
+	jobs.workerCount = 1;
+}
 
-		-1.5, 1.0, 0.0, // index 1
-		0.82, 0.71, 0.55, // Tan
+// Split [0, count) into chunks of at least grain items and run body(begin, end) on each across the
+// workers. Returns once every chunk has finished. Small ranges run inline.
+void ParallelFor(JobSystem& jobs, GLuint count, GLuint grain, const function<void(GLuint, GLuint)>& body)
+{
+	if (count == 0)
+		return;
+	if (jobs.workerCount == 1 || count <= grain)
+	{
+		body(0, count);
+		return;
+	}
 
-		1.5, -1.0, 0.0,  // index 2	
-		0.82, 0.71, 0.55, // Tan
+	// A few chunks per worker so stealing can even out uneven chunks
+	GLuint targetChunks = jobs.workerCount * 4;
+	GLuint chunkSize = max(grain, (count + targetChunks - 1) / targetChunks);
+	GLuint chunkCount = (count + chunkSize - 1) / chunkSize;
+	atomic<GLuint> pending(chunkCount);
+	for (GLuint chunk = 0; chunk < chunkCount; chunk++)
+	{
+		GLuint begin = chunk * chunkSize, end = min(count, begin + chunkSize);
+		Job job = { [&body, begin, end] { body(begin, end); }, &pending };
+		PushJob(jobs, job);
+	}
+	WaitForJobs(jobs, pending);
+}
 
-		// Triangle 2	
-		1.5, 1.0, 0.0,  // index 3	
-		0.82, 0.71, 0.55, // Tan
-	};
+/* Job System Definitions End Here */
 
-	// Define element indices
-	GLubyte squareIndices[] = {
-		0, 1, 2,
-		1, 2, 3
-	};
+/* Transform Store Definitions */
 
-	GLfloat brickRectangleVerticesLR[] = {   // Left right
+// Placement of every object plus its cached world matrix, stored as structure of arrays so the
+// matrix kernels load 4 or 8 objects per register. Rotations are kept as unit quaternions built
+// from Euler angles in degrees applied in Y, Z, X order, which covers every rotation chain the scene uses.
+struct TransformStore
+{
+	vector<GLfloat> positionX, positionY, positionZ;
+	vector<GLfloat> rotationX, rotationY, rotationZ, rotationW;
+	vector<GLfloat> scaleX, scaleY, scaleZ;
+	vector<glm::mat4> worldMatrices;	// Contiguous and ready to upload
+	vector<unsigned char> dirty;		// Position, rotation or scale edited since the last rebuild
+	vector<unsigned char> changed;		// Rebuilt since its batch last uploaded it
+	vector<unsigned char> moved;		// Rebuilt since the culling hierarchy last refit
+										// (bytes, not vector<bool>, so workers can write neighbours)
+	bool anyDirty = false;
+	bool anyMoved = false;
+};
+
+TransformStore sceneTransforms;
+
+// Build a world matrix from a position, rotation and scale through glm, one object at a time.
+// Scene conversion bakes matrices with it and --bench-transforms compares the kernels against it.
+glm::mat4 ComposeTransform(const glm::vec3& position, const glm::vec3& rotation, const glm::vec3& scale)
+{
+	glm::mat4 modelMatrix = glm::translate(glm::mat4(1.0f), position);
+	if (rotation.y != 0.0f)
+		modelMatrix = glm::rotate(modelMatrix, rotation.y * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
+	if (rotation.z != 0.0f)
+		modelMatrix = glm::rotate(modelMatrix, rotation.z * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
+	if (rotation.x != 0.0f)
+		modelMatrix = glm::rotate(modelMatrix, rotation.x * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
+	return glm::scale(modelMatrix, scale);
+}
 
-		// Triangle 1
-		-1.5, -0.5, 0.0, // index 0
-		0.79, 0.68, 0.52, // Tan
+// Quaternions are (x, y, z, w)
+glm::vec4 MultiplyQuaternions(const glm::vec4& a, const glm::vec4& b)
+{
+	return glm::vec4(a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+		a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+		a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+		a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z);
+}
 
-		-1.5, 0.5, 0.0, // index 1
-		0.79, 0.68, 0.52, // Tan
+// Same rotation as ComposeTransform's Y, Z, X chain
+glm::vec4 EulerToQuaternion(const glm::vec3& degrees)
+{
+	glm::vec3 half = degrees * (toRadians * 0.5f);
+	glm::vec4 yaw(0.0f, sinf(half.y), 0.0f, cosf(half.y));
+	glm::vec4 roll(0.0f, 0.0f, sinf(half.z), cosf(half.z));
+	glm::vec4 pitch(sinf(half.x), 0.0f, 0.0f, cosf(half.x));
+	return MultiplyQuaternions(MultiplyQuaternions(yaw, roll), pitch);
+}
 
-		1.5, -0.5, 0.0,  // index 2	
-		0.79, 0.68, 0.52, // Tan
+// Add an object and return its index in the store
+GLuint AddTransform(TransformStore& store, const glm::vec3& position, const glm::vec3& rotation, const glm::vec3& scale)
+{
+	glm::vec4 quaternion = EulerToQuaternion(rotation);
+	store.positionX.push_back(position.x);
+	store.positionY.push_back(position.y);
+	store.positionZ.push_back(position.z);
+	store.rotationX.push_back(quaternion.x);
+	store.rotationY.push_back(quaternion.y);
+	store.rotationZ.push_back(quaternion.z);
+	store.rotationW.push_back(quaternion.w);
+	store.scaleX.push_back(scale.x);
+	store.scaleY.push_back(scale.y);
+	store.scaleZ.push_back(scale.z);
+	store.worldMatrices.push_back(glm::mat4(1.0f));
+	store.dirty.push_back(true);
+	store.changed.push_back(false);
+	store.moved.push_back(false);
+	store.anyDirty = true;
+	return (GLuint)store.worldMatrices.size() - 1;
+}
 
-		// Triangle 2	
-		1.5, 0.5, 0.0,  // index 3	
-		0.79, 0.68, 0.52, // Tan
-	};
+// Edit an object's placement; its matrix is rebuilt on the next UpdateTransforms
+void SetTransformPosition(TransformStore& store, GLuint id, const glm::vec3& position)
+{
+	store.positionX[id] = position.x;
+	store.positionY[id] = position.y;
+	store.positionZ[id] = position.z;
+	store.dirty[id] = true;
+	store.anyDirty = true;
+}
 
-	GLfloat brickRectangleCapVertices[] = {   // Front Back
+void SetTransformRotation(TransformStore& store, GLuint id, const glm::vec3& rotation)
+{
+	glm::vec4 quaternion = EulerToQuaternion(rotation);
+	store.rotationX[id] = quaternion.x;
+	store.rotationY[id] = quaternion.y;
+	store.rotationZ[id] = quaternion.z;
+	store.rotationW[id] = quaternion.w;
+	store.dirty[id] = true;
+	store.anyDirty = true;
+}
 
-		// Triangle 1
-		-1.0, -0.5, 0.0, // index 0
-		0.79, 0.68, 0.52, // Tan
+void SetTransformScale(TransformStore& store, GLuint id, const glm::vec3& scale)
+{
+	store.scaleX[id] = scale.x;
+	store.scaleY[id] = scale.y;
+	store.scaleZ[id] = scale.z;
+	store.dirty[id] = true;
+	store.anyDirty = true;
+}
 
-		-1.0, 0.5, 0.0, // index 1
-		0.79, 0.68, 0.52, // Tan
+// Matrix kernels: world = translate * rotate(quaternion) * scale for objects [first, first + count).
+// Every kernel does the same float operations in the same order, so they produce identical matrices.
+enum TransformKernel
+{
+	TRANSFORM_KERNEL_SCALAR,
+	TRANSFORM_KERNEL_SSE,		// 4 objects per iteration
+	TRANSFORM_KERNEL_AVX2		// 8 objects per iteration
+};
 
-		1.0, -0.5, 0.0,  // index 2	
-		0.79, 0.68, 0.52, // Tan
+void ComposeTransformsScalar(TransformStore& store, GLuint first, GLuint count)
+{
+	for (GLuint i = first; i < first + count; i++)
+	{
+		GLfloat x = store.rotationX[i], y = store.rotationY[i], z = store.rotationZ[i], w = store.rotationW[i];
+		GLfloat xx = x * x, yy = y * y, zz = z * z;
+		GLfloat xy = x * y, xz = x * z, yz = y * z;
+		GLfloat wx = w * x, wy = w * y, wz = w * z;
+		GLfloat* m = glm::value_ptr(store.worldMatrices[i]);
+		m[0] = (1.0f - 2.0f * (yy + zz)) * store.scaleX[i];
+		m[1] = 2.0f * (xy + wz) * store.scaleX[i];
+		m[2] = 2.0f * (xz - wy) * store.scaleX[i];
+		m[3] = 0.0f;
+		m[4] = 2.0f * (xy - wz) * store.scaleY[i];
+		m[5] = (1.0f - 2.0f * (xx + zz)) * store.scaleY[i];
+		m[6] = 2.0f * (yz + wx) * store.scaleY[i];
+		m[7] = 0.0f;
+		m[8] = 2.0f * (xz + wy) * store.scaleZ[i];
+		m[9] = 2.0f * (yz - wx) * store.scaleZ[i];
+		m[10] = (1.0f - 2.0f * (xx + yy)) * store.scaleZ[i];
+		m[11] = 0.0f;
+		m[12] = store.positionX[i];
+		m[13] = store.positionY[i];
+		m[14] = store.positionZ[i];
+		m[15] = 1.0f;
+	}
+}
 
-		// Triangle 2	
-		1.0, 0.5, 0.0,  // index 3	
-		0.79, 0.68, 0.52, // Tan
-	};
+#ifdef SCENE_HAS_X86_SIMD
+// Four registers hold one matrix column of four objects, one row each; transpose them so each
+// register is one object's column and store it
+static inline void StoreTransposedColumn(TransformStore& store, GLuint first, GLuint column, __m128 row0, __m128 row1, __m128 row2, __m128 row3)
+{
+	_MM_TRANSPOSE4_PS(row0, row1, row2, row3);
+	_mm_storeu_ps(glm::value_ptr(store.worldMatrices[first + 0]) + column * 4, row0);
+	_mm_storeu_ps(glm::value_ptr(store.worldMatrices[first + 1]) + column * 4, row1);
+	_mm_storeu_ps(glm::value_ptr(store.worldMatrices[first + 2]) + column * 4, row2);
+	_mm_storeu_ps(glm::value_ptr(store.worldMatrices[first + 3]) + column * 4, row3);
+}
 
-	GLfloat shelfRectangleVerticesTB[] = { // Top Bottom
+void ComposeTransformsSSE(TransformStore& store, GLuint first, GLuint count)
+{
+	const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), zero = _mm_setzero_ps();
+	GLuint i = first, end = first + count;
+	for (; i + 4 <= end; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(&store.rotationX[i]), y = _mm_loadu_ps(&store.rotationY[i]);
+		__m128 z = _mm_loadu_ps(&store.rotationZ[i]), w = _mm_loadu_ps(&store.rotationW[i]);
+		__m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+		__m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+		__m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+		__m128 sx = _mm_loadu_ps(&store.scaleX[i]), sy = _mm_loadu_ps(&store.scaleY[i]), sz = _mm_loadu_ps(&store.scaleZ[i]);
+
+		StoreTransposedColumn(store, i, 0,
+			_mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx),
+			_mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx),
+			_mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx), zero);
+		StoreTransposedColumn(store, i, 1,
+			_mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy),
+			_mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy),
+			_mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy), zero);
+		StoreTransposedColumn(store, i, 2,
+			_mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz),
+			_mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz),
+			_mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz), zero);
+		StoreTransposedColumn(store, i, 3,
+			_mm_loadu_ps(&store.positionX[i]), _mm_loadu_ps(&store.positionY[i]), _mm_loadu_ps(&store.positionZ[i]), one);
+	}
+	ComposeTransformsScalar(store, i, end - i);
+}
 
-		// Triangle 1
-		-5.0, -1.0, 0.0, // index 0
-		0.59, 0.29, 0.0, // brown
+// Eight objects' column: each 128-bit half goes through the four-object transpose
+SCENE_TARGET_AVX2 static inline void StoreTransposedColumn8(TransformStore& store, GLuint first, GLuint column, __m256 row0, __m256 row1, __m256 row2, __m256 row3)
+{
+	StoreTransposedColumn(store, first, column, _mm256_castps256_ps128(row0), _mm256_castps256_ps128(row1),
+		_mm256_castps256_ps128(row2), _mm256_castps256_ps128(row3));
+	StoreTransposedColumn(store, first + 4, column, _mm256_extractf128_ps(row0, 1), _mm256_extractf128_ps(row1, 1),
+		_mm256_extractf128_ps(row2, 1), _mm256_extractf128_ps(row3, 1));
+}
 
-		-5.0, 1.0, 0.0, // index 1
-		0.59, 0.29, 0.0, // brown
+SCENE_TARGET_AVX2 void ComposeTransformsAVX2(TransformStore& store, GLuint first, GLuint count)
+{
+	const __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), zero = _mm256_setzero_ps();
+	GLuint i = first, end = first + count;
+	for (; i + 8 <= end; i += 8)
+	{
+		__m256 x = _mm256_loadu_ps(&store.rotationX[i]), y = _mm256_loadu_ps(&store.rotationY[i]);
+		__m256 z = _mm256_loadu_ps(&store.rotationZ[i]), w = _mm256_loadu_ps(&store.rotationW[i]);
+		__m256 xx = _mm256_mul_ps(x, x), yy = _mm256_mul_ps(y, y), zz = _mm256_mul_ps(z, z);
+		__m256 xy = _mm256_mul_ps(x, y), xz = _mm256_mul_ps(x, z), yz = _mm256_mul_ps(y, z);
+		__m256 wx = _mm256_mul_ps(w, x), wy = _mm256_mul_ps(w, y), wz = _mm256_mul_ps(w, z);
+		__m256 sx = _mm256_loadu_ps(&store.scaleX[i]), sy = _mm256_loadu_ps(&store.scaleY[i]), sz = _mm256_loadu_ps(&store.scaleZ[i]);
+
+		StoreTransposedColumn8(store, i, 0,
+			_mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz))), sx),
+			_mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xy, wz)), sx),
+			_mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xz, wy)), sx), zero);
+		StoreTransposedColumn8(store, i, 1,
+			_mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xy, wz)), sy),
+			_mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz))), sy),
+			_mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(yz, wx)), sy), zero);
+		StoreTransposedColumn8(store, i, 2,
+			_mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xz, wy)), sz),
+			_mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(yz, wx)), sz),
+			_mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy))), sz), zero);
+		StoreTransposedColumn8(store, i, 3,
+			_mm256_loadu_ps(&store.positionX[i]), _mm256_loadu_ps(&store.positionY[i]), _mm256_loadu_ps(&store.positionZ[i]), one);
+	}
+	ComposeTransformsSSE(store, i, end - i);
+}
+#endif
 
-		5.0, -1.0, 0.0,  // index 2	
-		0.59, 0.29, 0.0, // brown
+// Widest kernel this CPU (and OS, for the AVX registers) supports
+TransformKernel DetectTransformKernel()
+{
+#ifdef SCENE_HAS_X86_SIMD
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+	__cpuid(info, 1);
+	bool osSavesAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+	if (maxLeaf >= 7 && osSavesAvx)
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+			return TRANSFORM_KERNEL_AVX2;
+	}
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return TRANSFORM_KERNEL_AVX2;
+#endif
+	return TRANSFORM_KERNEL_SSE;
+#else
+	return TRANSFORM_KERNEL_SCALAR;
+#endif
+}
 
-		// Triangle 2	
-		5.0, 1.0, 0.0,  // index 3	
-		0.59, 0.29, 0.0, // brown
-	};
+TransformKernel transformKernel = DetectTransformKernel();
 
-	GLfloat shelfRectangleVerticesFB[] = { // Front Back
+const char* TransformKernelName(TransformKernel kernel)
+{
+	if (kernel == TRANSFORM_KERNEL_AVX2)
+		return "avx2";
+	if (kernel == TRANSFORM_KERNEL_SSE)
+		return "sse";
+	return "scalar";
+}
 
-		// Triangle 1
-		-5.0, -0.25, 0.0, // index 0
-		0.65, 0.35, 0.0, // brown
+void ComposeTransforms(TransformKernel kernel, TransformStore& store, GLuint first, GLuint count)
+{
+#ifdef SCENE_HAS_X86_SIMD
+	if (kernel == TRANSFORM_KERNEL_AVX2)
+	{
+		ComposeTransformsAVX2(store, first, count);
+		return;
+	}
+	if (kernel == TRANSFORM_KERNEL_SSE)
+	{
+		ComposeTransformsSSE(store, first, count);
+		return;
+	}
+#endif
+	ComposeTransformsScalar(store, first, count);
+}
 
-		-5.0, 0.25, 0.0, // index 1
-		0.65, 0.35, 0.0, // brown
+// Objects per dirty check; a block with any dirty object is rebuilt whole, which leaves clean
+// objects' matrices unchanged since the kernels are deterministic
+const GLuint TRANSFORM_BLOCK_SIZE = 8;
 
-		5.0, -0.25, 0.0,  // index 2	
-		0.65, 0.35, 0.0, // brown
+struct SceneGraph;
+void ApplySceneParents(const SceneGraph& graph, TransformStore& store, GLuint first, GLuint count);
 
-		// Triangle 2	
-		5.0, 0.25, 0.0,  // index 3	
-		0.65, 0.35, 0.0, // brown
+// Rebuild dirty world matrices across the job workers, returns how many were dirty. With a scene
+// graph, objects hanging from a node get its world matrix applied after their own.
+GLuint UpdateTransforms(TransformStore& store, JobSystem& jobs, const SceneGraph* graph = nullptr)
+{
+	if (!store.anyDirty)
+		return 0;
+
+	GLuint objectCount = (GLuint)store.worldMatrices.size();
+	GLuint blockCount = (objectCount + TRANSFORM_BLOCK_SIZE - 1) / TRANSFORM_BLOCK_SIZE;
+	atomic<GLuint> rebuiltCount(0);
+	ParallelFor(jobs, blockCount, 128, [&store, &rebuiltCount, objectCount, graph](GLuint beginBlock, GLuint endBlock) {
+		GLuint chunkRebuilt = 0;
+		GLuint runFirst = 0, runEnd = 0;	// Consecutive dirty blocks go to the kernel as one run
+		for (GLuint block = beginBlock; block <= endBlock; block++)
+		{
+			GLuint first = block * TRANSFORM_BLOCK_SIZE, end = min(objectCount, first + TRANSFORM_BLOCK_SIZE);
+			bool blockDirty = false;
+			for (GLuint i = first; block < endBlock && i < end; i++)
+			{
+				if (!store.dirty[i])
+					continue;
+				store.dirty[i] = false;
+				store.changed[i] = true;
+				store.moved[i] = true;
+				chunkRebuilt++;
+				blockDirty = true;
+			}
+			if (blockDirty && runEnd == first)
+			{
+				runEnd = end;
+				continue;
+			}
+			if (runEnd > runFirst)
+			{
+				ComposeTransforms(transformKernel, store, runFirst, runEnd - runFirst);
+				if (graph != nullptr)
+					ApplySceneParents(*graph, store, runFirst, runEnd - runFirst);
+			}
+			runFirst = first;
+			runEnd = blockDirty ? end : first;
+		}
+		rebuiltCount.fetch_add(chunkRebuilt);
+	});
+	GLuint rebuilt = rebuiltCount.load();
+	store.anyDirty = false;
+	store.anyMoved = store.anyMoved || rebuilt > 0;
+	return rebuilt;
+}
 
-	};
+/* Transform Store Definitions End Here */
 
-	GLfloat shelfRectangleCapVertices[] = { // Left Right
+/* Scene Graph Definitions */
 
-		// Triangle 1
-		-1.0, -0.25, 0.0, // index 0
-		0.59, 0.29, 0.0, // brown
+const GLuint SCENE_NO_NODE = 0xFFFFFFFF;
 
-		-1.0, 0.25, 0.0, // index 1
-		0.59, 0.29, 0.0, // brown
+// Parent/child placement nodes (shelf unit -> shelves -> panels) in one flat array kept depth
+// first: a parent comes before its children and a node's subtree is the contiguous range
+// [node, subtreeEnd). Transform store objects hang from at most one node and keep a local placement.
+// Moving a node recomputes only its subtree and marks only the objects hanging from it dirty.
+struct SceneGraph
+{
+	vector<string> names;
+	vector<GLuint> parent;				// SCENE_NO_NODE for roots
+	vector<GLuint> subtreeEnd;
+	vector<glm::mat4> localMatrices;	// Relative to the parent
+	vector<glm::mat4> worldMatrices;
+	vector<unsigned char> dirty;		// Local matrix edited since the last propagation
+	vector<GLuint> objectNode;			// Per transform ID, SCENE_NO_NODE for world-space objects
+	vector<GLuint> nodeObjectStart;		// Objects of node n are nodeObjects[nodeObjectStart[n]] up to nodeObjectStart[n + 1]
+	vector<GLuint> nodeObjects;
+	bool anyDirty = false;
+};
+
+SceneGraph sceneGraph;
+
+// Append a node under an existing one; nodes must be added parents first
+GLuint AddSceneNode(SceneGraph& graph, const string& name, GLuint parent, const glm::vec3& position, const glm::vec3& rotation, const glm::vec3& scale)
+{
+	glm::mat4 local = ComposeTransform(position, rotation, scale);
+	graph.names.push_back(name);
+	graph.parent.push_back(parent);
+	graph.subtreeEnd.push_back((GLuint)graph.parent.size());
+	graph.localMatrices.push_back(local);
+	graph.worldMatrices.push_back(parent == SCENE_NO_NODE ? local : graph.worldMatrices[parent] * local);
+	graph.dirty.push_back(false);
+	return (GLuint)graph.parent.size() - 1;
+}
 
-		1.0, -0.25, 0.0,  // index 2	
-		0.59, 0.29, 0.0, // brown
+GLuint FindSceneNode(const SceneGraph& graph, const string& name)
+{
+	for (GLuint i = 0; i < (GLuint)graph.names.size(); i++)
+		if (graph.names[i] == name)
+			return i;
+	return SCENE_NO_NODE;
+}
 
-		// Triangle 2	
-		1.0, 0.25, 0.0,  // index 3	
-		0.59, 0.29, 0.0, // brown
+// Derive subtree ranges and per-node object lists once every node and objectNode is in place
+void FinishSceneGraph(SceneGraph& graph)
+{
+	GLuint nodeCount = (GLuint)graph.parent.size();
+	for (GLuint i = nodeCount; i-- > 0;)
+	{
+		graph.subtreeEnd[i] = max(graph.subtreeEnd[i], i + 1);
+		if (graph.parent[i] != SCENE_NO_NODE)
+			graph.subtreeEnd[graph.parent[i]] = max(graph.subtreeEnd[graph.parent[i]], graph.subtreeEnd[i]);
+	}
 
-	};
+	// Counting sort of the objects by node
+	graph.nodeObjectStart.assign(nodeCount + 1, 0);
+	for (size_t i = 0; i < graph.objectNode.size(); i++)
+		if (graph.objectNode[i] != SCENE_NO_NODE)
+			graph.nodeObjectStart[graph.objectNode[i] + 1]++;
+	for (GLuint i = 0; i < nodeCount; i++)
+		graph.nodeObjectStart[i + 1] += graph.nodeObjectStart[i];
+	graph.nodeObjects.resize(graph.nodeObjectStart[nodeCount]);
+	vector<GLuint> next(graph.nodeObjectStart.begin(), graph.nodeObjectStart.end() - 1);
+	for (GLuint i = 0; i < (GLuint)graph.objectNode.size(); i++)
+		if (graph.objectNode[i] != SCENE_NO_NODE)
+			graph.nodeObjects[next[graph.objectNode[i]]++] = i;
+}
 
-	GLfloat floorVertices[] = {
+// Move a node, and so its whole subtree, by an offset in its parent's space
+void MoveSceneNode(SceneGraph& graph, GLuint node, const glm::vec3& offset)
+{
+	graph.localMatrices[node] = glm::translate(glm::mat4(1.0f), offset) * graph.localMatrices[node];
+	graph.dirty[node] = true;
+	graph.anyDirty = true;
+}
 
-		// Triangle 1
-		-0.5, -0.5, 0.0, // index 0
-		0.49, 0.19, 0.0, // brown
+// Recompute the world matrices of every dirty node's subtree and mark the objects hanging from
+// those nodes dirty in the store. Returns how many nodes were recomputed.
+GLuint PropagateSceneGraph(SceneGraph& graph, TransformStore& store)
+{
+	if (!graph.anyDirty)
+		return 0;
 
-		-0.5, 0.5, 0.0, // index 1
-		0.49, 0.19, 0.0, // brown
+	GLuint recomputed = 0;
+	GLuint nodeCount = (GLuint)graph.parent.size();
+	for (GLuint node = 0; node < nodeCount;)
+	{
+		if (!graph.dirty[node])
+		{
+			node++;
+			continue;
+		}
+		// Parents come first, so one forward pass over the range is enough
+		GLuint end = graph.subtreeEnd[node];
+		for (GLuint i = node; i < end; i++)
+		{
+			GLuint parent = graph.parent[i];
+			graph.worldMatrices[i] = parent == SCENE_NO_NODE ? graph.localMatrices[i] : graph.worldMatrices[parent] * graph.localMatrices[i];
+			graph.dirty[i] = false;
+			for (GLuint j = graph.nodeObjectStart[i]; j < graph.nodeObjectStart[i + 1]; j++)
+				store.dirty[graph.nodeObjects[j]] = true;
+			store.anyDirty = store.anyDirty || graph.nodeObjectStart[i + 1] > graph.nodeObjectStart[i];
+		}
+		recomputed += end - node;
+		node = end;
+	}
+	graph.anyDirty = false;
+	return recomputed;
+}
 
-		0.5, -0.5, 0.0,  // index 2	
-		0.49, 0.19, 0.0, // brown
+// Turn freshly composed local matrices of objects [first, first + count) into world matrices
+void ApplySceneParents(const SceneGraph& graph, TransformStore& store, GLuint first, GLuint count)
+{
+	if (graph.objectNode.empty())
+		return;
+	for (GLuint i = first; i < first + count; i++)
+		if (graph.objectNode[i] != SCENE_NO_NODE)
+			store.worldMatrices[i] = graph.worldMatrices[graph.objectNode[i]] * store.worldMatrices[i];
+}
 
-		// Triangle 2	
-		0.5, 0.5, 0.0,  // index 3	
-		0.49, 0.19, 0.0, // brown
-	};
+/* Scene Graph Definitions End Here */
 
-	GLfloat wallVertices[] = {
+/* Procedural Mesh Definitions */
 
-		// Triangle 1
-		-7.5, 0.0, -2.75, // index 0
-		0.0, 0.7, 0.7, // Teal
+// Detail levels generated for every cylinder and sphere, finest first
+const GLuint PROCEDURAL_LOD_LEVELS = 4;
+const GLuint CYLINDER_SEGMENTS[PROCEDURAL_LOD_LEVELS] = { 48, 24, 12, 6 };
+const GLuint SPHERE_SLICES[PROCEDURAL_LOD_LEVELS] = { 32, 16, 10, 6 };
+const GLuint SPHERE_STACKS[PROCEDURAL_LOD_LEVELS] = { 16, 8, 5, 3 };
 
-		-7.5, 15.5, -2.75, // index 1
-		0.0, 0.7, 0.7, // Teal
+// Append one position + color vertex, returning its index within the mesh
+static GLuint AddMeshVertex(vector<GLfloat>& vertices, GLuint firstVertex, const glm::vec3& position, const GLfloat color[3])
+{
+	GLfloat vertex[6] = { position.x, position.y, position.z, color[0], color[1], color[2] };
+	vertices.insert(vertices.end(), vertex, vertex + 6);
+	return (GLuint)(vertices.size() / 6) - 1 - firstVertex;
+}
 
-		7.5, 0.0, -2.75,  // index 2	
-		0.0, 0.7, 0.7, // Teal
+// Cylinder running from z = 0 to z = -length. Each cap fades from capColor at its center to
+// sideColor at the rim, like the original hand-built toilet paper roll. Every face winds
+// counterclockwise seen from outside.
+void GenerateCylinder(GLfloat radius, GLfloat length, GLuint segments, const GLfloat sideColor[3], const GLfloat capColor[3], vector<GLfloat>& vertices, vector<GLuint>& indices)
+{
+	GLuint firstVertex = (GLuint)(vertices.size() / 6);
 
-		// Triangle 2	
-		7.5, 15.5, -2.75,  // index 3	
-		0.0, 0.7, 0.7, // Teal
-	};
+	// Side: a ring of vertices at each end
+	for (GLuint i = 0; i < segments; i++)
+	{
+		GLfloat angle = 2.0f * (GLfloat)PI * i / segments;
+		glm::vec3 rim = glm::vec3(radius * cosf(angle), radius * sinf(angle), 0.0f);
+		AddMeshVertex(vertices, firstVertex, rim, sideColor);
+		AddMeshVertex(vertices, firstVertex, rim - glm::vec3(0.0f, 0.0f, length), sideColor);
+	}
+	for (GLuint i = 0; i < segments; i++)
+	{
+		GLuint next = (i + 1) % segments;
+		GLuint quad[6] = { 2 * i, 2 * i + 1, 2 * next, 2 * next, 2 * i + 1, 2 * next + 1 };
+		indices.insert(indices.end(), quad, quad + 6);
+	}
 
-	// Plane Transforms
-	glm::vec3 brickPlanePositions[] = {
-		glm::vec3(4.0f,  4.25f,  0.0f), // left 0
-		glm::vec3(2.0f,  4.25f,  0.0f), // right 1
-		glm::vec3(3.0f,  4.75f,  0.0f), // top 2
-		glm::vec3(3.0f,  3.75f,  0.0f), // bottom 3
-	};
+	// Caps: a fan around a center vertex at each end. Each cap has its own rim ring, so the
+	// smooth normals of the side and the caps stay apart across the hard edge.
+	for (GLuint end = 0; end < 2; end++)
+	{
+		GLfloat z = end == 0 ? 0.0f : -length;
+		GLuint center = AddMeshVertex(vertices, firstVertex, glm::vec3(0.0f, 0.0f, z), capColor);
+		for (GLuint i = 0; i < segments; i++)
+		{
+			GLfloat angle = 2.0f * (GLfloat)PI * i / segments;
+			AddMeshVertex(vertices, firstVertex, glm::vec3(radius * cosf(angle), radius * sinf(angle), z), sideColor);
+		}
+		for (GLuint i = 0; i < segments; i++)
+		{
+			GLuint rim = center + 1 + i, next = center + 1 + (i + 1) % segments;
+			GLuint fan[3] = { center, end == 0 ? rim : next, end == 0 ? next : rim };
+			indices.insert(indices.end(), fan, fan + 3);
+		}
+	}
+}
 
-	glm::float32 brickPlaneRotations[] = {
-		90.0f, 90.0f, 90.0f, 90.0f		// left, right, top, bottom, respectively
-	};
+// UV sphere around the origin
+void GenerateSphere(GLfloat radius, GLuint slices, GLuint stacks, const GLfloat color[3], vector<GLfloat>& vertices, vector<GLuint>& indices)
+{
+	GLuint firstVertex = (GLuint)(vertices.size() / 6);
 
-	// Plane Transforms
-	glm::vec3 brickRectangleCapPlanePositions[] = {
-		glm::vec3(3.0f,  4.25f,  -1.5f), // back 0
-		glm::vec3(3.0f,  4.25f,  1.5f), // front 1
-	};
+	GLuint top = AddMeshVertex(vertices, firstVertex, glm::vec3(0.0f, radius, 0.0f), color);
+	for (GLuint stack = 1; stack < stacks; stack++)
+	{
+		GLfloat polar = (GLfloat)PI * stack / stacks;
+		for (GLuint slice = 0; slice < slices; slice++)
+		{
+			GLfloat azimuth = 2.0f * (GLfloat)PI * slice / slices;
+			AddMeshVertex(vertices, firstVertex, radius * glm::vec3(sinf(polar) * cosf(azimuth), cosf(polar), sinf(polar) * sinf(azimuth)), color);
+		}
+	}
+	GLuint bottom = AddMeshVertex(vertices, firstVertex, glm::vec3(0.0f, -radius, 0.0f), color);
 
-	glm::float32 brickRectangleCapPlaneRotations[] = {
-		0.0f, 0.0f		// back, front respectively
-	};
+	// Rings start at 1 and hold one vertex per slice
+	for (GLuint slice = 0; slice < slices; slice++)
+	{
+		GLuint next = (slice + 1) % slices;
+		GLuint cap[6] = { top, 1 + next, 1 + slice, bottom, 1 + (stacks - 2) * slices + slice, 1 + (stacks - 2) * slices + next };
+		indices.insert(indices.end(), cap, cap + 6);
+		for (GLuint ring = 0; ring + 2 < stacks; ring++)
+		{
+			GLuint upper = 1 + ring * slices, lower = upper + slices;
+			GLuint quad[6] = { upper + slice, upper + next, lower + slice, upper + next, lower + next, lower + slice };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+}
 
-	// Plane Transforms
-	glm::vec3 shelfRectangleCapPlanePositions[] = {
-		// Horizontal
-		//Bottom shelf
-		glm::vec3(-5.0f, 0.5f,  0.0f), // left 0
-		glm::vec3(5.0f,  0.5f,  0.0f), // right 1
-
-		glm::vec3(-5.0f, 3.5f,  0.0f), // left 2
-		glm::vec3(5.0f,  3.5f,  0.0f), // right 3
-
-		glm::vec3(-5.0f, 6.5f,  0.0f), // left 4
-		glm::vec3(5.0f,  6.5f,  0.0f), // right 5
-		//	Top shelf
-		glm::vec3(-5.0f, 9.5f,  0.0f), // left 6
-		glm::vec3(5.0f,  9.5f,  0.0f), // right 7
-
-		// Vertical
-		// Leftmost
-		glm::vec3(-4.5f, 10.0f,  0.0f), // top	8
-		glm::vec3(-4.5f,  0.0f,  0.0f), // Bottom 9
-
-		glm::vec3(-1.5f, 10.0f,  0.0f), // top 10
-		glm::vec3(-1.5f,  0.0f,  0.0f), // bottom 11
-
-		glm::vec3(1.5f, 10.0f,  0.0f), // top 12
-		glm::vec3(1.5f,  0.0f,  0.0f), // bottom 13
-		// Rightmost
-		glm::vec3(4.5f, 10.0f,  0.0f), // top 14
-		glm::vec3(4.5f,  0.0f,  0.0f) // bottom 15
-	};
+/* Procedural Mesh Definitions End Here */
 
-	glm::float32 shelfRectangleCapPlaneRotations[] = {
-		90.0f, 90.0f, // Bottom shelf
-		90.0f, 90.0f,
-		90.0f, 90.0f, 
-		90.0f, 90.0f, // Top shelf
-
-		//Pillars
-		90.0f, 90.0f, // Leftmost pillar
-		90.0f, 90.0f,
-		90.0f, 90.0f,
-		90.0f, 90.0f  // Rightmost pillar
-	};
+/* Vertex Format Definitions */
 
-	// Plane Transforms
-	glm::vec3 shelfRectanglePlanePositions[] = {
-		// Horizontal
-		// Bottom shelf
-		glm::vec3(0.0f,  0.5f,  1.0f), // front 0
-		glm::vec3(0.0f,  0.5f,  -1.0f), // back 1
-		glm::vec3(0.0f,  0.75f,  0.0f), // top 2
-		glm::vec3(0.0f,  0.25f,  0.0f), // bottom 3
-
-		glm::vec3(0.0f,  3.5f,  1.0f), // front 4
-		glm::vec3(0.0f,  3.5f,  -1.0f), // back 5
-		glm::vec3(0.0f,  3.75f,  0.0f), // top 6
-		glm::vec3(0.0f,  3.25f,  0.0f), // bottom 7
-
-		glm::vec3(0.0f,  6.5f,  1.0f), // front 8
-		glm::vec3(0.0f,  6.5f,  -1.0f), // back 9
-		glm::vec3(0.0f,  6.75f,  0.0f), // top 10
-		glm::vec3(0.0f,  6.25f,  0.0f), // bottom 11
-		// Top shelf
-		glm::vec3(0.0f,  9.5f,  1.0f), // front 12
-		glm::vec3(0.0f,  9.5f,  -1.0f), // back 13
-		glm::vec3(0.0f,  9.75f,  0.0f), // top 14
-		glm::vec3(0.0f,  9.25f,  0.0f), // bottom 15
-
-		// Vertical
-		// Left Pillar
-		glm::vec3(-4.5f,  5.0f,  1.0f), // front 16
-		glm::vec3(-4.5f,  5.0f,  -1.0f), // back 17
-		glm::vec3(-4.75f,  5.0f,  0.0f), // left 18
-		glm::vec3(-4.25f,  5.0f,  0.0f), // right 19
-
-		glm::vec3(-1.5f,  5.0f,  1.0f), // front 20
-		glm::vec3(-1.5f,  5.0f,  -1.0f), // back 21
-		glm::vec3(-1.75f,  5.0f,  0.0f), // left 22
-		glm::vec3(-1.25f,  5.0f,  0.0f), // right 23
-
-		glm::vec3(1.5f,  5.0f,  1.0f), // front 24
-		glm::vec3(1.5f,  5.0f,  -1.0f), // back 25
-		glm::vec3(1.75f,  5.0f,  0.0f), // left 26
-		glm::vec3(1.25f,  5.0f,  0.0f), // right 27
-
-		glm::vec3(4.5f,  5.0f,  1.0f), // front 28
-		glm::vec3(4.5f,  5.0f,  -1.0f), // back 29
-		glm::vec3(4.75f,  5.0f,  0.0f), // left 30
-		glm::vec3(4.25f,  5.0f,  0.0f) // right 31
-	};
+// Vertex layouts are described once as types, e.g. VertexFormat<Position<int16_t, 3, true>,
+// Color<uint8_t, 4, true>>. The type computes offsets and stride at compile time (every attribute
+// starts on a 4-byte boundary) and generates the attribute descriptors, the vertex shader inputs and
+// typed stores that refuse data of the wrong component type or count.
 
-	glm::float32 shelfRectanglePlaneRotations[] = {
-		// Horizontal
-		0.0f, 0.0f, 90.0f, 90.0f, // Bottom shelf
-		0.0f, 0.0f, 90.0f, 90.0f, 
-		0.0f, 0.0f, 90.0f, 90.0f, 
-		0.0f, 0.0f, 90.0f, 90.0f,	// Top shelf
-		
-		// Vertical
-		90.0f, 90.0f, 90.0f, 90.0f,	// leftmost pillar
-		90.0f, 90.0f, 90.0f, 90.0f,
-		90.0f, 90.0f, 90.0f, 90.0f,
-		90.0f, 90.0f, 90.0f, 90.0f	// rightmost pillar
+// One interleaved vertex attribute, fed to glVertexAttribPointer as-is and stored in scene files
+struct SceneVertexAttribute
+{
+	GLuint location;
+	GLuint components;
+	GLenum type;
+	GLuint normalized;
+	GLuint offset;				// Bytes from the start of the vertex
+};
+
+// Bytes an attribute occupies in a vertex, 0 for a component type this program does not read
+GLuint VertexAttributeBytes(const SceneVertexAttribute& attribute)
+{
+	if (attribute.type == GL_FLOAT)
+		return attribute.components * 4;
+	if (attribute.type == GL_HALF_FLOAT || attribute.type == GL_SHORT)
+		return attribute.components * 2;
+	if (attribute.type == GL_UNSIGNED_BYTE || attribute.type == GL_BYTE)
+		return attribute.components;
+	return 0;
+}
 
-	};
+// IEEE 754 binary16 conversions, rounding to nearest
+uint16_t FloatToHalf(GLfloat value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+	int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+	uint32_t mantissa = bits & 0x7FFFFF;
+
+	if (exponent >= 31)		// Too large (or inf/nan)
+		return sign | 0x7C00;
+	if (exponent <= 0)		// Subnormal or zero
+	{
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		uint32_t shift = (uint32_t)(14 - exponent);
+		return sign | (uint16_t)((mantissa + (1u << (shift - 1))) >> shift);
+	}
+	return sign | (uint16_t)(((uint32_t)exponent << 10) + ((mantissa + 0x1000) >> 13));	// Carry may round up the exponent
+}
 
-	glm::float32 toiletPaperCylinderVertices[] = {
+GLfloat HalfToFloat(uint16_t half)
+{
+	GLfloat sign = (half & 0x8000) ? -1.0f : 1.0f;
+	int exponent = (half >> 10) & 0x1F;
+	int mantissa = half & 0x3FF;
+	if (exponent == 0)
+		return sign * ldexpf((GLfloat)mantissa, -24);
+	if (exponent == 31)
+		return sign * FLT_MAX;
+	return sign * ldexpf((GLfloat)(mantissa | 0x400), exponent - 25);
+}
 
-		// positon attributes (x,y,z)
-		0.0f, 0.0f, 0.0f,  // vert 1
-		0.0f, 0.0f, 0.0f, // black
+// Storage type of a GL_HALF_FLOAT component
+struct HalfFloat
+{
+	uint16_t bits;
+};
+
+template <typename Component> struct GLComponentType;
+template <> struct GLComponentType<GLfloat> { static const GLenum value = GL_FLOAT; };
+template <> struct GLComponentType<HalfFloat> { static const GLenum value = GL_HALF_FLOAT; };
+template <> struct GLComponentType<int16_t> { static const GLenum value = GL_SHORT; };
+template <> struct GLComponentType<uint8_t> { static const GLenum value = GL_UNSIGNED_BYTE; };
+template <> struct GLComponentType<int8_t> { static const GLenum value = GL_BYTE; };
+
+// What an attribute means to the shaders: its location and input name
+struct PositionRole
+{
+	static const GLuint location = 0;
+	static const char* Name() { return "vPosition"; }
+};
 
-		0.5f, 0.866f, 0.0f, // vert 2
-		1.0f, 1.0f, 1.0f, // white
+struct ColorRole
+{
+	static const GLuint location = 1;
+	static const char* Name() { return "aColor"; }
+};
 
-		1.0f, 0.0f, 0.0f, // vert 3
-		1.0f, 1.0f, 1.0f, // white
+// After the instance matrix columns at 2 to 5
+struct NormalRole
+{
+	static const GLuint location = 6;
+	static const char* Name() { return "aNormal"; }
+};
 
-		0.5f, 0.866f, 0.0f, // vert 4
-		1.0f, 1.0f, 1.0f, // white
+template <typename AttributeRole, typename ComponentType, GLuint Components, bool Normalized = false>
+struct VertexAttribute
+{
+	static_assert(Components >= 1 && Components <= 4, "vertex attributes have 1 to 4 components");
+	static_assert(!Normalized || is_integral<ComponentType>::value, "only integer components can be normalized");
+	typedef AttributeRole Role;
+	typedef ComponentType Component;
+	static const GLuint components = Components;
+	static const GLuint bytes = sizeof(ComponentType) * Components;
+	static const bool normalized = Normalized;
+	static const GLenum type = GLComponentType<ComponentType>::value;
+};
+
+template <typename Component, GLuint Components, bool Normalized = false>
+using Position = VertexAttribute<PositionRole, Component, Components, Normalized>;
+
+template <typename Component, GLuint Components, bool Normalized = false>
+using Color = VertexAttribute<ColorRole, Component, Components, Normalized>;
+
+template <typename Component, GLuint Components, bool Normalized = false>
+using Normal = VertexAttribute<NormalRole, Component, Components, Normalized>;
+
+// Offset of attribute index in a vertex made of Attributes; index == count gives the stride
+template <typename... Attributes>
+constexpr GLuint VertexAttributeOffset(GLuint index)
+{
+	const GLuint bytes[] = { 0, Attributes::bytes... };
+	GLuint offset = 0;
+	for (GLuint i = 1; i <= index; i++)
+		offset = (offset + bytes[i] + 3) / 4 * 4;
+	return offset;
+}
 
-		0.5f, 0.866f, -2.0f, // vert 5
-		1.0f, 1.0f, 1.0f, // white
+template <GLuint Index, typename Attribute>
+struct FoundVertexAttribute
+{
+	static const GLuint index = Index;
+	typedef Attribute type;
+};
 
-		1.0f, 0.0f, 0.0f, // vert 6
-		1.0f, 1.0f, 1.0f, // white
+// The attribute of Attributes playing Role, and its index
+template <typename Role, GLuint Index, typename... Attributes>
+struct FindVertexAttribute
+{
+	static_assert(sizeof(Role) == 0, "the vertex format has no attribute with this role");
+};
 
-		1.0f, 0.0f, 0.0f, // vert 7
-		1.0f, 1.0f, 1.0f, // white
+template <typename Role, GLuint Index, typename First, typename... Rest>
+struct FindVertexAttribute<Role, Index, First, Rest...>
+	: conditional<is_same<Role, typename First::Role>::value, FoundVertexAttribute<Index, First>, FindVertexAttribute<Role, Index + 1, Rest...>>::type
+{
+};
 
-		1.0f, 0.0f, -2.0f, // vert 8
-		1.0f, 1.0f, 1.0f, // white
+template <typename... Attributes>
+struct VertexFormat
+{
+	static const GLuint attributeCount = sizeof...(Attributes);
+	static const GLuint stride = VertexAttributeOffset<Attributes...>(sizeof...(Attributes));
 
-		0.5f, 0.866f, -2.0f, // vert 9
-		1.0f, 1.0f, 1.0f // white
-	};
+	template <typename Role>
+	using AttributeOf = typename FindVertexAttribute<Role, 0, Attributes...>::type;
 
-	glm::float32 triangleIndices[] = {
-		0,1,2
-	};
+	template <typename Role>
+	static constexpr GLuint OffsetOf()
+	{
+		return VertexAttributeOffset<Attributes...>(FindVertexAttribute<Role, 0, Attributes...>::index);
+	}
 
-	glm::float32 toiletPaperCylinderRotations[] = {
-		0.0f, 60.0f, 120.0f, 180.0f, 240.0f, 300.0f		// Counterclockwise
-	};
+	// Descriptors for glVertexAttribPointer and the scene file
+	static void Describe(SceneVertexAttribute* attributes)
+	{
+		const SceneVertexAttribute described[] = { { Attributes::Role::location, Attributes::components, Attributes::type, Attributes::normalized ? 1u : 0u, 0 }... };
+		for (GLuint i = 0; i < attributeCount; i++)
+		{
+			attributes[i] = described[i];
+			attributes[i].offset = VertexAttributeOffset<Attributes...>(i);
+		}
+	}
 
-	glm::vec3 toiletPaperCylinderPositions[] = {		// left middle shelf
-		glm::vec3(-3.0f,  4.65f,  1.0f),
-		glm::vec3(-3.0f,  4.65f,  1.0f),
-		glm::vec3(-3.0f,  4.65f,  1.0f),
-		glm::vec3(-3.0f,  4.65f,  1.0f),
-		glm::vec3(-3.0f,  4.65f,  1.0f),
-		glm::vec3(-3.0f,  4.65f,  1.0f),
-	};
+	// Vertex shader input declarations. Inputs are always vec4: GL converts or normalizes the stored
+	// components on fetch and fills missing ones from (0, 0, 0, 1).
+	static string ShaderInputs()
+	{
+		const GLuint locations[] = { Attributes::Role::location... };
+		const char* names[] = { Attributes::Role::Name()... };
+		string inputs;
+		for (GLuint i = 0; i < attributeCount; i++)
+			inputs += "layout(location = " + to_string(locations[i]) + ") in vec4 " + names[i] + ";";
+		return inputs;
+	}
 
-	glm::float32 tennisBallSphereVertices[] = {	// counterclockwise around (0,0)
+	// Copy one attribute's stored components into a vertex; they must match the format exactly
+	template <typename Role, typename Component, GLuint Components>
+	static void Store(unsigned char* vertex, const Component (&values)[Components])
+	{
+		typedef AttributeOf<Role> Attribute;
+		static_assert(is_same<Component, typename Attribute::Component>::value, "component type does not match the vertex format");
+		static_assert(Components == Attribute::components, "component count does not match the vertex format");
+		memcpy(vertex + OffsetOf<Role>(), values, sizeof(values));
+	}
+};
+
+// The layouts scene files can use (see SceneVertexFormat). All of them have the same roles at the
+// same locations, so one set of shader inputs serves every scene.
+typedef VertexFormat<Position<GLfloat, 3>, Color<GLfloat, 3>, Normal<GLfloat, 3>> FloatVertexFormat;
+typedef VertexFormat<Position<int16_t, 3, true>, Color<uint8_t, 4, true>, Normal<int8_t, 4, true>> Snorm16VertexFormat;
+typedef VertexFormat<Position<HalfFloat, 3>, Color<uint8_t, 4, true>, Normal<int8_t, 4, true>> HalfVertexFormat;
+static_assert(FloatVertexFormat::stride == 36, "float vertices are 36 bytes");
+static_assert(Snorm16VertexFormat::stride == 16 && HalfVertexFormat::stride == 16, "compact vertices are 16 bytes");
+
+// Float to stored component: integer storage is normalized to [-1, 1] or [0, 1]
+inline void StoreComponent(GLfloat value, GLfloat& stored) { stored = value; }
+inline void StoreComponent(GLfloat value, HalfFloat& stored) { stored.bits = FloatToHalf(value); }
+inline void StoreComponent(GLfloat value, int16_t& stored) { stored = (int16_t)lroundf(glm::clamp(value, -1.0f, 1.0f) * 32767.0f); }
+inline void StoreComponent(GLfloat value, uint8_t& stored) { stored = (uint8_t)lroundf(glm::clamp(value, 0.0f, 1.0f) * 255.0f); }
+inline void StoreComponent(GLfloat value, int8_t& stored) { stored = (int8_t)lroundf(glm::clamp(value, -1.0f, 1.0f) * 127.0f); }
+
+/* Vertex Format Definitions End Here */
+
+/* Scene File Definitions */
+
+// Binary scene container (.scnb). Every section starts on a 16-byte boundary so the mapped file
+// can be read in place and its vertex and index blobs handed straight to glBufferData.
+const GLuint SCENE_FILE_MAGIC = 0x424E4353;	// "SCNB"
+const GLuint SCENE_FILE_VERSION = 8;		// Also bumped when converted geometry changes, so stale files are converted again
+const GLuint SCENE_NAME_LENGTH = 32;
+const GLuint SCENE_PATH_LENGTH = 128;
+const GLuint SCENE_NO_TEXTURE = 0xFFFFFFFF;
+const GLfloat SCENE_GRID_SPACING = 16.0f;	// Floor width plus a gap, for --grid copies
+
+struct SceneFileHeader
+{
+	GLuint magic;
+	GLuint version;
+	GLuint attributeCount;
+	GLuint vertexStride;		// Bytes per interleaved vertex
+	GLuint meshCount;
+	GLuint instanceCount;
+	GLuint vertexCount;
+	GLuint indexCount;
+	GLuint nodeCount;
+	GLuint textureCount;
+	GLuint lightCount;
+	GLuint gridSize;			// Conversion options, reused when a stale file is converted again
+	GLuint vertexFormat;		// SceneVertexFormat
+	GLuint unused;
+	uint64_t attributeOffset;	// SceneVertexAttribute[attributeCount]
+	uint64_t meshOffset;		// SceneMeshRecord[meshCount]
+	uint64_t nodeOffset;		// SceneNodeRecord[nodeCount], depth first
+	uint64_t instanceOffset;	// SceneInstanceRecord[instanceCount], grouped by mesh
+	uint64_t vertexOffset;		// vertexCount * vertexStride bytes
+	uint64_t indexOffset;		// GLuint[indexCount]
+	uint64_t textureOffset;		// SceneTextureRecord[textureCount]
+	uint64_t lightOffset;		// SceneLightRecord[lightCount]
+};
+
+// Procedural meshes store every detail level as consecutive records sharing one name
+struct SceneMeshRecord
+{
+	char name[SCENE_NAME_LENGTH];
+	GLuint firstIndex;
+	GLuint indexCount;
+	GLint baseVertex;
+	GLuint vertexCount;
+	GLuint lodLevel;			// 0 is the finest
+	GLuint lodCount;			// Levels from this record on, coarsest last
+	GLfloat positionScale[3];	// Stored position * scale + bias gives the model-space position
+	GLfloat positionBias[3];
+	GLuint texture;				// SCENE_NO_TEXTURE, or a SceneTextureRecord
+	GLfloat uvPlanes[2][4];		// Planar mapping: u and v are dot(plane, model-space position with w = 1)
+};
+
+// Image file a mesh samples, relative to the scene file
+struct SceneTextureRecord
+{
+	char path[SCENE_PATH_LENGTH];
+};
 
-		// positon attributes (x,y,z)	
-		0.0f, 0.0f, 0.3f, // vert 1
-		1.0f, 0.55f, 0.0f, // orange
+// Vertex layouts the converter can write. The compact ones store positions normalized to the
+// mesh's bounds and colors and normals as normalized bytes: 16 bytes per vertex instead of 36.
+enum SceneVertexFormat
+{
+	VERTEX_FORMAT_FLOAT,		// 3 x float position, 3 x float color, 3 x float normal
+	VERTEX_FORMAT_SNORM16,		// 3 x GL_SHORT normalized position, 4 x GL_UNSIGNED_BYTE normalized color, 4 x GL_BYTE normalized normal
+	VERTEX_FORMAT_HALF			// 3 x GL_HALF_FLOAT position, 4 x GL_UNSIGNED_BYTE normalized color, 4 x GL_BYTE normalized normal
+};
 
-		1.0f, 0.0f, 0.0f, // vert 2
-		1.0f, 0.55f, 0.0f, // orange
+// Scene graph node; its placement is relative to the parent
+struct SceneNodeRecord
+{
+	char name[SCENE_NAME_LENGTH];
+	GLuint parent;				// Earlier node, or SCENE_NO_NODE
+	GLfloat position[3];
+	GLfloat rotation[3];		// Degrees, applied Y, Z, X
+	GLfloat scale[3];
+};
+
+// Placement of one mesh, relative to its node, with its world matrix baked so loading needs no trig
+struct SceneInstanceRecord
+{
+	GLuint mesh;
+	GLuint node;				// SCENE_NO_NODE when placed in world space
+	GLfloat position[3];
+	GLfloat rotation[3];		// Degrees, applied Y, Z, X
+	GLfloat scale[3];
+	GLfloat worldMatrix[16];
+};
+
+// Point light, relative to its node like an instance
+struct SceneLightRecord
+{
+	GLuint node;				// SCENE_NO_NODE when placed in world space
+	GLfloat position[3];
+	GLfloat radius;				// No light reaches past this distance
+	GLfloat color[3];			// Linear, may exceed 1 for bright lights
+};
+
+// Read-only view of a whole file mapped into memory
+struct MappedFile
+{
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+};
+
+// Pointers into a mapped scene file
+struct SceneFile
+{
+	MappedFile mapping;
+	const SceneFileHeader* header = nullptr;
+	const SceneVertexAttribute* attributes = nullptr;
+	const SceneMeshRecord* meshes = nullptr;
+	const SceneNodeRecord* nodes = nullptr;
+	const SceneInstanceRecord* instances = nullptr;
+	const unsigned char* vertices = nullptr;
+	const GLuint* indices = nullptr;
+	const SceneTextureRecord* textures = nullptr;
+	const SceneLightRecord* lights = nullptr;
+	string directory;			// Texture paths are relative to it
+};
+
+bool MapFile(const string& path, MappedFile& file)
+{
+#ifdef _WIN32
+	file.file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file.file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	GetFileSizeEx(file.file, &size);
+	file.size = (size_t)size.QuadPart;
+	file.mapping = CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (file.mapping != NULL)
+		file.data = (const unsigned char*)MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+	if (file.data == nullptr)
+	{
+		if (file.mapping != NULL)
+			CloseHandle(file.mapping);
+		CloseHandle(file.file);
+		file.mapping = NULL;
+		file.file = INVALID_HANDLE_VALUE;
+		return false;
+	}
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+	void* data = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps the file alive
+	if (data == MAP_FAILED)
+		return false;
+	file.data = (const unsigned char*)data;
+	file.size = (size_t)info.st_size;
+#endif
+	return true;
+}
 
-		0.5f, 0.866f, 0.0f, // vert 3
-		1.0f, 0.6f, 0.0f, // orange
-//          ----------------
-		0.0f, 0.0f, 0.3f, // vert 4
-		1.0f, 0.55f, 0.0f, // orange
+void UnmapFile(MappedFile& file)
+{
+	if (file.data == nullptr)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(file.data);
+	CloseHandle(file.mapping);
+	CloseHandle(file.file);
+	file.mapping = NULL;
+	file.file = INVALID_HANDLE_VALUE;
+#else
+	munmap((void*)file.data, file.size);
+#endif
+	file.data = nullptr;
+	file.size = 0;
+}
 
-		0.5f, 0.866f, 0.0f, // vert 5
-		1.0f, 0.65f, 0.0f, // orange
+// Last time a file was written, 0 when it does not exist. Only useful for comparing two files.
+int64_t FileModifiedTime(const string& path)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &info))
+		return 0;
+	return ((int64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+	// Nanoseconds, so an edit in the same second as a conversion still counts
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return 0;
+#ifdef __APPLE__
+	return (int64_t)info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+	return (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+}
 
-		-0.5f, 0.866f, 0.0f, // vert 6
-		1.0f, 0.65f, 0.0f, // orange
-//          ----------------
-		0.0f, 0.0f, 0.3f, // vert 7
-		1.0f, 0.55f, 0.0f, // orange
+// True when [offset, offset + bytes) lies inside the mapping
+static bool SceneSectionFits(const MappedFile& file, uint64_t offset, uint64_t bytes)
+{
+	return offset <= file.size && bytes <= file.size - offset;
+}
 
-		-0.5f, 0.866f, 0.0f, // vert 8
-		1.0f, 0.65f, 0.0f, // orange
+// Map a .scnb file and point into its sections; nothing is parsed or copied
+bool OpenSceneFile(const string& path, SceneFile& scene)
+{
+	if (!MapFile(path, scene.mapping))
+		return false;
+
+	const MappedFile& file = scene.mapping;
+	const SceneFileHeader* header = (const SceneFileHeader*)file.data;
+	bool valid = file.size >= sizeof(SceneFileHeader) && header->magic == SCENE_FILE_MAGIC && header->version == SCENE_FILE_VERSION;
+	valid = valid && SceneSectionFits(file, header->attributeOffset, (uint64_t)header->attributeCount * sizeof(SceneVertexAttribute));
+	valid = valid && SceneSectionFits(file, header->meshOffset, (uint64_t)header->meshCount * sizeof(SceneMeshRecord));
+	valid = valid && SceneSectionFits(file, header->nodeOffset, (uint64_t)header->nodeCount * sizeof(SceneNodeRecord));
+	valid = valid && SceneSectionFits(file, header->instanceOffset, (uint64_t)header->instanceCount * sizeof(SceneInstanceRecord));
+	valid = valid && SceneSectionFits(file, header->vertexOffset, (uint64_t)header->vertexCount * header->vertexStride);
+	valid = valid && SceneSectionFits(file, header->indexOffset, (uint64_t)header->indexCount * sizeof(GLuint));
+	valid = valid && SceneSectionFits(file, header->textureOffset, (uint64_t)header->textureCount * sizeof(SceneTextureRecord));
+	valid = valid && SceneSectionFits(file, header->lightOffset, (uint64_t)header->lightCount * sizeof(SceneLightRecord));
+	if (!valid)
+	{
+		cout << "Scene Error: " << path << " is not a version " << SCENE_FILE_VERSION << " scene file" << endl;
+		UnmapFile(scene.mapping);
+		return false;
+	}
 
-		-1.0f, -0.0f, 0.0f, // vert 9
-		1.0f, 0.65f, 0.0f, // orange
-//          ----------------
-		0.0f, 0.0f, 0.3f,  // vert 10
-		1.0f, 0.62f, 0.0f, // orange
+	scene.header = header;
+	scene.attributes = (const SceneVertexAttribute*)(file.data + header->attributeOffset);
+	scene.meshes = (const SceneMeshRecord*)(file.data + header->meshOffset);
+	scene.nodes = (const SceneNodeRecord*)(file.data + header->nodeOffset);
+	scene.instances = (const SceneInstanceRecord*)(file.data + header->instanceOffset);
+	scene.vertices = file.data + header->vertexOffset;
+	scene.indices = (const GLuint*)(file.data + header->indexOffset);
+	scene.textures = (const SceneTextureRecord*)(file.data + header->textureOffset);
+	scene.lights = (const SceneLightRecord*)(file.data + header->lightOffset);
+	size_t slash = path.find_last_of("/\\");
+	scene.directory = slash == string::npos ? string() : path.substr(0, slash + 1);
+
+	for (GLuint i = 0; i < header->meshCount; i++)
+	{
+		const SceneMeshRecord& mesh = scene.meshes[i];
+		if ((uint64_t)mesh.firstIndex + mesh.indexCount > header->indexCount || mesh.baseVertex < 0 || (uint64_t)mesh.baseVertex + mesh.vertexCount > header->vertexCount
+			|| mesh.lodCount == 0 || (uint64_t)i + mesh.lodCount > header->meshCount || (mesh.texture != SCENE_NO_TEXTURE && mesh.texture >= header->textureCount))
+		{
+			cout << "Scene Error: mesh " << i << " in " << path << " is out of range" << endl;
+			UnmapFile(scene.mapping);
+			return false;
+		}
 
-		-1.0f, -0.0f, 0.0f, // vert 11
-		1.0f, 0.65f, 0.0f, // orange
+		// Indices are relative to the mesh's first vertex; CPU readers follow them without checks
+		for (GLuint index = mesh.firstIndex; index < mesh.firstIndex + mesh.indexCount; index++)
+			if (scene.indices[index] >= mesh.vertexCount)
+			{
+				cout << "Scene Error: mesh " << i << " in " << path << " indexes past its " << mesh.vertexCount << " vertices" << endl;
+				UnmapFile(scene.mapping);
+				return false;
+			}
+	}
+	for (GLuint i = 0; i < header->attributeCount; i++)
+	{
+		// Attributes must lie inside the vertex, on the 4-byte boundaries GL expects
+		const SceneVertexAttribute& attribute = scene.attributes[i];
+		GLuint bytes = VertexAttributeBytes(attribute);
+		if (bytes == 0 || attribute.components > 4 || attribute.offset % 4 != 0 || attribute.offset + bytes > header->vertexStride)
+		{
+			cout << "Scene Error: vertex attribute " << i << " in " << path << " does not fit its vertex" << endl;
+			UnmapFile(scene.mapping);
+			return false;
+		}
+	}
+	for (GLuint i = 0; i < header->textureCount; i++)
+	{
+		if (memchr(scene.textures[i].path, 0, SCENE_PATH_LENGTH) == nullptr)
+		{
+			cout << "Scene Error: texture " << i << " in " << path << " has an unterminated path" << endl;
+			UnmapFile(scene.mapping);
+			return false;
+		}
+	}
+	for (GLuint i = 0; i < header->lightCount; i++)
+	{
+		if ((scene.lights[i].node != SCENE_NO_NODE && scene.lights[i].node >= header->nodeCount) || !(scene.lights[i].radius > 0.0f))
+		{
+			cout << "Scene Error: light " << i << " in " << path << " is out of range" << endl;
+			UnmapFile(scene.mapping);
+			return false;
+		}
+	}
+	for (GLuint i = 0; i < header->nodeCount; i++)
+	{
+		if (scene.nodes[i].parent != SCENE_NO_NODE && scene.nodes[i].parent >= i)
+		{
+			cout << "Scene Error: node " << i << " in " << path << " comes before its parent" << endl;
+			UnmapFile(scene.mapping);
+			return false;
+		}
+	}
+	for (GLuint i = 0; i < header->instanceCount; i++)
+	{
+		if (scene.instances[i].mesh >= header->meshCount || (scene.instances[i].node != SCENE_NO_NODE && scene.instances[i].node >= header->nodeCount))
+		{
+			cout << "Scene Error: instance " << i << " in " << path << " uses a missing mesh or node" << endl;
+			UnmapFile(scene.mapping);
+			return false;
+		}
+	}
+	return true;
+}
+
+void CloseSceneFile(SceneFile& scene)
+{
+	UnmapFile(scene.mapping);
+	scene.header = nullptr;
+}
+
+// Pad a file section to the next 16-byte boundary
+static void PadSceneSection(ofstream& out)
+{
+	static const char zeros[16] = {};
+	streamoff position = out.tellp();
+	if (position % 16 != 0)
+		out.write(zeros, 16 - position % 16);
+}
+
+// Smooth vertex normals of one mesh: the area-weighted sum of the faces around each vertex.
+// Vertices no triangle uses point along +z.
+static void ComputeMeshNormals(const GLfloat* vertices, const GLuint* indices, const SceneMeshRecord& mesh, vector<glm::vec3>& normals)
+{
+	normals.assign(mesh.vertexCount, glm::vec3(0.0f));
+	for (GLuint i = 0; i + 2 < mesh.indexCount; i += 3)
+	{
+		const GLuint* triangle = indices + mesh.firstIndex + i;
+		glm::vec3 corners[3];
+		for (GLuint corner = 0; corner < 3; corner++)
+			corners[corner] = glm::vec3(vertices[triangle[corner] * 6], vertices[triangle[corner] * 6 + 1], vertices[triangle[corner] * 6 + 2]);
+		glm::vec3 face = glm::cross(corners[1] - corners[0], corners[2] - corners[0]); // Length is twice the area
+		for (GLuint corner = 0; corner < 3; corner++)
+			normals[triangle[corner]] += face;
+	}
+	for (GLuint v = 0; v < mesh.vertexCount; v++)
+		normals[v] = glm::length(normals[v]) > 0.0f ? glm::normalize(normals[v]) : glm::vec3(0.0f, 0.0f, 1.0f);
+}
+
+// Pack parsed position + color floats (6 per vertex) into Format, adding normals derived from the
+// triangles. Positions stored in anything but float are normalized to each mesh's bounds; the mesh
+// records get the matching dequantization.
+template <typename Format>
+GLuint PackVertices(const vector<GLfloat>& vertices, const vector<GLuint>& indices, vector<SceneMeshRecord>& meshes, SceneVertexAttribute* attributes, vector<unsigned char>& packed)
+{
+	typedef typename Format::template AttributeOf<PositionRole> PositionAttribute;
+	typedef typename Format::template AttributeOf<ColorRole> ColorAttribute;
+	typedef typename Format::template AttributeOf<NormalRole> NormalAttribute;
+	typedef typename PositionAttribute::Component PositionComponent;
+	typedef typename ColorAttribute::Component ColorComponent;
+	typedef typename NormalAttribute::Component NormalComponent;
+	static_assert(Format::attributeCount == 3, "scene files store a position, a color and a normal");
+	static_assert(PositionAttribute::components == 3 && ColorAttribute::components >= 3 && NormalAttribute::components >= 3, "scene vertices have xyz, rgb and a normal");
+	static_assert(!is_integral<NormalComponent>::value || NormalAttribute::normalized, "integer normals must be normalized");
+	static_assert(!is_integral<PositionComponent>::value || PositionAttribute::normalized, "integer positions must be normalized");
+	static_assert(!is_integral<ColorComponent>::value || ColorAttribute::normalized, "integer colors must be normalized");
+	const bool quantized = !is_same<PositionComponent, GLfloat>::value;
+
+	Format::Describe(attributes);
+	packed.assign(vertices.size() / 6 * Format::stride, 0);
+	vector<glm::vec3> normals;
+	for (size_t i = 0; i < meshes.size(); i++)
+	{
+		SceneMeshRecord& mesh = meshes[i];
+		const GLfloat* first = &vertices[(size_t)mesh.baseVertex * 6];
+		ComputeMeshNormals(first, indices.data(), mesh, normals);
+
+		// Map the mesh's bounds onto [-1, 1] on every axis
+		glm::vec3 boundsMin = glm::vec3(FLT_MAX), boundsMax = glm::vec3(-FLT_MAX);
+		for (GLuint v = 0; v < mesh.vertexCount; v++)
+		{
+			glm::vec3 position = glm::vec3(first[v * 6], first[v * 6 + 1], first[v * 6 + 2]);
+			boundsMin = glm::min(boundsMin, position);
+			boundsMax = glm::max(boundsMax, position);
+		}
+		if (mesh.vertexCount == 0)
+			boundsMin = boundsMax = glm::vec3(0.0f);
+		for (GLuint axis = 0; axis < 3; axis++)
+		{
+			mesh.positionScale[axis] = quantized ? (boundsMax[axis] - boundsMin[axis]) * 0.5f : 1.0f;
+			mesh.positionBias[axis] = quantized ? (boundsMax[axis] + boundsMin[axis]) * 0.5f : 0.0f;
+		}
+
+		for (GLuint v = 0; v < mesh.vertexCount; v++)
+		{
+			PositionComponent position[3];
+			for (GLuint axis = 0; axis < 3; axis++)
+			{
+				GLfloat value = first[v * 6 + axis];
+				if (quantized)
+					value = mesh.positionScale[axis] > 0.0f ? glm::clamp((value - mesh.positionBias[axis]) / mesh.positionScale[axis], -1.0f, 1.0f) : 0.0f;
+				StoreComponent(value, position[axis]);
+			}
+			ColorComponent color[ColorAttribute::components];
+			for (GLuint channel = 0; channel < ColorAttribute::components; channel++)
+				StoreComponent(channel < 3 ? first[v * 6 + 3 + channel] : 1.0f, color[channel]);
+			NormalComponent normal[NormalAttribute::components];
+			for (GLuint axis = 0; axis < NormalAttribute::components; axis++)
+				StoreComponent(axis < 3 ? normals[v][axis] : 0.0f, normal[axis]);
+
+			unsigned char* out = &packed[((size_t)mesh.baseVertex + v) * Format::stride];
+			Format::template Store<PositionRole>(out, position);
+			Format::template Store<ColorRole>(out, color);
+			Format::template Store<NormalRole>(out, normal);
+		}
+	}
+	return Format::stride;
+}
+
+// Pack into the layout picked at conversion time, returns the vertex stride
+GLuint PackSceneVertices(const vector<GLfloat>& vertices, const vector<GLuint>& indices, vector<SceneMeshRecord>& meshes, SceneVertexFormat format, SceneVertexAttribute attributes[3], vector<unsigned char>& packed)
+{
+	if (format == VERTEX_FORMAT_SNORM16)
+		return PackVertices<Snorm16VertexFormat>(vertices, indices, meshes, attributes, packed);
+	if (format == VERTEX_FORMAT_HALF)
+		return PackVertices<HalfVertexFormat>(vertices, indices, meshes, attributes, packed);
+	return PackVertices<FloatVertexFormat>(vertices, indices, meshes, attributes, packed);
+}
+
+static GLuint FindSceneNodeRecord(const vector<SceneNodeRecord>& nodes, const string& name)
+{
+	for (GLuint i = 0; i < (GLuint)nodes.size(); i++)
+		if (name == nodes[i].name)
+			return i;
+	return SCENE_NO_NODE;
+}
+
+// Convert a human-editable .scene description into a .scnb container
+bool ConvertSceneText(const string& textPath, const string& binaryPath, GLuint gridSize = 1, SceneVertexFormat format = VERTEX_FORMAT_FLOAT)
+{
+	ifstream in(textPath);
+	if (!in)
+	{
+		cout << "Scene Error: cannot open " << textPath << endl;
+		return false;
+	}
+
+	vector<SceneMeshRecord> meshes;
+	vector<SceneNodeRecord> nodes;
+	vector<glm::mat4> nodeWorld;	// Baked into the instances below them
+	vector<SceneInstanceRecord> instances;
+	vector<SceneTextureRecord> textures;
+	vector<SceneLightRecord> lights;
+	vector<GLfloat> textureRepeats;		// Per mesh record: model-space length one copy of its image covers, 0 for its extent
+	vector<GLfloat> vertices;
+	vector<GLuint> indices;
+	bool inMesh = false;
+	GLuint meshVertexCount = 0, meshIndexCount = 0;
+
+	string line;
+	for (GLuint lineNumber = 1; getline(in, line); lineNumber++)
+	{
+		size_t comment = line.find('#');
+		if (comment != string::npos)
+			line.erase(comment);
+
+		istringstream fields(line);
+		string keyword;
+		if (!(fields >> keyword))
+			continue;
+
+		bool ok = true;
+		if (keyword == "mesh" && !inMesh)
+		{
+			string name;
+			ok = (fields >> name) && name.size() < SCENE_NAME_LENGTH;
+			SceneMeshRecord mesh = {};
+			strncpy(mesh.name, name.c_str(), SCENE_NAME_LENGTH - 1);
+			mesh.firstIndex = (GLuint)indices.size();
+			mesh.baseVertex = (GLint)(vertices.size() / 6);
+			mesh.lodCount = 1;
+			mesh.texture = SCENE_NO_TEXTURE;
+			meshes.push_back(mesh);
+			meshVertexCount = meshIndexCount = 0;
+			inMesh = true;
+		}
+		else if ((keyword == "cylinder" || keyword == "sphere") && !inMesh)
+		{
+			bool cylinder = keyword == "cylinder";
+			string name;
+			GLfloat radius = 0.0f, length = 0.0f, color[3], capColor[3];
+			ok = (fields >> name) && name.size() < SCENE_NAME_LENGTH && (fields >> radius) && (!cylinder || (fields >> length));
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> color[i]);
+			for (GLuint i = 0; i < 3 && ok && cylinder; i++)
+				ok = (bool)(fields >> capColor[i]);
+
+			// Every detail level becomes its own mesh record, finest first
+			for (GLuint level = 0; level < PROCEDURAL_LOD_LEVELS && ok; level++)
+			{
+				SceneMeshRecord mesh = {};
+				strncpy(mesh.name, name.c_str(), SCENE_NAME_LENGTH - 1);
+				mesh.firstIndex = (GLuint)indices.size();
+				mesh.baseVertex = (GLint)(vertices.size() / 6);
+				if (cylinder)
+					GenerateCylinder(radius, length, CYLINDER_SEGMENTS[level], color, capColor, vertices, indices);
+				else
+					GenerateSphere(radius, SPHERE_SLICES[level], SPHERE_STACKS[level], color, vertices, indices);
+				mesh.vertexCount = (GLuint)(vertices.size() / 6) - mesh.baseVertex;
+				mesh.indexCount = (GLuint)indices.size() - mesh.firstIndex;
+				mesh.lodLevel = level;
+				mesh.lodCount = PROCEDURAL_LOD_LEVELS - level;
+				mesh.texture = SCENE_NO_TEXTURE;
+				meshes.push_back(mesh);
+			}
+		}
+		else if (keyword == "v" && inMesh)
+		{
+			GLfloat values[6];
+			for (GLuint i = 0; i < 6 && ok; i++)
+				ok = (bool)(fields >> values[i]);
+			vertices.insert(vertices.end(), values, values + 6);
+			meshVertexCount++;
+		}
+		else if (keyword == "i" && inMesh)
+		{
+			GLuint index;
+			while (fields >> index)
+			{
+				indices.push_back(index);
+				meshIndexCount++;
+			}
+			ok = fields.eof();
+		}
+		else if (keyword == "end" && inMesh)
+		{
+			SceneMeshRecord& mesh = meshes.back();
+			mesh.vertexCount = meshVertexCount;
+			if (meshIndexCount == 0) // Drawn in vertex order
+			{
+				for (GLuint i = 0; i < meshVertexCount; i++)
+					indices.push_back(i);
+				meshIndexCount = meshVertexCount;
+			}
+			mesh.indexCount = meshIndexCount;
+			for (GLuint i = mesh.firstIndex; i < mesh.firstIndex + mesh.indexCount && ok; i++)
+				ok = indices[i] < meshVertexCount;
+			inMesh = false;
+		}
+		else if (keyword == "texture" && !inMesh)
+		{
+			// Every detail level of the mesh samples the image; meshes naming the same file share it
+			string name, image;
+			GLfloat repeat = 0.0f;
+			ok = (bool)(fields >> name >> image) && image.size() < SCENE_PATH_LENGTH;
+			if (ok && !(fields >> repeat))
+				repeat = 0.0f;
+			ok = ok && repeat >= 0.0f;
+			GLuint texture = 0;
+			while (texture < textures.size() && image != textures[texture].path)
+				texture++;
+			if (ok && texture == textures.size())
+			{
+				SceneTextureRecord record = {};
+				strncpy(record.path, image.c_str(), SCENE_PATH_LENGTH - 1);
+				textures.push_back(record);
+			}
+			bool found = false;
+			textureRepeats.resize(meshes.size(), 0.0f);
+			for (GLuint i = 0; i < meshes.size() && ok; i++)
+				if (name == meshes[i].name)
+				{
+					meshes[i].texture = texture;
+					textureRepeats[i] = repeat;
+					found = true;
+				}
+			ok = ok && found;
+		}
+		else if (keyword == "node" && !inMesh)
+		{
+			string name, parentName;
+			SceneNodeRecord node = {};
+			ok = (fields >> name >> parentName) && name.size() < SCENE_NAME_LENGTH && FindSceneNodeRecord(nodes, name) == SCENE_NO_NODE;
+			strncpy(node.name, name.c_str(), SCENE_NAME_LENGTH - 1);
+			node.parent = parentName == "-" ? SCENE_NO_NODE : FindSceneNodeRecord(nodes, parentName);
+			ok = ok && (parentName == "-" || node.parent != SCENE_NO_NODE);
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> node.position[i]);
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> node.rotation[i]);
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> node.scale[i]);
+
+			if (ok)
+			{
+				glm::mat4 local = ComposeTransform(glm::vec3(node.position[0], node.position[1], node.position[2]),
+					glm::vec3(node.rotation[0], node.rotation[1], node.rotation[2]), glm::vec3(node.scale[0], node.scale[1], node.scale[2]));
+				nodeWorld.push_back(node.parent == SCENE_NO_NODE ? local : nodeWorld[node.parent] * local);
+				nodes.push_back(node);
+			}
+		}
+		else if (keyword == "light" && !inMesh)
+		{
+			SceneLightRecord light = {};
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> light.position[i]);
+			ok = ok && (fields >> light.radius) && light.radius > 0.0f;
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> light.color[i]);
+			string nodeName;
+			light.node = SCENE_NO_NODE;
+			if (ok && fields >> nodeName)
+			{
+				light.node = FindSceneNodeRecord(nodes, nodeName);
+				ok = light.node != SCENE_NO_NODE;
+			}
+			lights.push_back(light);
+		}
+		else if (keyword == "instance" && !inMesh)
+		{
+			string name;
+			SceneInstanceRecord instance = {};
+			ok = (bool)(fields >> name);
+			instance.mesh = (GLuint)meshes.size();
+			for (GLuint i = 0; i < meshes.size() && instance.mesh == meshes.size(); i++)
+				if (name == meshes[i].name && meshes[i].lodLevel == 0)
+					instance.mesh = i;
+			ok = ok && instance.mesh < meshes.size();
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> instance.position[i]);
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> instance.rotation[i]);
+			for (GLuint i = 0; i < 3 && ok; i++)
+				ok = (bool)(fields >> instance.scale[i]);
+			string nodeName;
+			instance.node = SCENE_NO_NODE;
+			if (ok && fields >> nodeName)
+			{
+				instance.node = FindSceneNodeRecord(nodes, nodeName);
+				ok = instance.node != SCENE_NO_NODE;
+			}
+
+			glm::mat4 worldMatrix = ComposeTransform(glm::vec3(instance.position[0], instance.position[1], instance.position[2]),
+				glm::vec3(instance.rotation[0], instance.rotation[1], instance.rotation[2]),
+				glm::vec3(instance.scale[0], instance.scale[1], instance.scale[2]));
+			if (ok && instance.node != SCENE_NO_NODE)
+				worldMatrix = nodeWorld[instance.node] * worldMatrix;
+			memcpy(instance.worldMatrix, glm::value_ptr(worldMatrix), sizeof(instance.worldMatrix));
+			instances.push_back(instance);
+		}
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			cout << "Scene Error: " << textPath << ":" << lineNumber << ": cannot read '" << keyword << "' line" << endl;
+			return false;
+		}
+	}
+	if (inMesh)
+	{
+		cout << "Scene Error: " << textPath << ": mesh " << meshes.back().name << " has no 'end'" << endl;
+		return false;
+	}
+
+	// Nodes may be declared in any order that puts parents first; store them depth first so every
+	// subtree is a contiguous range
+	vector<GLuint> depthFirst, newIndex(nodes.size());
+	for (GLuint root = 0; root < (GLuint)nodes.size(); root++)
+	{
+		if (nodes[root].parent != SCENE_NO_NODE)
+			continue;
+		vector<GLuint> pending(1, root);
+		while (!pending.empty())
+		{
+			GLuint node = pending.back();
+			pending.pop_back();
+			newIndex[node] = (GLuint)depthFirst.size();
+			depthFirst.push_back(node);
+			for (GLuint child = (GLuint)nodes.size(); child-- > node + 1;) // Reversed so children pop in file order
+				if (nodes[child].parent == node)
+					pending.push_back(child);
+		}
+	}
+	vector<SceneNodeRecord> sortedNodes;
+	for (size_t i = 0; i < depthFirst.size(); i++)
+	{
+		SceneNodeRecord node = nodes[depthFirst[i]];
+		node.parent = node.parent == SCENE_NO_NODE ? SCENE_NO_NODE : newIndex[node.parent];
+		sortedNodes.push_back(node);
+	}
+	nodes.swap(sortedNodes);
+	for (size_t i = 0; i < instances.size(); i++)
+		if (instances[i].node != SCENE_NO_NODE)
+			instances[i].node = newIndex[instances[i].node];
+	for (size_t i = 0; i < lights.size(); i++)
+		if (lights[i].node != SCENE_NO_NODE)
+			lights[i].node = newIndex[lights[i].node];
+
+	// Stress scenes: repeat every node and placement on a gridSize x gridSize grid, one floor apart.
+	// Only roots move; everything below them follows.
+	size_t sourceInstances = instances.size(), sourceNodes = nodes.size(), sourceLights = lights.size();
+	for (GLuint row = 0; row < gridSize; row++)
+		for (GLuint column = 0; column < gridSize; column++)
+		{
+			if (row == 0 && column == 0)
+				continue;
+			GLfloat offsetX = column * SCENE_GRID_SPACING, offsetZ = -(GLfloat)row * SCENE_GRID_SPACING;
+			GLuint firstNode = (GLuint)nodes.size();
+			for (size_t i = 0; i < sourceNodes; i++)
+			{
+				SceneNodeRecord node = nodes[i];
+				if (node.parent == SCENE_NO_NODE)
+				{
+					node.position[0] += offsetX;
+					node.position[2] += offsetZ;
+				}
+				else
+					node.parent += firstNode;
+				nodes.push_back(node);
+			}
+			for (size_t i = 0; i < sourceInstances; i++)
+			{
+				SceneInstanceRecord instance = instances[i];
+				if (instance.node == SCENE_NO_NODE)
+				{
+					instance.position[0] += offsetX;
+					instance.position[2] += offsetZ;
+				}
+				else
+					instance.node += firstNode;
+				instance.worldMatrix[12] += offsetX;
+				instance.worldMatrix[14] += offsetZ;
+				instances.push_back(instance);
+			}
+			for (size_t i = 0; i < sourceLights; i++)
+			{
+				SceneLightRecord light = lights[i];
+				if (light.node == SCENE_NO_NODE)
+				{
+					light.position[0] += offsetX;
+					light.position[2] += offsetZ;
+				}
+				else
+					light.node += firstNode;
+				lights.push_back(light);
+			}
+		}
+
+	// Project each textured mesh's image onto the plane of its two longest sides
+	textureRepeats.resize(meshes.size(), 0.0f);
+	for (size_t i = 0; i < meshes.size(); i++)
+	{
+		SceneMeshRecord& mesh = meshes[i];
+		if (mesh.texture == SCENE_NO_TEXTURE || mesh.vertexCount == 0)
+			continue;
+		glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+		for (GLuint vertex = mesh.baseVertex; vertex < mesh.baseVertex + mesh.vertexCount; vertex++)
+		{
+			glm::vec3 position(vertices[vertex * 6], vertices[vertex * 6 + 1], vertices[vertex * 6 + 2]);
+			boundsMin = glm::min(boundsMin, position);
+			boundsMax = glm::max(boundsMax, position);
+		}
+		glm::vec3 extent = boundsMax - boundsMin;
+		GLuint axes[3] = { 0, 1, 2 };
+		stable_sort(axes, axes + 3, [&](GLuint a, GLuint b) { return extent[a] > extent[b]; });
+		GLfloat repeat = textureRepeats[i] > 0.0f ? textureRepeats[i] : max(extent[axes[0]], 1e-6f);
+		for (GLuint plane = 0; plane < 2; plane++)
+		{
+			GLuint axis = axes[plane];
+			memset(mesh.uvPlanes[plane], 0, sizeof(mesh.uvPlanes[plane]));
+			mesh.uvPlanes[plane][axis] = 1.0f / repeat;
+			mesh.uvPlanes[plane][3] = -boundsMin[axis] / repeat;
+		}
+	}
+
+	// Group instances by mesh so each mesh's placements are one contiguous draw batch
+	stable_sort(instances.begin(), instances.end(), [](const SceneInstanceRecord& a, const SceneInstanceRecord& b) { return a.mesh < b.mesh; });
+
+	// Interleaved position, color and normal in the requested layout
+	SceneVertexAttribute attributes[3];
+	vector<unsigned char> packedVertices;
+	GLuint vertexStride = PackSceneVertices(vertices, indices, meshes, format, attributes, packedVertices);
+
+	SceneFileHeader header = {};
+	header.magic = SCENE_FILE_MAGIC;
+	header.version = SCENE_FILE_VERSION;
+	header.attributeCount = 3;
+	header.vertexStride = vertexStride;
+	header.meshCount = (GLuint)meshes.size();
+	header.nodeCount = (GLuint)nodes.size();
+	header.textureCount = (GLuint)textures.size();
+	header.lightCount = (GLuint)lights.size();
+	header.gridSize = gridSize;
+	header.vertexFormat = format;
+	header.instanceCount = (GLuint)instances.size();
+	header.vertexCount = (GLuint)(vertices.size() / 6);
+	header.indexCount = (GLuint)indices.size();
+
+	ofstream out(binaryPath, ios::binary | ios::trunc);
+	if (!out)
+	{
+		cout << "Scene Error: cannot write " << binaryPath << endl;
+		return false;
+	}
+
+	out.write((const char*)&header, sizeof(header)); // Rewritten once the offsets are known
+	PadSceneSection(out);
+	header.attributeOffset = (uint64_t)out.tellp();
+	out.write((const char*)attributes, sizeof(attributes));
+	PadSceneSection(out);
+	header.meshOffset = (uint64_t)out.tellp();
+	out.write((const char*)meshes.data(), meshes.size() * sizeof(SceneMeshRecord));
+	PadSceneSection(out);
+	header.nodeOffset = (uint64_t)out.tellp();
+	out.write((const char*)nodes.data(), nodes.size() * sizeof(SceneNodeRecord));
+	PadSceneSection(out);
+	header.instanceOffset = (uint64_t)out.tellp();
+	out.write((const char*)instances.data(), instances.size() * sizeof(SceneInstanceRecord));
+	PadSceneSection(out);
+	header.vertexOffset = (uint64_t)out.tellp();
+	out.write((const char*)packedVertices.data(), packedVertices.size());
+	PadSceneSection(out);
+	header.indexOffset = (uint64_t)out.tellp();
+	out.write((const char*)indices.data(), indices.size() * sizeof(GLuint));
+	PadSceneSection(out);
+	header.textureOffset = (uint64_t)out.tellp();
+	out.write((const char*)textures.data(), textures.size() * sizeof(SceneTextureRecord));
+	PadSceneSection(out);
+	header.lightOffset = (uint64_t)out.tellp();
+	out.write((const char*)lights.data(), lights.size() * sizeof(SceneLightRecord));
+	out.seekp(0);
+	out.write((const char*)&header, sizeof(header));
+
+	if (!out)
+	{
+		cout << "Scene Error: failed writing " << binaryPath << endl;
+		return false;
+	}
+
+	cout << "Converted " << textPath << " -> " << binaryPath << ": " << header.meshCount << " meshes, "
+		<< header.vertexCount << " vertices (" << header.vertexStride << " bytes each), " << header.nodeCount << " nodes, " << header.instanceCount << " instances, " << header.textureCount << " textures, " << header.lightCount << " lights" << endl;
+	return true;
+}
+
+// Map a scene, converting its .scene text source first when the binary is missing or older than it.
+// A stale binary is converted again with the --grid and --vertex-format options it was made with.
+bool LoadSceneFile(const string& binaryPath, SceneFile& scene)
+{
+	string textPath = binaryPath;
+	size_t extension = textPath.rfind(".scnb");
+	if (extension == string::npos)
+		return OpenSceneFile(binaryPath, scene);
+	textPath.replace(extension, string::npos, ".scene");
+
+	// A missing source never makes the binary stale
+	bool stale = FileModifiedTime(textPath) > FileModifiedTime(binaryPath);
+	GLuint gridSize = 1;
+	SceneVertexFormat format = VERTEX_FORMAT_FLOAT;
+	if (OpenSceneFile(binaryPath, scene))
+	{
+		if (!stale)
+			return true;
+		gridSize = max(scene.header->gridSize, 1u);
+		if (scene.header->vertexFormat <= VERTEX_FORMAT_HALF)
+			format = (SceneVertexFormat)scene.header->vertexFormat;
+		CloseSceneFile(scene);
+	}
+
+	ifstream source(textPath);
+	if (!source)
+	{
+		cout << "Scene Error: cannot open " << binaryPath << endl;
+		return false;
+	}
+	source.close();
+
+	return ConvertSceneText(textPath, binaryPath, gridSize, format) && OpenSceneFile(binaryPath, scene);
+}
+
+// Copy a scene's placements into the transform store, using the baked world matrices
+void LoadSceneTransforms(TransformStore& store, const SceneFile& scene)
+{
+	for (GLuint i = 0; i < scene.header->instanceCount; i++)
+	{
+		const SceneInstanceRecord& instance = scene.instances[i];
+		GLuint id = AddTransform(store, glm::vec3(instance.position[0], instance.position[1], instance.position[2]),
+			glm::vec3(instance.rotation[0], instance.rotation[1], instance.rotation[2]),
+			glm::vec3(instance.scale[0], instance.scale[1], instance.scale[2]));
+		// The baked matrix is already current
+		memcpy(glm::value_ptr(store.worldMatrices[id]), instance.worldMatrix, sizeof(instance.worldMatrix));
+		store.dirty[id] = false;
+		store.changed[id] = true;
+	}
+	store.anyDirty = false;
+}
+
+// Rebuild a scene's node hierarchy and hang its placements from their nodes
+void LoadSceneGraph(SceneGraph& graph, const SceneFile& scene)
+{
+	for (GLuint i = 0; i < scene.header->nodeCount; i++)
+	{
+		const SceneNodeRecord& node = scene.nodes[i];
+		AddSceneNode(graph, node.name, node.parent, glm::vec3(node.position[0], node.position[1], node.position[2]),
+			glm::vec3(node.rotation[0], node.rotation[1], node.rotation[2]), glm::vec3(node.scale[0], node.scale[1], node.scale[2]));
+	}
+	graph.objectNode.resize(scene.header->instanceCount);
+	for (GLuint i = 0; i < scene.header->instanceCount; i++)
+		graph.objectNode[i] = scene.instances[i].node;
+	FinishSceneGraph(graph);
+}
+
+/* Scene File Definitions End Here */
+
+/* GPU Resource Definitions */
+
+// Every GL object the scene owns sits in a move-only handle that deletes it when the handle is
+// released or destroyed. Live objects are recorded in gpuResources with a label, usage hint and
+// storage size. That gives a memory report per category, a leak check at shutdown and an optional
+// budget that storage may not grow past.
+enum GpuResourceKind
+{
+	GPU_BUFFER,
+	GPU_VERTEX_ARRAY,
+	GPU_PROGRAM,
+	GPU_TEXTURE,
+	GPU_RENDERBUFFER,
+	GPU_FRAMEBUFFER,
+	GPU_RESOURCE_KIND_COUNT
+};
+
+const char* const GPU_RESOURCE_KIND_NAMES[GPU_RESOURCE_KIND_COUNT] = { "buffers", "vertex arrays", "programs", "textures", "renderbuffers", "framebuffers" };
+const GLenum GPU_RESOURCE_IDENTIFIERS[GPU_RESOURCE_KIND_COUNT] = { GL_BUFFER, GL_VERTEX_ARRAY, GL_PROGRAM, GL_TEXTURE, GL_RENDERBUFFER, GL_FRAMEBUFFER };
+
+struct GpuResourceRecord
+{
+	string label;
+	GLenum usage = 0;			// Buffer usage hint, GL_MAP_PERSISTENT_BIT for persistent storage, 0 otherwise
+	GLsizeiptr bytes = 0;		// Storage held; programs count their binary when the driver reports it
+	bool labeled = false;		// glObjectLabel needs the object to exist, which for most kinds is after the first bind
+};
+
+struct GpuResourceRegistry
+{
+	map<uint64_t, GpuResourceRecord> records;	// Keyed by kind << 32 | name
+	GLuint liveCount[GPU_RESOURCE_KIND_COUNT] = {};
+	GLsizeiptr liveBytes[GPU_RESOURCE_KIND_COUNT] = {};
+	GLsizeiptr totalBytes = 0;
+	GLsizeiptr peakBytes = 0;
+	GLsizeiptr budgetBytes = 0;					// 0 means no budget
+	bool budgetReported = false;				// Per-frame growth past the budget is reported once
+};
+
+GpuResourceRegistry gpuResources;
+bool gpuReportObjects = false;		// List every live object after InitScene, not just the totals
+
+template <GpuResourceKind Kind>
+struct GpuObject;
+
+template <GpuResourceKind Kind>
+void ReleaseGpuObject(GpuObject<Kind>& object);
+
+// Owns one GL object name. Converts to GLuint so binds and draws take it as they took the raw name.
+template <GpuResourceKind Kind>
+struct GpuObject
+{
+	GLuint name = 0;
+
+	GpuObject() = default;
+	GpuObject(const GpuObject&) = delete;
+	GpuObject& operator=(const GpuObject&) = delete;
+	GpuObject(GpuObject&& other) noexcept : name(other.name) { other.name = 0; }
+	GpuObject& operator=(GpuObject&& other) noexcept
+	{
+		if (this != &other)
+		{
+			ReleaseGpuObject(*this);
+			name = other.name;
+			other.name = 0;
+		}
+		return *this;
+	}
+	~GpuObject() { ReleaseGpuObject(*this); }
+	operator GLuint() const { return name; }
+};
+
+typedef GpuObject<GPU_BUFFER> GpuBuffer;
+typedef GpuObject<GPU_VERTEX_ARRAY> GpuVertexArray;
+typedef GpuObject<GPU_PROGRAM> GpuProgram;
+typedef GpuObject<GPU_TEXTURE> GpuTexture;
+typedef GpuObject<GPU_RENDERBUFFER> GpuRenderbuffer;
+typedef GpuObject<GPU_FRAMEBUFFER> GpuFramebuffer;
+
+uint64_t GpuResourceKey(GpuResourceKind kind, GLuint name)
+{
+	return (uint64_t)kind << 32 | name;
+}
+
+string FormatGpuBytes(GLsizeiptr bytes)
+{
+	ostringstream text;
+	text << fixed << setprecision(1);
+	if (bytes >= 1024 * 1024)
+		text << bytes / (1024.0 * 1024.0) << " MB";
+	else if (bytes >= 1024)
+		text << bytes / 1024.0 << " KB";
+	else
+		text << setprecision(0) << (double)bytes << " B";
+	return text.str();
+}
+
+// Attach the registered label for graphics debuggers; a no-op before GL 4.3
+void LabelGpuObject(GpuResourceKind kind, GLuint name)
+{
+	map<uint64_t, GpuResourceRecord>::iterator record = gpuResources.records.find(GpuResourceKey(kind, name));
+	if (record == gpuResources.records.end() || record->second.labeled || !GLEW_VERSION_4_3)
+		return;
+	glObjectLabel(GPU_RESOURCE_IDENTIFIERS[kind], name, -1, record->second.label.c_str());
+	record->second.labeled = true;
+}
+
+template <GpuResourceKind Kind>
+void LabelGpuObject(const GpuObject<Kind>& object)
+{
+	LabelGpuObject(Kind, object.name);
+}
+
+// True when live storage can grow by extraBytes without passing the budget
+bool FitsGpuBudget(GLsizeiptr extraBytes)
+{
+	return gpuResources.budgetBytes == 0 || extraBytes <= 0 || gpuResources.totalBytes + extraBytes <= gpuResources.budgetBytes;
+}
+
+// Record the storage an object now holds. Growth past the budget is refused (returning false with the
+// record unchanged) unless enforceBudget is off, as for per-frame buffers that cannot skip a frame.
+bool TrackGpuObjectBytes(GpuResourceKind kind, GLuint name, GLsizeiptr bytes, GLenum usage, bool enforceBudget = true)
+{
+	map<uint64_t, GpuResourceRecord>::iterator found = gpuResources.records.find(GpuResourceKey(kind, name));
+	if (found == gpuResources.records.end())
+		return true;
+	GpuResourceRecord& record = found->second;
+
+	GLsizeiptr growth = bytes - record.bytes;
+	if (!FitsGpuBudget(growth))
+	{
+		if (enforceBudget)
+		{
+			cout << "GPU Budget Error: " << record.label << " needs " << FormatGpuBytes(bytes) << " with " << FormatGpuBytes(gpuResources.totalBytes)
+				<< " of the " << FormatGpuBytes(gpuResources.budgetBytes) << " budget already live" << endl;
+			return false;
+		}
+		if (!gpuResources.budgetReported)
+			cout << "GPU Budget Error: " << record.label << " grew live memory to " << FormatGpuBytes(gpuResources.totalBytes + growth)
+				<< ", past the " << FormatGpuBytes(gpuResources.budgetBytes) << " budget" << endl;
+		gpuResources.budgetReported = true;
+	}
+
+	record.bytes = bytes;
+	record.usage = usage;
+	gpuResources.liveBytes[kind] += growth;
+	gpuResources.totalBytes += growth;
+	gpuResources.peakBytes = max(gpuResources.peakBytes, gpuResources.totalBytes);
+	LabelGpuObject(kind, name);
+	return true;
+}
+
+// glBufferData on the buffer bound to target, tracked against the budget
+bool GpuBufferData(const GpuBuffer& buffer, GLenum target, GLsizeiptr bytes, const void* data, GLenum usage, bool enforceBudget = true)
+{
+	if (!TrackGpuObjectBytes(GPU_BUFFER, buffer.name, bytes, usage, enforceBudget))
+		return false;
+	glBufferData(target, bytes, data, usage);
+	return true;
+}
+
+// Take ownership of a name some other code created, such as a linked program
+template <GpuResourceKind Kind>
+void AdoptGpuObject(GpuObject<Kind>& object, GLuint name, const string& label)
+{
+	ReleaseGpuObject(object);
+	object.name = name;
+	if (name == 0)
+		return;
+	GpuResourceRecord record;
+	record.label = label;
+	gpuResources.records[GpuResourceKey(Kind, name)] = record;
+	gpuResources.liveCount[Kind]++;
+
+	// A linked program exists already; its binary is the nearest thing to a size the GL exposes
+	if (Kind == GPU_PROGRAM && glIsProgram(name))
+	{
+		GLint binaryBytes = 0;
+		if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+			glGetProgramiv(name, GL_PROGRAM_BINARY_LENGTH, &binaryBytes);
+		TrackGpuObjectBytes(Kind, name, binaryBytes, 0, false);
+	}
+}
+
+template <GpuResourceKind Kind>
+void CreateGpuObject(GpuObject<Kind>& object, const string& label)
+{
+	GLuint name = 0;
+	switch (Kind)
+	{
+	case GPU_BUFFER: glGenBuffers(1, &name); break;
+	case GPU_VERTEX_ARRAY: glGenVertexArrays(1, &name); break;
+	case GPU_PROGRAM: name = glCreateProgram(); break;
+	case GPU_TEXTURE: glGenTextures(1, &name); break;
+	case GPU_RENDERBUFFER: glGenRenderbuffers(1, &name); break;
+	default: glGenFramebuffers(1, &name); break;
+	}
+	AdoptGpuObject(object, name, label);
+}
+
+template <GpuResourceKind Kind>
+void ReleaseGpuObject(GpuObject<Kind>& object)
+{
+	if (object.name == 0)
+		return;
+	map<uint64_t, GpuResourceRecord>::iterator record = gpuResources.records.find(GpuResourceKey(Kind, object.name));
+	if (record != gpuResources.records.end())
+	{
+		gpuResources.liveBytes[Kind] -= record->second.bytes;
+		gpuResources.totalBytes -= record->second.bytes;
+		gpuResources.liveCount[Kind]--;
+		gpuResources.records.erase(record);
+	}
+
+	switch (Kind)
+	{
+	case GPU_BUFFER: glDeleteBuffers(1, &object.name); break;
+	case GPU_VERTEX_ARRAY: glDeleteVertexArrays(1, &object.name); break;
+	case GPU_PROGRAM: glDeleteProgram(object.name); break;
+	case GPU_TEXTURE: glDeleteTextures(1, &object.name); break;
+	case GPU_RENDERBUFFER: glDeleteRenderbuffers(1, &object.name); break;
+	default: glDeleteFramebuffers(1, &object.name); break;
+	}
+	object.name = 0;
+}
+
+const char* GpuUsageName(GLenum usage)
+{
+	switch (usage)
+	{
+	case GL_STATIC_DRAW: return "static";
+	case GL_DYNAMIC_DRAW: return "dynamic";
+	case GL_STREAM_DRAW: return "stream";
+	case GL_MAP_PERSISTENT_BIT: return "persistent";
+	default: return "-";
+	}
+}
+
+// Live memory per category, optionally followed by every object
+void PrintGpuMemoryReport(bool listObjects)
+{
+	cout << "GPU memory: " << FormatGpuBytes(gpuResources.totalBytes) << " live, " << FormatGpuBytes(gpuResources.peakBytes) << " peak";
+	if (gpuResources.budgetBytes > 0)
+		cout << ", " << FormatGpuBytes(gpuResources.budgetBytes) << " budget";
+	cout << endl;
+	for (GLuint kind = 0; kind < GPU_RESOURCE_KIND_COUNT; kind++)
+		if (gpuResources.liveCount[kind] > 0)
+			cout << "  " << left << setw(14) << GPU_RESOURCE_KIND_NAMES[kind] << right << setw(4) << gpuResources.liveCount[kind] << "  "
+				<< FormatGpuBytes(gpuResources.liveBytes[kind]) << endl;
+	if (!listObjects)
+		return;
+
+	for (map<uint64_t, GpuResourceRecord>::const_iterator i = gpuResources.records.begin(); i != gpuResources.records.end(); ++i)
+		cout << "    " << left << setw(14) << GPU_RESOURCE_KIND_NAMES[i->first >> 32] << right << setw(5) << (GLuint)i->first << "  "
+			<< left << setw(28) << i->second.label << setw(11) << GpuUsageName(i->second.usage) << right << FormatGpuBytes(i->second.bytes) << endl;
+}
+
+// Report every object still registered once its owner should have released it; returns how many
+GLuint ReportGpuLeaks()
+{
+	for (map<uint64_t, GpuResourceRecord>::const_iterator i = gpuResources.records.begin(); i != gpuResources.records.end(); ++i)
+		cout << "GPU Leak: " << GPU_RESOURCE_KIND_NAMES[i->first >> 32] << " " << (GLuint)i->first << " '" << i->second.label << "' holding "
+			<< FormatGpuBytes(i->second.bytes) << endl;
+	return (GLuint)gpuResources.records.size();
+}
+
+/* GPU Resource Definitions End Here */
+
+/* Geometry Arena Definitions */
+
+// Where a mesh lives inside the shared vertex and index buffers
+struct MeshRange
+{
+	GLuint firstIndex;
+	GLuint indexCount;
+	GLint baseVertex;
+	glm::vec3 boundsMin, boundsMax;	// Local-space box around the vertices the mesh draws
+	GLuint lodCount;				// Coarser levels follow this mesh in the arena
+	glm::vec3 positionScale;		// Dequantizes the stored positions in the vertex shader
+	glm::vec3 positionBias;
+	GLint textureLayer;				// Layer of the scene texture array, -1 for vertex colors only
+	glm::vec4 uvPlanes[2];			// Model-space position to texture coordinates
+};
+
+// Every mesh in one vertex buffer and one index buffer behind a single VAO. The vertex and
+// index data point into the mapped scene file until they are uploaded.
+struct GeometryArena
+{
+	GpuVertexArray vao;
+	GpuBuffer vbo, ebo;
+	const void* vertexData = nullptr;
+	size_t vertexBytes = 0;
+	const GLuint* indexData = nullptr;
+	size_t indexCount = 0;
+	GLuint vertexStride = 0;
+	vector<SceneVertexAttribute> attributes;
+	vector<MeshRange> meshes;
+	vector<string> meshNames;
+};
+
+GeometryArena sceneGeometry;
+
+// Stored value of one vertex attribute in the arena's CPU-side data, converted the way GL's vertex
+// fetch would. Missing components read as (0, 0, 0, 1).
+glm::vec4 ReadVertexAttribute(const GeometryArena& arena, GLuint vertex, GLuint location)
+{
+	glm::vec4 value = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	for (size_t i = 0; i < arena.attributes.size(); i++)
+	{
+		const SceneVertexAttribute& attribute = arena.attributes[i];
+		if (attribute.location != location)
+			continue;
+
+		const char* data = (const char*)arena.vertexData + (size_t)vertex * arena.vertexStride + attribute.offset;
+		for (GLuint axis = 0; axis < attribute.components && axis < 4; axis++)
+		{
+			if (attribute.type == GL_FLOAT)
+				memcpy(&value[axis], data + axis * sizeof(GLfloat), sizeof(GLfloat));
+			else if (attribute.type == GL_UNSIGNED_BYTE)
+			{
+				unsigned char stored = (unsigned char)data[axis];
+				value[axis] = attribute.normalized ? stored / 255.0f : (GLfloat)stored;
+			}
+			else if (attribute.type == GL_BYTE)
+			{
+				signed char stored = (signed char)data[axis];
+				value[axis] = attribute.normalized ? glm::max(stored / 127.0f, -1.0f) : (GLfloat)stored;
+			}
+			else
+			{
+				uint16_t stored;
+				memcpy(&stored, data + axis * sizeof(uint16_t), sizeof(stored));
+				if (attribute.type == GL_HALF_FLOAT)
+					value[axis] = HalfToFloat(stored);
+				else if (attribute.type == GL_SHORT)
+					value[axis] = attribute.normalized ? glm::max((GLfloat)(int16_t)stored / 32767.0f, -1.0f) : (GLfloat)(int16_t)stored;
+			}
+		}
+		break;
+	}
+	return value;
+}
+
+// Stored (still quantized) position of a vertex (attribute location 0)
+glm::vec3 ReadVertexPosition(const GeometryArena& arena, GLuint vertex)
+{
+	return glm::vec3(ReadVertexAttribute(arena, vertex, 0));
+}
+
+// Point the arena at a mapped scene's vertex layout, meshes and buffers
+void AttachSceneGeometry(GeometryArena& arena, const SceneFile& scene)
+{
+	const SceneFileHeader& header = *scene.header;
+	arena.vertexData = scene.vertices;
+	arena.vertexBytes = (size_t)header.vertexCount * header.vertexStride;
+	arena.indexData = scene.indices;
+	arena.indexCount = header.indexCount;
+	arena.vertexStride = header.vertexStride;
+	arena.attributes.assign(scene.attributes, scene.attributes + header.attributeCount);
+
+	for (GLuint i = 0; i < header.meshCount; i++)
+	{
+		MeshRange mesh;
+		mesh.firstIndex = scene.meshes[i].firstIndex;
+		mesh.indexCount = scene.meshes[i].indexCount;
+		mesh.baseVertex = scene.meshes[i].baseVertex;
+		mesh.lodCount = scene.meshes[i].lodCount;
+		mesh.positionScale = glm::vec3(scene.meshes[i].positionScale[0], scene.meshes[i].positionScale[1], scene.meshes[i].positionScale[2]);
+		mesh.positionBias = glm::vec3(scene.meshes[i].positionBias[0], scene.meshes[i].positionBias[1], scene.meshes[i].positionBias[2]);
+		mesh.textureLayer = scene.meshes[i].texture == SCENE_NO_TEXTURE ? -1 : (GLint)scene.meshes[i].texture;
+		for (GLuint plane = 0; plane < 2; plane++)
+		{
+			const GLfloat* uvPlane = scene.meshes[i].uvPlanes[plane];
+			mesh.uvPlanes[plane] = glm::vec4(uvPlane[0], uvPlane[1], uvPlane[2], uvPlane[3]);
+		}
+		mesh.boundsMin = glm::vec3(FLT_MAX);
+		mesh.boundsMax = glm::vec3(-FLT_MAX);
+		for (GLuint index = mesh.firstIndex; index < mesh.firstIndex + mesh.indexCount; index++)
+		{
+			glm::vec3 position = ReadVertexPosition(arena, mesh.baseVertex + arena.indexData[index]) * mesh.positionScale + mesh.positionBias;
+			mesh.boundsMin = glm::min(mesh.boundsMin, position);
+			mesh.boundsMax = glm::max(mesh.boundsMax, position);
+		}
+		if (mesh.indexCount == 0)
+			mesh.boundsMin = mesh.boundsMax = glm::vec3(0.0f);
+		arena.meshes.push_back(mesh);
+		arena.meshNames.push_back(scene.meshes[i].name);
+	}
+}
+
+// Create the arena's buffers and the one VAO used by every draw. Attribute pointers follow the
+// scene's layout descriptors; the transform buffer feeds the per-instance model matrix at
+// locations 2-5. Fails when the buffers do not fit the GPU memory budget.
+bool UploadGeometryArena(GeometryArena& arena, GLuint transformBuffer)
+{
+	CreateGpuObject(arena.vbo, "scene vertices"); // Create VBO
+	CreateGpuObject(arena.ebo, "scene indices"); // Create EBO
+	CreateGpuObject(arena.vao, "scene arena"); // Create VOA
+
+	glBindVertexArray(arena.vao);
+	LabelGpuObject(arena.vao);
+		glBindBuffer(GL_ARRAY_BUFFER, arena.vbo); // Select VBO
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.ebo); // Select EBO
+		if (!GpuBufferData(arena.vbo, GL_ARRAY_BUFFER, arena.vertexBytes, arena.vertexData, GL_STATIC_DRAW) // Load vertex attributes
+			|| !GpuBufferData(arena.ebo, GL_ELEMENT_ARRAY_BUFFER, arena.indexCount * sizeof(GLuint), arena.indexData, GL_STATIC_DRAW)) // Load indices
+		{
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			return false;
+		}
+		// Specify attribute location and layout to GPU
+		for (size_t i = 0; i < arena.attributes.size(); i++)
+		{
+			const SceneVertexAttribute& attribute = arena.attributes[i];
+			glVertexAttribPointer(attribute.location, attribute.components, attribute.type, attribute.normalized ? GL_TRUE : GL_FALSE, arena.vertexStride, (GLvoid*)(size_t)attribute.offset);
+			glEnableVertexAttribArray(attribute.location);
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, transformBuffer);
+		for (GLuint column = 0; column < 4; column++)
+		{
+			glVertexAttribPointer(2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (GLvoid*)(column * sizeof(glm::vec4)));
+			glEnableVertexAttribArray(2 + column);
+			glVertexAttribDivisor(2 + column, 1); // Advance once per instance rather than per vertex
+		}
+	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return true;
+}
+
+// Draw Primitive(s)
+void draw(const MeshRange& mesh)
+{
+	glDrawElementsBaseVertex(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, (GLvoid*)(mesh.firstIndex * sizeof(GLuint)), mesh.baseVertex);
+}
+
+/* Geometry Arena Definitions End Here */
+
+/* Stream Buffer Definitions */
+
+// Everything rewritten every frame (visible matrices, FrameBlock, ObjectBlock ranges, indirect commands)
+// is written straight into one persistently mapped buffer split into STREAM_FRAME_REGIONS regions.
+// A frame bump-allocates slices from its own region and fences it after its last draw; the region is
+// reused only once that fence signals, so the CPU never writes what the GPU may still be reading
+// and nothing is orphaned.
+const GLuint STREAM_FRAME_REGIONS = 3;
+const GLsizeiptr STREAM_MIN_REGION_BYTES = 256 * 1024;
+
+// Where a GPU-side array lives: a whole buffer, or a slice of the stream buffer
+struct BufferRange
+{
+	GLuint buffer;
+	GLintptr offset;
+	GLsizeiptr size;
+};
+
+struct StreamBuffer
+{
+	GpuBuffer buffer;
+	unsigned char* mapped = nullptr;		// Write-only, coherent: no flush needed
+	GLsizeiptr regionSize = 0;
+	GLsizeiptr alignment = 256;				// Every slice can be bound as a uniform or storage block range
+	GLsync fences[STREAM_FRAME_REGIONS] = {};
+	GLuint region = 0;						// Region the current frame writes
+	GLsizeiptr head = 0;					// Next free byte within it
+	GLsizeiptr requested = 0;				// Bytes the current frame asked for, including any that did not fit
+	bool frameOpen = false;
+	GLuint waits = 0;						// Frames that found their region still in use by the GPU
+	GLuint overflows = 0;					// Uploads that fell back to orphaning: region full or no frame open
+};
+
+StreamBuffer sceneStream;
+bool streamingEnabled = true;
+
+// A slice handed out by AllocateStream; data is null when the frame's region is full
+struct StreamSlice
+{
+	unsigned char* data;
+	BufferRange range;
+};
+
+bool IsStreamingSupported()
+{
+	return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+}
+
+// Create the buffer with room for regionSize bytes per frame, rounded up to the slice alignment
+void CreateStreamBuffer(StreamBuffer& stream, GLsizeiptr regionSize)
+{
+	GLint uniformAlignment = 256, storageAlignment = 16;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniformAlignment);
+	if (GLEW_VERSION_4_3 || GLEW_ARB_shader_storage_buffer_object)
+		glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &storageAlignment);
+	stream.alignment = max((GLsizeiptr)max(uniformAlignment, storageAlignment), (GLsizeiptr)sizeof(glm::mat4));
+	stream.regionSize = (max(regionSize, STREAM_MIN_REGION_BYTES) + stream.alignment - 1) / stream.alignment * stream.alignment;
+
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	CreateGpuObject(stream.buffer, "frame stream");
+	glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+	if (!TrackGpuObjectBytes(GPU_BUFFER, stream.buffer, stream.regionSize * STREAM_FRAME_REGIONS, GL_MAP_PERSISTENT_BIT))
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		ReleaseGpuObject(stream.buffer);
+		cout << "Stream Error: no room in the GPU memory budget, uploads fall back to orphaning" << endl;
+		return;
+	}
+	glBufferStorage(GL_ARRAY_BUFFER, stream.regionSize * STREAM_FRAME_REGIONS, nullptr, flags);
+	stream.mapped = (unsigned char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, stream.regionSize * STREAM_FRAME_REGIONS, flags);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	if (stream.mapped == nullptr)
+		cout << "Stream Error: cannot map " << stream.regionSize * STREAM_FRAME_REGIONS << " bytes, uploads fall back to orphaning" << endl;
+}
+
+// The GL keeps a deleted buffer alive until the draws reading it finish, so nothing waits here
+void DestroyStreamBuffer(StreamBuffer& stream)
+{
+	for (GLuint i = 0; i < STREAM_FRAME_REGIONS; i++)
+		if (stream.fences[i])
+		{
+			glDeleteSync(stream.fences[i]);
+			stream.fences[i] = 0;
+		}
+	if (stream.mapped)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	ReleaseGpuObject(stream.buffer);
+	stream.mapped = nullptr;
+	stream.frameOpen = false;
+	stream.requested = 0;
+}
+
+// Move on to the next region, first waiting for the frame that last wrote it to leave the GPU.
+// A frame that overflowed its region makes every region grow before the next one starts, unless the
+// GPU memory budget has no room; those frames keep falling back for what does not fit.
+void BeginStreamFrame(StreamBuffer& stream)
+{
+	if (stream.buffer == 0)
+		return;
+	GLsizeiptr regionSize = stream.requested + stream.requested / 2;
+	if (stream.requested > stream.regionSize && FitsGpuBudget((regionSize - stream.regionSize) * STREAM_FRAME_REGIONS))
+	{
+		DestroyStreamBuffer(stream);
+		CreateStreamBuffer(stream, regionSize);
+		stream.region = 0;
+	}
+	else
+		stream.region = (stream.region + 1) % STREAM_FRAME_REGIONS;
+	stream.head = 0;
+	stream.requested = 0;
+	stream.frameOpen = stream.mapped != nullptr;
+
+	GLsync& fence = stream.fences[stream.region];
+	if (fence == 0)
+		return;
+	if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+	{
+		stream.waits++;
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			;
+	}
+	glDeleteSync(fence);
+	fence = 0;
+}
+
+// Fence the region once every command reading it has been issued
+void EndStreamFrame(StreamBuffer& stream)
+{
+	if (!stream.frameOpen)
+		return;
+	stream.fences[stream.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	stream.frameOpen = false;
+}
+
+// Bump-allocate an aligned slice of the current region. Outside a frame, or once the region is full,
+// the slice is empty and the caller uploads through its own buffer instead. Occasional bursts pass
+// grow = false so they only use room the frame left over and never enlarge the regions.
+StreamSlice AllocateStream(StreamBuffer& stream, GLsizeiptr size, bool grow = true)
+{
+	StreamSlice slice = { nullptr, { 0, 0, size } };
+	if (!stream.frameOpen)
+		return slice;
+	GLsizeiptr offset = (stream.head + stream.alignment - 1) / stream.alignment * stream.alignment;
+	if (grow)
+		stream.requested += (size + stream.alignment - 1) / stream.alignment * stream.alignment;
+	if (offset + size > stream.regionSize)
+		return slice;
+	stream.head = offset + size;
+
+	slice.range.buffer = stream.buffer;
+	slice.range.offset = (GLintptr)stream.region * stream.regionSize + offset;
+	slice.data = stream.mapped + slice.range.offset;
+	return slice;
+}
+
+// Copy size bytes into a stream slice, or when none is free into fallback bound to target, and return
+// where they landed. The fallback's old storage is orphaned so the driver never waits on the draws or
+// uploads still reading last frame's contents.
+BufferRange StreamOrOrphan(StreamBuffer& stream, GLenum target, const GpuBuffer& fallback, const void* data, GLsizeiptr size, bool grow = true)
+{
+	StreamSlice slice = AllocateStream(stream, size, grow);
+	if (slice.data)
+	{
+		memcpy(slice.data, data, size);
+		return slice.range;
+	}
+
+	if (stream.buffer)
+		stream.overflows++;
+	glBindBuffer(target, fallback);
+	GpuBufferData(fallback, target, size, data, GL_STREAM_DRAW, false);
+	glBindBuffer(target, 0);
+	BufferRange range = { fallback, 0, size };
+	return range;
+}
+
+/* Stream Buffer Definitions End Here */
+
+
+// A mesh and the contiguous range of placements it is drawn at
+struct DrawBatch
+{
+	GLuint mesh;			// Mesh ID in the geometry arena
+	GLuint firstTransform;	// First placement in the transform store
+	GLsizei instanceCount;
+};
+
+// One batch per run of instances sharing a mesh (scene files keep them grouped by mesh)
+vector<DrawBatch> BuildDrawBatches(const SceneFile& scene)
+{
+	vector<DrawBatch> batches;
+	for (GLuint i = 0; i < scene.header->instanceCount; i++)
+	{
+		GLuint mesh = scene.instances[i].mesh;
+		if (batches.empty() || batches.back().mesh != mesh)
+		{
+			DrawBatch batch = { mesh, i, 0 };
+			batches.push_back(batch);
+		}
+		batches.back().instanceCount++;
+	}
+	return batches;
+}
+
+// Re-upload only the span of world matrices rebuilt since the last upload. Inside a stream frame the
+// span is staged in the ring and copied on the GPU, so editing placements the GPU is still drawing
+// never makes the driver wait or shadow the buffer.
+void UploadChangedTransforms(GLuint transformBuffer, TransformStore& store, StreamBuffer& stream)
+{
+	GLint first = -1, last = -1;
+	for (GLint i = 0; i < (GLint)store.changed.size(); i++)
+	{
+		if (!store.changed[i])
+			continue;
+		if (first < 0)
+			first = i;
+		last = i;
+		store.changed[i] = false;
+	}
+	if (first < 0)
+		return;
+
+	GLsizeiptr bytes = (last - first + 1) * sizeof(glm::mat4);
+	StreamSlice slice = AllocateStream(stream, bytes);
+	if (slice.data)
+	{
+		memcpy(slice.data, &store.worldMatrices[first], bytes);
+		glBindBuffer(GL_COPY_READ_BUFFER, slice.range.buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, transformBuffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, slice.range.offset, first * sizeof(glm::mat4), bytes);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		return;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, transformBuffer);
+	glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(glm::mat4), bytes, &store.worldMatrices[first]);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Draw every placement of a batch with a single call. Without base instance support the
+// instance attributes are re-pointed at the batch's first matrix.
+void drawInstanced(const GeometryArena& arena, const DrawBatch& batch, const BufferRange& transforms)
+{
+	const MeshRange& mesh = arena.meshes[batch.mesh];
+	glBindBuffer(GL_ARRAY_BUFFER, transforms.buffer);
+	for (GLuint column = 0; column < 4; column++)
+		glVertexAttribPointer(2 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (GLvoid*)(transforms.offset + batch.firstTransform * sizeof(glm::mat4) + column * sizeof(glm::vec4)));
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, (GLvoid*)(mesh.firstIndex * sizeof(GLuint)), batch.instanceCount, mesh.baseVertex);
+}
+
+/* Multi-Draw Indirect Definitions */
+
+// Layout fixed by glMultiDrawElementsIndirect
+struct DrawElementsIndirectCommand
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+// Per-draw data the indirect vertex shader reads with gl_DrawIDARB (std430 layout)
+struct IndirectDrawData
+{
+	GLuint firstTransform;
+	GLuint mesh;
+	GLint textureLayer;			// -1 for vertex colors only
+	GLuint padding;
+	glm::vec4 positionScale;	// Mesh dequantization, w unused
+	glm::vec4 positionBias;
+	glm::vec4 uvPlaneU;			// Model-space position to texture coordinates
+	glm::vec4 uvPlaneV;
+};
+
+// GPU side of the indirect path: commands plus the per-draw data they index
+struct IndirectDrawList
+{
+	GpuBuffer commandBuffer;		// Storage for lists that outlive a frame
+	GpuBuffer drawDataBuffer;
+	GLsizei commandCount = 0;
+	BufferRange commands = {};		// Where the current list lives: the buffers above or stream slices
+	BufferRange drawData = {};
+};
+
+// True when the context can run glMultiDrawElementsIndirect with gl_DrawIDARB
+bool IsIndirectSupported()
+{
+	return (GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_shader_storage_buffer_object)) && GLEW_ARB_shader_draw_parameters;
+}
+
+// Build one indirect command per batch with its per-draw data. A list rebuilt every frame is written
+// into the stream; one that must outlive the frame (stream null) goes to the list's own buffers.
+void BuildIndirectDrawList(IndirectDrawList& list, const GeometryArena& arena, const DrawBatch* batches, GLuint batchCount, StreamBuffer* stream = nullptr)
+{
+	vector<DrawElementsIndirectCommand> localCommands;
+	vector<IndirectDrawData> localDrawData;
+	StreamSlice commandSlice = {}, drawDataSlice = {};
+	if (stream)
+	{
+		commandSlice = AllocateStream(*stream, batchCount * sizeof(DrawElementsIndirectCommand));
+		drawDataSlice = AllocateStream(*stream, batchCount * sizeof(IndirectDrawData));
+	}
+	bool streamed = commandSlice.data && drawDataSlice.data;
+	if (!streamed)
+	{
+		localCommands.resize(batchCount);
+		localDrawData.resize(batchCount);
+	}
+	DrawElementsIndirectCommand* commands = streamed ? (DrawElementsIndirectCommand*)commandSlice.data : localCommands.data();
+	IndirectDrawData* drawData = streamed ? (IndirectDrawData*)drawDataSlice.data : localDrawData.data();
+
+	for (GLuint i = 0; i < batchCount; i++)
+	{
+		const MeshRange& mesh = arena.meshes[batches[i].mesh];
+		commands[i].count = mesh.indexCount;
+		commands[i].instanceCount = batches[i].instanceCount;
+		commands[i].firstIndex = mesh.firstIndex;
+		commands[i].baseVertex = mesh.baseVertex;
+		commands[i].baseInstance = batches[i].firstTransform; // Keeps the instance attributes in range
+
+		drawData[i].firstTransform = batches[i].firstTransform;
+		drawData[i].mesh = batches[i].mesh;
+		drawData[i].textureLayer = mesh.textureLayer;
+		drawData[i].padding = 0;
+		drawData[i].positionScale = glm::vec4(mesh.positionScale, 0.0f);
+		drawData[i].positionBias = glm::vec4(mesh.positionBias, 0.0f);
+		drawData[i].uvPlaneU = mesh.uvPlanes[0];
+		drawData[i].uvPlaneV = mesh.uvPlanes[1];
+	}
+
+	list.commandCount = (GLsizei)batchCount;
+	if (streamed)
+	{
+		list.commands = commandSlice.range;
+		list.drawData = drawDataSlice.range;
+		return;
+	}
+
+	if (list.commandBuffer == 0)
+	{
+		CreateGpuObject(list.commandBuffer, "indirect commands");
+		CreateGpuObject(list.drawDataBuffer, "indirect draw data");
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, list.commandBuffer);
+	GpuBufferData(list.commandBuffer, GL_DRAW_INDIRECT_BUFFER, localCommands.size() * sizeof(DrawElementsIndirectCommand), localCommands.data(), GL_DYNAMIC_DRAW, false);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, list.drawDataBuffer);
+	GpuBufferData(list.drawDataBuffer, GL_SHADER_STORAGE_BUFFER, localDrawData.size() * sizeof(IndirectDrawData), localDrawData.data(), GL_DYNAMIC_DRAW, false);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	list.commands = { list.commandBuffer, 0, (GLsizeiptr)(batchCount * sizeof(DrawElementsIndirectCommand)) };
+	list.drawData = { list.drawDataBuffer, 0, (GLsizeiptr)(batchCount * sizeof(IndirectDrawData)) };
+}
+
+// Submit every batch with a single call; the arena VAO must be bound
+void drawIndirect(const IndirectDrawList& list, const BufferRange& transforms)
+{
+	if (list.commandCount == 0)
+		return;
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, list.drawData.buffer, list.drawData.offset, list.drawData.size);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, transforms.buffer, transforms.offset, transforms.size);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, list.commands.buffer);
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (GLvoid*)list.commands.offset, list.commandCount, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+/* Multi-Draw Indirect Definitions End Here */
+
+/* Frustum Culling Definitions */
+
+// The six planes of a view frustum as (normal, distance), normals pointing inwards
+struct Frustum
+{
+	glm::vec4 planes[6];
+};
+
+// Gribb-Hartmann extraction from a combined projection * view matrix
+Frustum ExtractFrustum(const glm::mat4& viewProjection)
+{
+	// glm is column major, so row i is (m[0][i], m[1][i], m[2][i], m[3][i])
+	glm::vec4 rows[4];
+	for (GLuint i = 0; i < 4; i++)
+		rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+
+	Frustum frustum;
+	frustum.planes[0] = rows[3] + rows[0];	// Left
+	frustum.planes[1] = rows[3] - rows[0];	// Right
+	frustum.planes[2] = rows[3] + rows[1];	// Bottom
+	frustum.planes[3] = rows[3] - rows[1];	// Top
+	frustum.planes[4] = rows[3] + rows[2];	// Near
+	frustum.planes[5] = rows[3] - rows[2];	// Far
+	for (GLuint i = 0; i < 6; i++)
+		frustum.planes[i] = frustum.planes[i] * (1.0f / glm::length(glm::vec3(frustum.planes[i])));
+	return frustum;
+}
+
+enum FrustumTest
+{
+	FRUSTUM_OUTSIDE,
+	FRUSTUM_INTERSECTS,
+	FRUSTUM_INSIDE
+};
+
+// Classify an axis-aligned box against the frustum
+FrustumTest TestFrustumBox(const Frustum& frustum, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+	glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+	glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+	FrustumTest result = FRUSTUM_INSIDE;
+	for (GLuint i = 0; i < 6; i++)
+	{
+		glm::vec3 normal = glm::vec3(frustum.planes[i]);
+		GLfloat distance = glm::dot(normal, center) + frustum.planes[i].w;
+		GLfloat radius = glm::dot(glm::abs(normal), extent);
+		if (distance + radius < 0.0f)
+			return FRUSTUM_OUTSIDE;
+		if (distance - radius < 0.0f)
+			result = FRUSTUM_INTERSECTS;
+	}
+	return result;
+}
+
+// World-space box around a transformed local box (Arvo's method)
+void TransformBounds(const glm::mat4& worldMatrix, const glm::vec3& localMin, const glm::vec3& localMax, glm::vec3& worldMin, glm::vec3& worldMax)
+{
+	glm::vec3 center = glm::vec3(worldMatrix * glm::vec4((localMin + localMax) * 0.5f, 1.0f));
+	glm::vec3 extent = (localMax - localMin) * 0.5f;
+	glm::vec3 worldExtent = glm::abs(glm::vec3(worldMatrix[0])) * extent.x
+		+ glm::abs(glm::vec3(worldMatrix[1])) * extent.y
+		+ glm::abs(glm::vec3(worldMatrix[2])) * extent.z;
+	worldMin = center - worldExtent;
+	worldMax = center + worldExtent;
+}
+
+// Every node covers a contiguous run of objectOrder; interior nodes keep their two children
+// next to each other after the parent, so a reverse walk visits children before parents.
+struct BVHNode
+{
+	glm::vec3 boundsMin, boundsMax;
+	GLuint firstObject;
+	GLuint objectCount;
+	GLuint leftChild;		// 0 for leaves, right child is leftChild + 1
+};
+
+// Bounding volume hierarchy over every placement in the transform store
+struct BoundingVolumeHierarchy
+{
+	vector<BVHNode> nodes;
+	vector<GLuint> objectOrder;			// Transform IDs, grouped by leaf
+	vector<GLuint> objectMesh;			// Mesh drawn by each transform ID
+	vector<glm::vec3> objectMin, objectMax;
+};
+
+// Objects tested and kept by the last CullScene
+struct CullStats
+{
+	GLuint nodesTested;
+	GLuint objectsTested;
+	GLuint visible;
+	GLuint culled;
+};
+
+const GLuint BVH_LEAF_SIZE = 4;
+
+BoundingVolumeHierarchy sceneBVH;
+CullStats cullStats;
+bool cullingEnabled = true;
+
+void UpdateObjectBounds(BoundingVolumeHierarchy& bvh, const GeometryArena& arena, const TransformStore& store, GLuint object)
+{
+	const MeshRange& mesh = arena.meshes[bvh.objectMesh[object]];
+	TransformBounds(store.worldMatrices[object], mesh.boundsMin, mesh.boundsMax, bvh.objectMin[object], bvh.objectMax[object]);
+}
+
+// Fit a node's box to its children, or to its objects for a leaf
+void FitNodeBounds(BoundingVolumeHierarchy& bvh, BVHNode& node)
+{
+	if (node.leftChild != 0)
+	{
+		const BVHNode& left = bvh.nodes[node.leftChild];
+		const BVHNode& right = bvh.nodes[node.leftChild + 1];
+		node.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+		node.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+		return;
+	}
+	node.boundsMin = glm::vec3(FLT_MAX);
+	node.boundsMax = glm::vec3(-FLT_MAX);
+	for (GLuint i = node.firstObject; i < node.firstObject + node.objectCount; i++)
+	{
+		node.boundsMin = glm::min(node.boundsMin, bvh.objectMin[bvh.objectOrder[i]]);
+		node.boundsMax = glm::max(node.boundsMax, bvh.objectMax[bvh.objectOrder[i]]);
+	}
+}
+
+// Split a node at the median centroid along its longest axis until leaves are small
+void SubdivideNode(BoundingVolumeHierarchy& bvh, GLuint nodeIndex)
+{
+	FitNodeBounds(bvh, bvh.nodes[nodeIndex]);
+	BVHNode node = bvh.nodes[nodeIndex];
+	if (node.objectCount <= BVH_LEAF_SIZE)
+		return;
+
+	glm::vec3 size = node.boundsMax - node.boundsMin;
+	int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+	vector<GLuint>::iterator first = bvh.objectOrder.begin() + node.firstObject;
+	GLuint half = node.objectCount / 2;
+	nth_element(first, first + half, first + node.objectCount, [&bvh, axis](GLuint a, GLuint b) {
+		return bvh.objectMin[a][axis] + bvh.objectMax[a][axis] < bvh.objectMin[b][axis] + bvh.objectMax[b][axis];
+	});
+
+	GLuint leftChild = (GLuint)bvh.nodes.size();
+	BVHNode left = { glm::vec3(0.0f), glm::vec3(0.0f), node.firstObject, half, 0 };
+	BVHNode right = { glm::vec3(0.0f), glm::vec3(0.0f), node.firstObject + half, node.objectCount - half, 0 };
+	bvh.nodes.push_back(left);
+	bvh.nodes.push_back(right);
+	bvh.nodes[nodeIndex].leftChild = leftChild;
+
+	SubdivideNode(bvh, leftChild);
+	SubdivideNode(bvh, leftChild + 1);
+	FitNodeBounds(bvh, bvh.nodes[nodeIndex]);
+}
+
+// Build the hierarchy from the current world matrices
+void BuildCullingHierarchy(BoundingVolumeHierarchy& bvh, const GeometryArena& arena, const TransformStore& store, const vector<DrawBatch>& batches)
+{
+	GLuint objectCount = (GLuint)store.worldMatrices.size();
+	bvh.nodes.clear();
+	bvh.objectOrder.resize(objectCount);
+	bvh.objectMesh.assign(objectCount, 0);
+	bvh.objectMin.resize(objectCount);
+	bvh.objectMax.resize(objectCount);
+
+	for (size_t i = 0; i < batches.size(); i++)
+		for (GLsizei j = 0; j < batches[i].instanceCount; j++)
+			bvh.objectMesh[batches[i].firstTransform + j] = batches[i].mesh;
+	for (GLuint i = 0; i < objectCount; i++)
+	{
+		bvh.objectOrder[i] = i;
+		UpdateObjectBounds(bvh, arena, store, i);
+	}
+
+	BVHNode root = { glm::vec3(0.0f), glm::vec3(0.0f), 0, objectCount, 0 };
+	bvh.nodes.push_back(root);
+	SubdivideNode(bvh, 0);
+}
+
+// Refit boxes after objects move; the tree shape is kept
+void RefitCullingHierarchy(BoundingVolumeHierarchy& bvh, const GeometryArena& arena, TransformStore& store, JobSystem& jobs)
+{
+	if (!store.anyMoved)
+		return;
+
+	ParallelFor(jobs, (GLuint)store.moved.size(), 1024, [&bvh, &arena, &store](GLuint begin, GLuint end) {
+		for (GLuint i = begin; i < end; i++)
+		{
+			if (!store.moved[i])
+				continue;
+			UpdateObjectBounds(bvh, arena, store, i);
+			store.moved[i] = false;
+		}
+	});
+	for (size_t i = bvh.nodes.size(); i-- > 0;)
+		FitNodeBounds(bvh, bvh.nodes[i]);
+	store.anyMoved = false;
+}
+
+// Mark the objects of one subtree that are inside the frustum. Nodes fully inside accept their
+// objects without testing them.
+void CullSubtree(const BoundingVolumeHierarchy& bvh, const Frustum& frustum, GLuint root, vector<unsigned char>& objectVisible, CullStats& stats)
+{
+	GLuint stack[64];
+	GLuint stackSize = 0;
+	stack[stackSize++] = root;
+
+	while (stackSize > 0)
+	{
+		const BVHNode& node = bvh.nodes[stack[--stackSize]];
+		stats.nodesTested++;
+		FrustumTest test = TestFrustumBox(frustum, node.boundsMin, node.boundsMax);
+		if (test == FRUSTUM_OUTSIDE)
+			continue;
+
+		if (test == FRUSTUM_INTERSECTS && node.leftChild != 0)
+		{
+			stack[stackSize++] = node.leftChild;
+			stack[stackSize++] = node.leftChild + 1;
+			continue;
+		}
+
+		for (GLuint i = node.firstObject; i < node.firstObject + node.objectCount; i++)
+		{
+			GLuint object = bvh.objectOrder[i];
+			if (test == FRUSTUM_INTERSECTS)
+			{
+				stats.objectsTested++;
+				if (TestFrustumBox(frustum, bvh.objectMin[object], bvh.objectMax[object]) == FRUSTUM_OUTSIDE)
+					continue;
+			}
+			objectVisible[object] = 1;
+			stats.visible++;
+		}
+	}
+}
+
+// Mark the objects inside the frustum. The top of the tree is split into a few subtrees per worker
+// and each subtree is culled as one job; subtrees own disjoint objects.
+void CullScene(const BoundingVolumeHierarchy& bvh, const Frustum& frustum, vector<unsigned char>& objectVisible, CullStats& stats, JobSystem& jobs)
+{
+	stats.nodesTested = stats.objectsTested = stats.visible = 0;
+	objectVisible.assign(bvh.objectOrder.size(), 0);
+	if (bvh.nodes.empty())
+		return;
+
+	vector<GLuint> subtrees(1, 0);
+	for (size_t expanded = 0; subtrees.size() < jobs.workerCount * 4 && expanded < subtrees.size();)
+	{
+		const BVHNode& node = bvh.nodes[subtrees[expanded]];
+		if (node.leftChild == 0)
+		{
+			expanded++;
+			continue;
+		}
+		subtrees[expanded] = node.leftChild;
+		subtrees.push_back(node.leftChild + 1);
+	}
+
+	atomic<GLuint> nodesTested(0), objectsTested(0), visible(0);
+	ParallelFor(jobs, (GLuint)subtrees.size(), 1, [&](GLuint begin, GLuint end) {
+		CullStats chunkStats = {};
+		for (GLuint i = begin; i < end; i++)
+			CullSubtree(bvh, frustum, subtrees[i], objectVisible, chunkStats);
+		nodesTested.fetch_add(chunkStats.nodesTested);
+		objectsTested.fetch_add(chunkStats.objectsTested);
+		visible.fetch_add(chunkStats.visible);
+	});
+	stats.nodesTested = nodesTested.load();
+	stats.objectsTested = objectsTested.load();
+	stats.visible = visible.load();
+	stats.culled = (GLuint)bvh.objectOrder.size() - stats.visible;
+}
+
+// Visible placements regrouped into contiguous batches so every render path can draw them
+struct VisibleSet
+{
+	vector<unsigned char> objectVisible;	// Per transform ID, filled by CullScene
+	vector<unsigned char> objectLod;		// Per transform ID, filled by SelectLevelsOfDetail
+	vector<DrawBatch> batches;
+	vector<glm::mat4> worldMatrices;		// Visible matrices in batch order
+	GpuBuffer transformBuffer;				// GPU copy of worldMatrices when the stream cannot hold it
+	BufferRange transforms = {};			// Where this frame's copy landed
+};
+
+VisibleSet sceneVisible;
+
+// Projected heights in pixels below which each coarser level takes over
+const GLfloat LOD_SCREEN_HEIGHTS[PROCEDURAL_LOD_LEVELS - 1] = { 160.0f, 60.0f, 20.0f };
+
+// Pick a detail level for each visible placement of a multi-level mesh from the height of its
+// bounding sphere on screen. projection[1][1] is 1 / tan(fov / 2), so zooming changes the pick.
+void SelectLevelsOfDetail(VisibleSet& visible, const BoundingVolumeHierarchy& bvh, const GeometryArena& arena, const glm::mat4& projection, const glm::vec3& eye, int viewportHeight, JobSystem& jobs)
+{
+	visible.objectLod.assign(visible.objectVisible.size(), 0);
+	bool perspective = projection[2][3] != 0.0f;
+	GLfloat pixelsPerUnit = projection[1][1] * viewportHeight;
+
+	ParallelFor(jobs, (GLuint)visible.objectVisible.size(), 1024, [&](GLuint begin, GLuint end) {
+		for (GLuint object = begin; object < end; object++)
+		{
+			GLuint lodCount = arena.meshes[bvh.objectMesh[object]].lodCount;
+			if (!visible.objectVisible[object] || lodCount == 1)
+				continue;
+
+			glm::vec3 center = (bvh.objectMin[object] + bvh.objectMax[object]) * 0.5f;
+			GLfloat radius = glm::length(bvh.objectMax[object] - center);
+			GLfloat distance = perspective ? glm::max(glm::length(center - eye), 0.001f) : 1.0f;
+			GLfloat screenHeight = radius * pixelsPerUnit / distance;
+
+			GLuint level = 0;
+			while (level + 1 < lodCount && level < PROCEDURAL_LOD_LEVELS - 1 && screenHeight < LOD_SCREEN_HEIGHTS[level])
+				level++;
+			visible.objectLod[object] = (unsigned char)level;
+		}
+	});
+}
+
+// Placements per compaction job; a chunk never spans two batches
+const GLuint COMPACT_CHUNK_SIZE = 2048;
+
+// Gather the visible placements of each batch, split by detail level, with their matrices.
+// Jobs count their chunk's placements per level, a prefix sum gives every chunk its output slots,
+// then jobs copy the matrices, so the result matches a serial pass exactly.
+void CompactVisibleSet(VisibleSet& visible, const GeometryArena& arena, const vector<DrawBatch>& batches, const TransformStore& store, JobSystem& jobs)
+{
+	struct CompactChunk
+	{
+		GLuint batch, first, end;
+		GLuint counts[PROCEDURAL_LOD_LEVELS];
+		GLuint offsets[PROCEDURAL_LOD_LEVELS];
+	};
+	vector<CompactChunk> chunks;
+	for (GLuint i = 0; i < (GLuint)batches.size(); i++)
+	{
+		GLuint batchEnd = batches[i].firstTransform + batches[i].instanceCount;
+		for (GLuint first = batches[i].firstTransform; first < batchEnd; first += COMPACT_CHUNK_SIZE)
+		{
+			CompactChunk chunk = { i, first, min(batchEnd, first + COMPACT_CHUNK_SIZE), {}, {} };
+			chunks.push_back(chunk);
+		}
+	}
+
+	ParallelFor(jobs, (GLuint)chunks.size(), 1, [&](GLuint begin, GLuint end) {
+		for (GLuint c = begin; c < end; c++)
+		{
+			CompactChunk& chunk = chunks[c];
+			memset(chunk.counts, 0, sizeof(chunk.counts));
+			for (GLuint object = chunk.first; object < chunk.end; object++)
+				if (visible.objectVisible[object])
+					chunk.counts[visible.objectLod[object]]++;
+		}
+	});
+
+	visible.batches.clear();
+	GLuint total = 0;
+	for (size_t c = 0; c < chunks.size();)
+	{
+		size_t batchChunksEnd = c;
+		while (batchChunksEnd < chunks.size() && chunks[batchChunksEnd].batch == chunks[c].batch)
+			batchChunksEnd++;
+		const DrawBatch& source = batches[chunks[c].batch];
+		for (GLuint level = 0; level < arena.meshes[source.mesh].lodCount; level++)
+		{
+			DrawBatch batch = { source.mesh + level, total, 0 };
+			for (size_t k = c; k < batchChunksEnd; k++)
+			{
+				chunks[k].offsets[level] = total;
+				total += chunks[k].counts[level];
+			}
+			batch.instanceCount = total - batch.firstTransform;
+			if (batch.instanceCount > 0)
+				visible.batches.push_back(batch);
+		}
+		c = batchChunksEnd;
+	}
+
+	visible.worldMatrices.resize(total);
+	ParallelFor(jobs, (GLuint)chunks.size(), 1, [&](GLuint begin, GLuint end) {
+		for (GLuint c = begin; c < end; c++)
+		{
+			CompactChunk& chunk = chunks[c];
+			for (GLuint object = chunk.first; object < chunk.end; object++)
+				if (visible.objectVisible[object])
+					visible.worldMatrices[chunk.offsets[visible.objectLod[object]]++] = store.worldMatrices[object];
+		}
+	});
+}
+
+// Send the compacted matrices to the GL path, into the stream when it has room
+void UploadVisibleTransforms(VisibleSet& visible, StreamBuffer& stream)
+{
+	GLsizeiptr bytes = visible.worldMatrices.size() * sizeof(glm::mat4);
+	visible.transforms = StreamOrOrphan(stream, GL_ARRAY_BUFFER, visible.transformBuffer, visible.worldMatrices.data(), bytes);
+}
+
+/* Frustum Culling Definitions End Here */
+
+/* Texture File Definitions */
+
+// Baked texture container (.texb). Images are resampled to TEXTURE_LAYER_SIZE square and stored
+// with every mip level, once per format: BC1 blocks for drivers with S3TC and RGBA8 for the rest.
+// Levels start on 16-byte boundaries, so the mapped file is uploaded as is with no decode step.
+const GLuint TEXTURE_FILE_MAGIC = 0x42584554;	// "TEXB"
+const GLuint TEXTURE_FILE_VERSION = 1;
+const GLsizei TEXTURE_LAYER_SIZE = 256;			// Every baked image, so all of them fit one texture array
+const GLint TEXTURE_LEVELS = 9;					// 256 down to 1
+
+enum TextureFileFormat
+{
+	TEXTURE_FORMAT_RGBA8,
+	TEXTURE_FORMAT_BC1,			// 8 bytes per 4 x 4 block, opaque
+	TEXTURE_FORMAT_COUNT
+};
+
+struct TextureFileLevel
+{
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+struct TextureFileHeader
+{
+	GLuint magic;
+	GLuint version;
+	GLuint size;				// Width and height of level 0
+	GLuint levelCount;
+	TextureFileLevel levels[TEXTURE_FORMAT_COUNT][TEXTURE_LEVELS];	// Per format, finest first and back to back
+};
+
+// Pointers into a mapped texture file
+struct TextureFile
+{
+	MappedFile mapping;
+	const TextureFileHeader* header = nullptr;
+};
+
+GLenum TextureFormatInternal(TextureFileFormat format)
+{
+	return format == TEXTURE_FORMAT_BC1 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_RGBA8;
+}
+
+GLsizeiptr TextureLevelBytes(TextureFileFormat format, GLint level)
+{
+	GLsizeiptr size = max(TEXTURE_LAYER_SIZE >> level, 1);
+	if (format == TEXTURE_FORMAT_BC1)
+		return ((size + 3) / 4) * ((size + 3) / 4) * 8;
+	return size * size * 4;
+}
+
+// Baked files sit next to their images: Textures/brick.png bakes to Textures/brick.texb
+string BakedTexturePath(const string& imagePath)
+{
+	size_t dot = imagePath.find_last_of('.');
+	size_t slash = imagePath.find_last_of("/\\");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		return imagePath + ".texb";
+	return imagePath.substr(0, dot) + ".texb";
+}
+
+// Bilinear resample of an RGBA8 image to the layer size, then a box-filtered mip chain back to back
+static void BuildTextureLevels(const unsigned char* image, int imageWidth, int imageHeight, vector<unsigned char>& pixels, size_t* levelOffsets)
+{
+	size_t offset = 0;
+	for (GLint level = 0; level <= TEXTURE_LEVELS; level++)
+	{
+		levelOffsets[level] = offset;
+		if (level < TEXTURE_LEVELS)
+			offset += (size_t)TextureLevelBytes(TEXTURE_FORMAT_RGBA8, level);
+	}
+	pixels.resize(levelOffsets[TEXTURE_LEVELS]);
+
+	unsigned char* top = pixels.data();
+	for (GLsizei y = 0; y < TEXTURE_LAYER_SIZE; y++)
+		for (GLsizei x = 0; x < TEXTURE_LAYER_SIZE; x++)
+		{
+			GLfloat sourceX = glm::clamp((x + 0.5f) * imageWidth / TEXTURE_LAYER_SIZE - 0.5f, 0.0f, (GLfloat)(imageWidth - 1));
+			GLfloat sourceY = glm::clamp((y + 0.5f) * imageHeight / TEXTURE_LAYER_SIZE - 0.5f, 0.0f, (GLfloat)(imageHeight - 1));
+			int x0 = (int)sourceX, y0 = (int)sourceY;
+			int x1 = min(x0 + 1, imageWidth - 1), y1 = min(y0 + 1, imageHeight - 1);
+			GLfloat fx = sourceX - x0, fy = sourceY - y0;
+			for (int channel = 0; channel < 4; channel++)
+			{
+				GLfloat row0 = image[(y0 * imageWidth + x0) * 4 + channel] * (1.0f - fx) + image[(y0 * imageWidth + x1) * 4 + channel] * fx;
+				GLfloat row1 = image[(y1 * imageWidth + x0) * 4 + channel] * (1.0f - fx) + image[(y1 * imageWidth + x1) * 4 + channel] * fx;
+				top[(y * TEXTURE_LAYER_SIZE + x) * 4 + channel] = (unsigned char)(row0 * (1.0f - fy) + row1 * fy + 0.5f);
+			}
+		}
+
+	for (GLint level = 1; level < TEXTURE_LEVELS; level++)
+	{
+		const unsigned char* source = &pixels[levelOffsets[level - 1]];
+		unsigned char* target = &pixels[levelOffsets[level]];
+		GLsizei sourceSize = TEXTURE_LAYER_SIZE >> (level - 1), size = sourceSize / 2;
+		for (GLsizei y = 0; y < size; y++)
+			for (GLsizei x = 0; x < size; x++)
+				for (int channel = 0; channel < 4; channel++)
+				{
+					GLuint sum = source[((2 * y) * sourceSize + 2 * x) * 4 + channel] + source[((2 * y) * sourceSize + 2 * x + 1) * 4 + channel]
+						+ source[((2 * y + 1) * sourceSize + 2 * x) * 4 + channel] + source[((2 * y + 1) * sourceSize + 2 * x + 1) * 4 + channel];
+					target[(y * size + x) * 4 + channel] = (unsigned char)((sum + 2) / 4);
+				}
+	}
+}
+
+static uint16_t PackRGB565(const int* color)
+{
+	return (uint16_t)(((color[0] * 31 + 127) / 255) << 11 | ((color[1] * 63 + 127) / 255) << 5 | ((color[2] * 31 + 127) / 255));
+}
+
+static void UnpackRGB565(uint16_t packed, int* color)
+{
+	int red = packed >> 11, green = (packed >> 5) & 63, blue = packed & 31;
+	color[0] = (red << 3) | (red >> 2);
+	color[1] = (green << 2) | (green >> 4);
+	color[2] = (blue << 3) | (blue >> 2);
+}
+
+// One BC1 block from a 4 x 4 tile of RGBA8 pixels: endpoints at the corners of the tile's color
+// bounding box, four-color mode, each pixel taking the nearest of the four palette entries
+static void EncodeBC1Block(const unsigned char tile[16][4], unsigned char* block)
+{
+	int low[3] = { 255, 255, 255 }, high[3] = { 0, 0, 0 };
+	for (int pixel = 0; pixel < 16; pixel++)
+		for (int channel = 0; channel < 3; channel++)
+		{
+			low[channel] = min(low[channel], (int)tile[pixel][channel]);
+			high[channel] = max(high[channel], (int)tile[pixel][channel]);
+		}
+
+	// Four-color mode needs color0 > color1
+	uint16_t color0 = PackRGB565(high), color1 = PackRGB565(low);
+	if (color0 < color1)
+		swap(color0, color1);
+	uint32_t indices = 0;
+	if (color0 != color1)
+	{
+		int palette[4][3];
+		UnpackRGB565(color0, palette[0]);
+		UnpackRGB565(color1, palette[1]);
+		for (int channel = 0; channel < 3; channel++)
+		{
+			palette[2][channel] = (2 * palette[0][channel] + palette[1][channel]) / 3;
+			palette[3][channel] = (palette[0][channel] + 2 * palette[1][channel]) / 3;
+		}
+		for (int pixel = 0; pixel < 16; pixel++)
+		{
+			int bestEntry = 0, bestDistance = INT32_MAX;
+			for (int entry = 0; entry < 4; entry++)
+			{
+				int distance = 0;
+				for (int channel = 0; channel < 3; channel++)
+					distance += (tile[pixel][channel] - palette[entry][channel]) * (tile[pixel][channel] - palette[entry][channel]);
+				if (distance < bestDistance)
+				{
+					bestDistance = distance;
+					bestEntry = entry;
+				}
+			}
+			indices |= (uint32_t)bestEntry << (2 * pixel);
+		}
+	}
+
+	block[0] = (unsigned char)(color0 & 0xFF);
+	block[1] = (unsigned char)(color0 >> 8);
+	block[2] = (unsigned char)(color1 & 0xFF);
+	block[3] = (unsigned char)(color1 >> 8);
+	for (int i = 0; i < 4; i++)
+		block[4 + i] = (unsigned char)(indices >> (8 * i));
+}
+
+// Expand one opaque BC1 block back to a 4 x 4 tile, rounding the palette the way Mesa does
+static void DecodeBC1Block(const unsigned char* block, unsigned char tile[16][4])
+{
+	uint16_t color0 = (uint16_t)(block[0] | block[1] << 8), color1 = (uint16_t)(block[2] | block[3] << 8);
+	int palette[4][3];
+	UnpackRGB565(color0, palette[0]);
+	UnpackRGB565(color1, palette[1]);
+	for (int channel = 0; channel < 3; channel++)
+		if (color0 > color1)
+		{
+			palette[2][channel] = (2 * palette[0][channel] + palette[1][channel]) / 3;
+			palette[3][channel] = (palette[0][channel] + 2 * palette[1][channel]) / 3;
+		}
+		else
+		{
+			palette[2][channel] = (palette[0][channel] + palette[1][channel]) / 2;
+			palette[3][channel] = 0;
+		}
+
+	uint32_t indices = (uint32_t)block[4] | (uint32_t)block[5] << 8 | (uint32_t)block[6] << 16 | (uint32_t)block[7] << 24;
+	for (int pixel = 0; pixel < 16; pixel++)
+	{
+		int entry = (indices >> (2 * pixel)) & 3;
+		for (int channel = 0; channel < 3; channel++)
+			tile[pixel][channel] = (unsigned char)palette[entry][channel];
+		tile[pixel][3] = 255;
+	}
+}
+
+// BC1-encode one RGBA8 level; levels under 4 x 4 repeat their edge pixels to fill the block
+static void EncodeBC1Level(const unsigned char* pixels, GLsizei size, unsigned char* blocks)
+{
+	GLsizei blocksWide = (size + 3) / 4;
+	for (GLsizei blockY = 0; blockY < blocksWide; blockY++)
+		for (GLsizei blockX = 0; blockX < blocksWide; blockX++)
+		{
+			unsigned char tile[16][4];
+			for (int pixel = 0; pixel < 16; pixel++)
+			{
+				GLsizei x = min(blockX * 4 + pixel % 4, size - 1), y = min(blockY * 4 + pixel / 4, size - 1);
+				memcpy(tile[pixel], &pixels[((size_t)y * size + x) * 4], 4);
+			}
+			EncodeBC1Block(tile, blocks + ((size_t)blockY * blocksWide + blockX) * 8);
+		}
+}
+
+// SOIL2 keeps decoder state and its last error in globals, and the texture loader threads and
+// LoadSoftwareTextures may all bake at once, so decoding takes turns
+mutex soilLock;
+
+// Offline: decode an image with SOIL2 once and write every level in every format
+bool BakeTextureFile(const string& imagePath, const string& bakedPath)
+{
+	int imageWidth = 0, imageHeight = 0, channels = 0;
+	unsigned char* image = nullptr;
+	{
+		lock_guard<mutex> lock(soilLock);
+		image = SOIL_load_image(imagePath.c_str(), &imageWidth, &imageHeight, &channels, SOIL_LOAD_RGBA);
+		if (image == nullptr || imageWidth <= 0 || imageHeight <= 0)
+		{
+			cout << "Texture Error: cannot load " << imagePath << " (" << SOIL_last_result() << ")" << endl;
+			if (image != nullptr)
+				SOIL_free_image_data(image);
+			return false;
+		}
+	}
+	vector<unsigned char> pixels;
+	size_t levelOffsets[TEXTURE_LEVELS + 1];
+	BuildTextureLevels(image, imageWidth, imageHeight, pixels, levelOffsets);
+	SOIL_free_image_data(image);
+
+	ofstream out(bakedPath, ios::binary | ios::trunc);
+	if (!out)
+	{
+		cout << "Texture Error: cannot write " << bakedPath << endl;
+		return false;
+	}
+
+	TextureFileHeader header = {};
+	header.magic = TEXTURE_FILE_MAGIC;
+	header.version = TEXTURE_FILE_VERSION;
+	header.size = TEXTURE_LAYER_SIZE;
+	header.levelCount = TEXTURE_LEVELS;
+	out.write((const char*)&header, sizeof(header)); // Rewritten once the offsets are known
+	vector<unsigned char> blocks;
+	for (GLint level = 0; level < TEXTURE_LEVELS; level++)
+	{
+		PadSceneSection(out);
+		header.levels[TEXTURE_FORMAT_RGBA8][level] = { (uint64_t)out.tellp(), (uint64_t)TextureLevelBytes(TEXTURE_FORMAT_RGBA8, level) };
+		out.write((const char*)&pixels[levelOffsets[level]], TextureLevelBytes(TEXTURE_FORMAT_RGBA8, level));
+	}
+	for (GLint level = 0; level < TEXTURE_LEVELS; level++)
+	{
+		blocks.resize(TextureLevelBytes(TEXTURE_FORMAT_BC1, level));
+		EncodeBC1Level(&pixels[levelOffsets[level]], max(TEXTURE_LAYER_SIZE >> level, 1), blocks.data());
+		PadSceneSection(out);
+		header.levels[TEXTURE_FORMAT_BC1][level] = { (uint64_t)out.tellp(), (uint64_t)blocks.size() };
+		out.write((const char*)blocks.data(), blocks.size());
+	}
+	out.seekp(0);
+	out.write((const char*)&header, sizeof(header));
+
+	if (!out)
+	{
+		cout << "Texture Error: failed writing " << bakedPath << endl;
+		return false;
+	}
+
+	cout << "Baked " << imagePath << " (" << imageWidth << "x" << imageHeight << ") -> " << bakedPath << ": " << TEXTURE_LEVELS << " levels, "
+		<< (header.levels[TEXTURE_FORMAT_BC1][TEXTURE_LEVELS - 1].offset + header.levels[TEXTURE_FORMAT_BC1][TEXTURE_LEVELS - 1].bytes) / 1024 << " KB" << endl;
+	return true;
+}
+
+// Map a .texb file and check its level table; nothing is parsed or copied
+bool OpenTextureFile(const string& path, TextureFile& texture)
+{
+	if (!MapFile(path, texture.mapping))
+		return false;
+
+	const MappedFile& file = texture.mapping;
+	const TextureFileHeader* header = (const TextureFileHeader*)file.data;
+	bool valid = file.size >= sizeof(TextureFileHeader) && header->magic == TEXTURE_FILE_MAGIC && header->version == TEXTURE_FILE_VERSION
+		&& header->size == (GLuint)TEXTURE_LAYER_SIZE && header->levelCount == (GLuint)TEXTURE_LEVELS;
+	for (int format = 0; format < TEXTURE_FORMAT_COUNT && valid; format++)
+		for (GLint level = 0; level < TEXTURE_LEVELS && valid; level++)
+		{
+			const TextureFileLevel& entry = header->levels[format][level];
+			valid = entry.bytes == (uint64_t)TextureLevelBytes((TextureFileFormat)format, level) && SceneSectionFits(file, entry.offset, entry.bytes)
+				&& (level == 0 || entry.offset >= header->levels[format][level - 1].offset + header->levels[format][level - 1].bytes);
+		}
+	if (!valid)
+	{
+		cout << "Texture Error: " << path << " is not a version " << TEXTURE_FILE_VERSION << " texture file of " << TEXTURE_LAYER_SIZE << " x " << TEXTURE_LAYER_SIZE << endl;
+		UnmapFile(texture.mapping);
+		return false;
+	}
+	texture.header = header;
+	return true;
+}
+
+// Map an image's baked file, baking it first when it is missing, older than the image or out of date with this build
+bool LoadTextureFile(const string& imagePath, TextureFile& texture)
+{
+	string bakedPath = BakedTexturePath(imagePath);
+	bool current = FileModifiedTime(imagePath) <= FileModifiedTime(bakedPath); // A baked file without its image is still used
+	return (current && OpenTextureFile(bakedPath, texture)) || (BakeTextureFile(imagePath, bakedPath) && OpenTextureFile(bakedPath, texture));
+}
+
+// Bytes of levels [firstLevel, endLevel) in one format, padding included, as they lie in the file
+GLsizeiptr TextureFileSpan(const TextureFile& texture, TextureFileFormat format, GLint firstLevel, GLint endLevel)
+{
+	const TextureFileLevel* levels = texture.header->levels[format];
+	return (GLsizeiptr)(levels[endLevel - 1].offset + levels[endLevel - 1].bytes - levels[firstLevel].offset);
+}
+
+/* Texture File Definitions End Here */
+
+/* Texture Streaming Definitions */
+
+// Scene images share one GL_TEXTURE_2D_ARRAY, a layer each, so every textured mesh draws with the
+// same binding. Loader threads map each image's baked file, baking it on the spot the first time.
+// The render thread then copies at most TEXTURE_UPLOAD_BYTES_PER_FRAME per frame from the mappings
+// into pixel unpack buffers, coarsest levels first. The shader never samples finer than what is
+// resident, and a layer with nothing resident keeps its vertex colors, so startup never waits on I/O.
+const GLuint TEXTURE_MAX_LAYERS = 16;			// FrameBlock carries one resident level per layer
+const GLint TEXTURE_PLACEHOLDER_LEVEL = 4;		// 16 x 16 and coarser go up together as the first placeholder
+const GLsizeiptr TEXTURE_UPLOAD_BYTES_PER_FRAME = 512 * 1024;
+const GLuint TEXTURE_LOADER_THREADS = 2;
+
+// One layer's mapped file; no header when it could be neither opened nor baked
+struct StreamedTexture
+{
+	GLuint layer = 0;
+	TextureFile file;
+	~StreamedTexture() { UnmapFile(file.mapping); }
+};
+
+struct TextureStreamer
+{
+	GpuTexture array;
+	GpuBuffer unpackBuffer;					// Staging for uploads the frame stream has no room for
+	TextureFileFormat format = TEXTURE_FORMAT_RGBA8;
+	vector<string> paths;					// Per layer
+	vector<GLint> residentLevel;			// Per layer: finest level uploaded, TEXTURE_LEVELS while none is
+	vector<thread> loaders;
+	atomic<GLuint> nextPath{ 0 };
+	atomic<bool> cancel{ false };
+	mutex loadedLock;
+	vector<unique_ptr<StreamedTexture>> loaded;		// Mapped by loaders, not yet taken by the render thread
+	vector<unique_ptr<StreamedTexture>> uploading;	// Levels still to upload
+	GLuint failedLayers = 0;
+	uint64_t uploadedBytes = 0;
+	chrono::steady_clock::time_point startTime;
+	double placeholderMilliseconds = -1.0;	// When every layer first showed something, -1 until then
+	double completeMilliseconds = -1.0;		// When every layer was complete
+};
+
+TextureStreamer sceneTextures;
+bool texturesEnabled = true;
+bool textureCompressionEnabled = true;
+
+// Loader thread: claim paths until none are left, map each and hand it to the render thread
+void TextureLoaderMain(TextureStreamer& streamer)
+{
+	for (GLuint layer = streamer.nextPath++; layer < streamer.paths.size() && !streamer.cancel; layer = streamer.nextPath++)
+	{
+		unique_ptr<StreamedTexture> texture(new StreamedTexture());
+		texture->layer = layer;
+		LoadTextureFile(streamer.paths[layer], texture->file);
+
+		lock_guard<mutex> lock(streamer.loadedLock);
+		streamer.loaded.push_back(move(texture));
+	}
+}
+
+// Allocate the array for the scene's images and start loading them; returns at once
+void StartTextureStreaming(TextureStreamer& streamer, const SceneFile& scene)
+{
+	streamer.startTime = chrono::steady_clock::now();
+	streamer.format = textureCompressionEnabled && GLEW_EXT_texture_compression_s3tc ? TEXTURE_FORMAT_BC1 : TEXTURE_FORMAT_RGBA8;
+	GLuint layerCount = min(scene.header->textureCount, TEXTURE_MAX_LAYERS);
+	if (scene.header->textureCount > TEXTURE_MAX_LAYERS)
+		cout << "Texture Error: " << scene.header->textureCount << " textures, only the first " << TEXTURE_MAX_LAYERS << " are loaded" << endl;
+	if (layerCount == 0)
+		return;
+
+	GLsizeiptr bytes = 0;
+	for (GLint level = 0; level < TEXTURE_LEVELS; level++)
+		bytes += TextureLevelBytes(streamer.format, level) * layerCount;
+	CreateGpuObject(streamer.array, "scene textures");
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, streamer.array);	// Binding creates the object, which labeling needs
+	if (!TrackGpuObjectBytes(GPU_TEXTURE, streamer.array, bytes, GL_STATIC_DRAW))
+	{
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		ReleaseGpuObject(streamer.array);
+		cout << "Texture Error: no room in the GPU memory budget, meshes keep their vertex colors" << endl;
+		return;
+	}
+
+	// Storage for every level up front; levels fill in as they arrive
+	GLenum internalFormat = TextureFormatInternal(streamer.format);
+	if (GLEW_VERSION_4_2 || GLEW_ARB_texture_storage)
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, TEXTURE_LEVELS, internalFormat, TEXTURE_LAYER_SIZE, TEXTURE_LAYER_SIZE, layerCount);
+	else
+		for (GLint level = 0; level < TEXTURE_LEVELS; level++)
+		{
+			GLsizei size = max(TEXTURE_LAYER_SIZE >> level, 1);
+			if (streamer.format == TEXTURE_FORMAT_BC1)
+				glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat, size, size, layerCount, 0, (GLsizei)(TextureLevelBytes(streamer.format, level) * layerCount), nullptr);
+			else
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internalFormat, size, size, layerCount, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		}
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, TEXTURE_LEVELS - 1);
+	CreateGpuObject(streamer.unpackBuffer, "texture staging");
+
+	for (GLuint layer = 0; layer < layerCount; layer++)
+		streamer.paths.push_back(scene.directory + scene.textures[layer].path);
+	streamer.residentLevel.assign(layerCount, TEXTURE_LEVELS);
+	streamer.nextPath = 0;
+	streamer.cancel = false;
+	for (GLuint i = 0; i < min(layerCount, TEXTURE_LOADER_THREADS); i++)
+		streamer.loaders.push_back(thread(TextureLoaderMain, ref(streamer)));
+}
+
+// Copy levels [firstLevel, endLevel) of a mapped layer to the array, through the frame stream when it
+// has room. The array stays bound to texture unit 0 for the whole run.
+GLsizeiptr UploadTextureLevels(TextureStreamer& streamer, StreamBuffer& stream, const StreamedTexture& texture, GLint firstLevel, GLint endLevel)
+{
+	const TextureFileLevel* levels = texture.file.header->levels[streamer.format];
+	const unsigned char* pixels = texture.file.mapping.data + levels[firstLevel].offset;
+	GLsizeiptr bytes = TextureFileSpan(texture.file, streamer.format, firstLevel, endLevel);
+	BufferRange source = StreamOrOrphan(stream, GL_PIXEL_UNPACK_BUFFER, streamer.unpackBuffer, pixels, bytes, false);
+	GLintptr base = source.offset;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, source.buffer);
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, streamer.array);
+	for (GLint level = firstLevel; level < endLevel; level++)
+	{
+		GLsizei size = max(TEXTURE_LAYER_SIZE >> level, 1);
+		GLintptr offset = base + (GLintptr)(levels[level].offset - levels[firstLevel].offset);
+		if (streamer.format == TEXTURE_FORMAT_BC1)
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, texture.layer, size, size, 1, TextureFormatInternal(streamer.format),
+				(GLsizei)levels[level].bytes, (GLvoid*)offset);
+		else
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, texture.layer, size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)offset);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	streamer.residentLevel[texture.layer] = firstLevel;
+	streamer.uploadedBytes += bytes;
+	return bytes;
+}
+
+// Once a frame on the render thread: take what the loaders mapped and upload within the frame's budget.
+// Layers showing nothing get their placeholder levels first, then every layer refines a level at a time.
+void PumpTextureStreaming(TextureStreamer& streamer, StreamBuffer& stream)
+{
+	if (streamer.completeMilliseconds >= 0.0 || streamer.array == 0)
+		return;
+	{
+		lock_guard<mutex> lock(streamer.loadedLock);
+		for (size_t i = 0; i < streamer.loaded.size(); i++)
+		{
+			if (streamer.loaded[i]->file.header == nullptr)
+				streamer.failedLayers++;
+			else
+				streamer.uploading.push_back(move(streamer.loaded[i]));
+		}
+		streamer.loaded.clear();
+	}
+
+	GLsizeiptr budget = TEXTURE_UPLOAD_BYTES_PER_FRAME;
+	for (size_t i = 0; i < streamer.uploading.size(); i++)
+	{
+		const StreamedTexture& texture = *streamer.uploading[i];
+		if (streamer.residentLevel[texture.layer] == TEXTURE_LEVELS)
+			budget -= UploadTextureLevels(streamer, stream, texture, TEXTURE_PLACEHOLDER_LEVEL, TEXTURE_LEVELS);
+	}
+	for (bool progressed = true; progressed && budget > 0;)
+	{
+		progressed = false;
+		for (size_t i = 0; i < streamer.uploading.size() && budget > 0; i++)
+		{
+			const StreamedTexture& texture = *streamer.uploading[i];
+			GLint level = streamer.residentLevel[texture.layer] - 1;
+			if (level < 0)
+				continue;
+			budget -= UploadTextureLevels(streamer, stream, texture, level, level + 1);
+			progressed = true;
+		}
+	}
+	streamer.uploading.erase(remove_if(streamer.uploading.begin(), streamer.uploading.end(),
+		[&](const unique_ptr<StreamedTexture>& texture) { return streamer.residentLevel[texture->layer] == 0; }), streamer.uploading.end());
+
+	GLuint showing = 0, complete = 0;
+	for (size_t layer = 0; layer < streamer.residentLevel.size(); layer++)
+	{
+		showing += streamer.residentLevel[layer] < TEXTURE_LEVELS ? 1 : 0;
+		complete += streamer.residentLevel[layer] == 0 ? 1 : 0;
+	}
+	double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - streamer.startTime).count();
+	if (streamer.placeholderMilliseconds < 0.0 && showing + streamer.failedLayers == streamer.residentLevel.size())
+		streamer.placeholderMilliseconds = elapsed;
+	if (complete + streamer.failedLayers == streamer.residentLevel.size())
+	{
+		streamer.completeMilliseconds = elapsed;
+		ReleaseGpuObject(streamer.unpackBuffer);	// Nothing left to stage
+	}
+}
+
+bool IsTextureStreamingDone(const TextureStreamer& streamer)
+{
+	return streamer.array == 0 || streamer.completeMilliseconds >= 0.0;
+}
+
+// Block until every layer is complete. Only the measuring modes call this, so their frames are reproducible.
+void FinishTextureStreaming(TextureStreamer& streamer, StreamBuffer& stream)
+{
+	while (!IsTextureStreamingDone(streamer))
+	{
+		PumpTextureStreaming(streamer, stream);
+		if (!IsTextureStreamingDone(streamer))
+			this_thread::sleep_for(chrono::milliseconds(1));
+	}
+}
+
+void StopTextureStreaming(TextureStreamer& streamer)
+{
+	streamer.cancel = true;
+	for (size_t i = 0; i < streamer.loaders.size(); i++)
+		streamer.loaders[i].join();
+	streamer.loaders.clear();
+	streamer.loaded.clear();
+	streamer.uploading.clear();
+	streamer.paths.clear();
+	streamer.residentLevel.clear();
+	streamer.failedLayers = 0;
+	streamer.uploadedBytes = 0;
+	streamer.placeholderMilliseconds = streamer.completeMilliseconds = -1.0;
+	ReleaseGpuObject(streamer.unpackBuffer);
+	ReleaseGpuObject(streamer.array);
+}
+
+/* Texture Streaming Definitions End Here */
+
+/* Clustered Lighting Definitions */
+
+// Point lights are shaded per fragment from short per-cluster lists instead of looping over every
+// light. The view frustum is cut into CLUSTER_TILES_X x CLUSTER_TILES_Y screen tiles and
+// CLUSTER_SLICES depth slices, spaced exponentially between the projection's near and far planes.
+// Each frame the job workers place every light in the clusters its sphere touches, one depth slice
+// per job. The lights, a (first, count) pair per cluster and the packed light indices then go to the
+// GPU as shader storage through the frame stream. A scene without lights stays unlit.
+const GLuint CLUSTER_TILES_X = 16;
+const GLuint CLUSTER_TILES_Y = 9;
+const GLuint CLUSTER_SLICES = 24;
+const GLuint CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+const GLuint CLUSTER_MAX_LIGHTS = 128;			// Per cluster; further lights are dropped from it
+const GLfloat CLUSTER_NEAR = NEAR_PLANE;		// Slices span the view's clip range
+const GLfloat CLUSTER_FAR = FAR_PLANE;
+const GLfloat LIGHT_AMBIENT = 0.3f;				// Share of the surface color lit scenes show without any light
+const GLuint LIGHT_BUFFER_BINDING = 2;			// Shader storage bindings; the indirect path uses 0 and 1
+const GLuint CLUSTER_BUFFER_BINDING = 3;
+const GLuint LIGHT_INDEX_BUFFER_BINDING = 4;
+
+// std430 mirror of one light as the shader reads it, in view space
+struct GpuPointLight
+{
+	glm::vec4 positionRadius;
+	glm::vec4 color;
+};
+
+struct ClusterLighting
+{
+	vector<SceneLightRecord> lights;		// From the scene, relative to their nodes
+	vector<GpuPointLight> viewLights;		// This frame's view-space copies
+	vector<glm::uvec2> lightSlices;			// Per light: first and last depth slice it reaches, first > last when it is out of view
+	vector<vector<GLuint>> clusterLights;	// Per cluster, rebuilt each frame; the vectors keep their capacity
+	vector<glm::uvec2> clusterRanges;		// Per cluster: first index and count in clusterIndices
+	vector<GLuint> clusterIndices;
+	GpuBuffer lightBuffer, clusterBuffer, indexBuffer;	// Used when the frame stream has no room
+	glm::vec2 projectionScale = glm::vec2(1.0f);	// projection[0][0] and [1][1] of the frame being assigned
+	GLuint assignedLights = 0;				// Light-cluster pairs in the last frame
+	GLuint busiestCluster = 0;
+	atomic<GLuint> droppedLights{ 0 };
+};
+
+ClusterLighting sceneLighting;
+bool lightingEnabled = true;
+
+// Clustered shading reads shader storage from the fragment shader
+bool IsClusteredLightingSupported()
+{
+	return GLEW_VERSION_4_3 != 0;
+}
+
+// Depth slice holding a view depth (distance in front of the camera)
+GLuint ClusterSlice(GLfloat depth)
+{
+	GLfloat slice = logf(max(depth, CLUSTER_NEAR) / CLUSTER_NEAR) / logf(CLUSTER_FAR / CLUSTER_NEAR) * CLUSTER_SLICES;
+	return (GLuint)glm::clamp(slice, 0.0f, (GLfloat)(CLUSTER_SLICES - 1));
+}
+
+GLfloat ClusterSliceNear(GLuint slice)
+{
+	return CLUSTER_NEAR * powf(CLUSTER_FAR / CLUSTER_NEAR, (GLfloat)slice / CLUSTER_SLICES);
+}
+
+// Log-depth to slice mapping the shaders use: slice = log(depth) * x + y
+glm::vec2 ClusterDepthMapping()
+{
+	GLfloat sliceScale = CLUSTER_SLICES / logf(CLUSTER_FAR / CLUSTER_NEAR);
+	return glm::vec2(sliceScale, -logf(CLUSTER_NEAR) * sliceScale);
+}
+
+// The scene's lights and room for their cluster lists; the software backend needs nothing more
+void LoadClusterLights(ClusterLighting& lighting, const SceneFile& scene)
+{
+	lighting.lights.assign(scene.lights, scene.lights + scene.header->lightCount);
+	lighting.viewLights.resize(lighting.lights.size());
+	lighting.lightSlices.resize(lighting.lights.size());
+	lighting.clusterLights.assign(CLUSTER_COUNT, vector<GLuint>());
+	lighting.clusterRanges.resize(CLUSTER_COUNT);
+}
+
+void CreateClusterLighting(ClusterLighting& lighting, const SceneFile& scene)
+{
+	LoadClusterLights(lighting, scene);
+	CreateGpuObject(lighting.lightBuffer, "point lights");
+	CreateGpuObject(lighting.clusterBuffer, "light clusters");
+	CreateGpuObject(lighting.indexBuffer, "light cluster indices");
+}
+
+void DestroyClusterLighting(ClusterLighting& lighting)
+{
+	ReleaseGpuObject(lighting.lightBuffer);
+	ReleaseGpuObject(lighting.clusterBuffer);
+	ReleaseGpuObject(lighting.indexBuffer);
+	lighting.lights.clear();
+}
+
+// Conservative tile rectangle covered by a view-space box in front of the camera
+static bool ClusterTileRect(const ClusterLighting& lighting, const glm::vec3& boxMin, const glm::vec3& boxMax, GLuint* tiles)
+{
+	// x / depth over the box is extreme at its corners; depths are positive here
+	GLfloat nearDepth = -boxMax.z, farDepth = -boxMin.z;
+	GLfloat left = min(boxMin.x / nearDepth, boxMin.x / farDepth) * lighting.projectionScale.x;
+	GLfloat right = max(boxMax.x / nearDepth, boxMax.x / farDepth) * lighting.projectionScale.x;
+	GLfloat bottom = min(boxMin.y / nearDepth, boxMin.y / farDepth) * lighting.projectionScale.y;
+	GLfloat top = max(boxMax.y / nearDepth, boxMax.y / farDepth) * lighting.projectionScale.y;
+	if (left > 1.0f || right < -1.0f || bottom > 1.0f || top < -1.0f)
+		return false;
+	tiles[0] = (GLuint)glm::clamp((left * 0.5f + 0.5f) * CLUSTER_TILES_X, 0.0f, (GLfloat)(CLUSTER_TILES_X - 1));
+	tiles[1] = (GLuint)glm::clamp((right * 0.5f + 0.5f) * CLUSTER_TILES_X, 0.0f, (GLfloat)(CLUSTER_TILES_X - 1));
+	tiles[2] = (GLuint)glm::clamp((bottom * 0.5f + 0.5f) * CLUSTER_TILES_Y, 0.0f, (GLfloat)(CLUSTER_TILES_Y - 1));
+	tiles[3] = (GLuint)glm::clamp((top * 0.5f + 0.5f) * CLUSTER_TILES_Y, 0.0f, (GLfloat)(CLUSTER_TILES_Y - 1));
+	return true;
+}
+
+// Move the lights into view space and list each cluster's lights, across the job workers
+void AssignLightClusters(ClusterLighting& lighting, const SceneGraph& graph, const glm::mat4& view, const glm::mat4& projection, JobSystem& jobs)
+{
+	lighting.projectionScale = glm::vec2(projection[0][0], projection[1][1]);
+	lighting.droppedLights = 0;
+
+	// View-space centers, lights following their nodes, and the depth slices each sphere spans
+	ParallelFor(jobs, (GLuint)lighting.lights.size(), 256, [&](GLuint begin, GLuint end) {
+		for (GLuint i = begin; i < end; i++)
+		{
+			const SceneLightRecord& light = lighting.lights[i];
+			glm::vec4 world = glm::vec4(light.position[0], light.position[1], light.position[2], 1.0f);
+			if (light.node != SCENE_NO_NODE)
+				world = graph.worldMatrices[light.node] * world;
+			glm::vec3 center = glm::vec3(view * world);
+			lighting.viewLights[i].positionRadius = glm::vec4(center, light.radius);
+			lighting.viewLights[i].color = glm::vec4(light.color[0], light.color[1], light.color[2], 0.0f);
+
+			GLfloat nearDepth = -center.z - light.radius, farDepth = -center.z + light.radius;
+			if (farDepth < CLUSTER_NEAR || nearDepth > CLUSTER_FAR)
+				lighting.lightSlices[i] = glm::uvec2(1, 0);
+			else
+				lighting.lightSlices[i] = glm::uvec2(ClusterSlice(nearDepth), ClusterSlice(farDepth));
+		}
+	});
+
+	// One slice per job: every cluster list is written by exactly one worker
+	ParallelFor(jobs, CLUSTER_SLICES, 1, [&](GLuint beginSlice, GLuint endSlice) {
+		GLuint dropped = 0;
+		for (GLuint slice = beginSlice; slice < endSlice; slice++)
+		{
+			vector<GLuint>* sliceClusters = &lighting.clusterLights[(size_t)slice * CLUSTER_TILES_X * CLUSTER_TILES_Y];
+			for (GLuint cluster = 0; cluster < CLUSTER_TILES_X * CLUSTER_TILES_Y; cluster++)
+				sliceClusters[cluster].clear();
+
+			GLfloat sliceNear = ClusterSliceNear(slice), sliceFar = ClusterSliceNear(slice + 1);
+			for (GLuint i = 0; i < (GLuint)lighting.lights.size(); i++)
+			{
+				if (slice < lighting.lightSlices[i].x || slice > lighting.lightSlices[i].y)
+					continue;
+
+				// The sphere's box, cut down to the slice's depths
+				glm::vec3 center = glm::vec3(lighting.viewLights[i].positionRadius);
+				GLfloat radius = lighting.viewLights[i].positionRadius.w;
+				glm::vec3 boxMin = center - glm::vec3(radius), boxMax = center + glm::vec3(radius);
+				boxMin.z = max(boxMin.z, -sliceFar);
+				boxMax.z = min(boxMax.z, -sliceNear);
+				GLuint tiles[4];
+				if (boxMin.z > boxMax.z || !ClusterTileRect(lighting, boxMin, boxMax, tiles))
+					continue;
+				for (GLuint y = tiles[2]; y <= tiles[3]; y++)
+					for (GLuint x = tiles[0]; x <= tiles[1]; x++)
+					{
+						vector<GLuint>& clusterLights = sliceClusters[y * CLUSTER_TILES_X + x];
+						if (clusterLights.size() < CLUSTER_MAX_LIGHTS)
+							clusterLights.push_back(i);
+						else
+							dropped++;
+					}
+			}
+		}
+		lighting.droppedLights += dropped;
+	});
+
+	// Pack the lists back to back
+	lighting.clusterIndices.clear();
+	lighting.busiestCluster = 0;
+	for (GLuint cluster = 0; cluster < CLUSTER_COUNT; cluster++)
+	{
+		const vector<GLuint>& clusterLights = lighting.clusterLights[cluster];
+		lighting.clusterRanges[cluster] = glm::uvec2((GLuint)lighting.clusterIndices.size(), (GLuint)clusterLights.size());
+		lighting.clusterIndices.insert(lighting.clusterIndices.end(), clusterLights.begin(), clusterLights.end());
+		lighting.busiestCluster = max(lighting.busiestCluster, (GLuint)clusterLights.size());
+	}
+	lighting.assignedLights = (GLuint)lighting.clusterIndices.size();
+	if (lighting.clusterIndices.empty())
+		lighting.clusterIndices.push_back(0); // Storage ranges may not be empty
+}
+
+// Bind one of the lighting arrays as shader storage, from the frame stream when it has room
+static void UploadLightingArray(StreamBuffer& stream, const GpuBuffer& fallback, GLuint binding, const void* data, GLsizeiptr bytes)
+{
+	BufferRange range = StreamOrOrphan(stream, GL_SHADER_STORAGE_BUFFER, fallback, data, bytes);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, binding, range.buffer, range.offset, range.size);
+}
+
+void UploadLightClusters(const ClusterLighting& lighting, StreamBuffer& stream)
+{
+	UploadLightingArray(stream, lighting.lightBuffer, LIGHT_BUFFER_BINDING, lighting.viewLights.data(), lighting.viewLights.size() * sizeof(GpuPointLight));
+	UploadLightingArray(stream, lighting.clusterBuffer, CLUSTER_BUFFER_BINDING, lighting.clusterRanges.data(), lighting.clusterRanges.size() * sizeof(glm::uvec2));
+	UploadLightingArray(stream, lighting.indexBuffer, LIGHT_INDEX_BUFFER_BINDING, lighting.clusterIndices.data(), lighting.clusterIndices.size() * sizeof(GLuint));
+}
+
+// GLSL that finds a fragment's cluster and adds up its lights; needs FrameBlock and a 4.3 shader
+string ClusterLightingSource()
+{
+	return
+		"struct PointLight { vec4 positionRadius; vec4 color; };"
+		"layout(std430, binding = " + to_string(LIGHT_BUFFER_BINDING) + ") readonly buffer LightBuffer { PointLight lights[]; };"
+		"layout(std430, binding = " + to_string(CLUSTER_BUFFER_BINDING) + ") readonly buffer ClusterBuffer { uvec2 clusters[]; };"
+		"layout(std430, binding = " + to_string(LIGHT_INDEX_BUFFER_BINDING) + ") readonly buffer LightIndexBuffer { uint lightIndices[]; };"
+		"vec3 ClusterLight(vec3 position, vec3 normal)\n"
+		"{\n"
+		"ivec2 tile = clamp(ivec2((gl_FragCoord.xy - viewport.xy) / viewport.zw * clusterGrid.xy), ivec2(0), ivec2(clusterGrid.xy) - 1);"
+		"int slice = clamp(int(log(-position.z) * clusterDepth.x + clusterDepth.y), 0, int(clusterGrid.z) - 1);"
+		"uvec2 range = clusters[(slice * int(clusterGrid.y) + tile.y) * int(clusterGrid.x) + tile.x];"
+		"vec3 light = vec3(clusterDepth.z);"
+		"for (uint i = 0u; i < range.y; i++)"
+		"{"
+		"PointLight pointLight = lights[lightIndices[range.x + i]];"
+		"vec3 toLight = pointLight.positionRadius.xyz - position;"
+		"float distance = length(toLight);"
+		"float window = clamp(1.0 - pow(distance / pointLight.positionRadius.w, 4.0), 0.0, 1.0);"
+		"light += pointLight.color.rgb * max(dot(normal, toLight / max(distance, 1e-4)), 0.0) * window * window / (1.0 + distance * distance);"
+		"}"
+		"return light;"
+		"}\n";
+}
+
+// ClusterLight from ClusterLightingSource on the CPU, for the software rasterizer. fragCoord is the
+// pixel center in a viewport of viewportSize.
+glm::vec3 ClusterLightAt(const ClusterLighting& lighting, const glm::vec3& position, const glm::vec3& normal, const glm::vec2& fragCoord, const glm::vec2& viewportSize)
+{
+	glm::vec2 depthMapping = ClusterDepthMapping();
+	int tileX = glm::clamp((int)(fragCoord.x / viewportSize.x * CLUSTER_TILES_X), 0, (int)CLUSTER_TILES_X - 1);
+	int tileY = glm::clamp((int)(fragCoord.y / viewportSize.y * CLUSTER_TILES_Y), 0, (int)CLUSTER_TILES_Y - 1);
+	int slice = glm::clamp((int)(logf(max(-position.z, CLUSTER_NEAR)) * depthMapping.x + depthMapping.y), 0, (int)CLUSTER_SLICES - 1);
+	const glm::uvec2& range = lighting.clusterRanges[((size_t)slice * CLUSTER_TILES_Y + tileY) * CLUSTER_TILES_X + tileX];
+
+	glm::vec3 light = glm::vec3(LIGHT_AMBIENT);
+	for (GLuint i = 0; i < range.y; i++)
+	{
+		const GpuPointLight& pointLight = lighting.viewLights[lighting.clusterIndices[range.x + i]];
+		glm::vec3 toLight = glm::vec3(pointLight.positionRadius) - position;
+		GLfloat distance = glm::length(toLight);
+		GLfloat window = glm::clamp(1.0f - powf(distance / pointLight.positionRadius.w, 4.0f), 0.0f, 1.0f);
+		light += glm::vec3(pointLight.color) * (max(glm::dot(normal, toLight / max(distance, 1e-4f)), 0.0f) * window * window / (1.0f + distance * distance));
+	}
+	return light;
+}
+
+/* Clustered Lighting Definitions End Here */
+
+/* Uniform Block Definitions */
+
+// Binding points shared by every program; CreateShaderProgram attaches the blocks to them
+const GLuint FRAME_BLOCK_BINDING = 0;
+const GLuint OBJECT_BLOCK_BINDING = 1;
+const GLuint OBJECT_BLOCK_CAPACITY = 256;	// Model matrices per ObjectBlock range: 16 KB, the smallest GL_MAX_UNIFORM_BLOCK_SIZE allowed
+
+// std140 mirror of the FrameBlock uniform block, written once per frame
+struct FrameUniforms
+{
+	glm::mat4 view;
+	glm::mat4 projection;
+	glm::vec4 viewport;		// x, y, width, height
+	GLfloat time;			// Seconds since InitScene
+	GLfloat padding[3];
+	glm::vec4 textureLevels[TEXTURE_MAX_LAYERS / 4];	// Finest resident level of each texture layer, TEXTURE_LEVELS while none is
+	glm::vec4 clusterGrid;		// Tiles across, tiles down, depth slices, lights (0 leaves the scene unlit)
+	glm::vec4 clusterDepth;		// Slice of a view depth is log(depth) * x + y; z is the ambient level
+};
+
+// GLSL declaration of FrameBlock, shared by every program so the layouts cannot drift apart
+string FrameBlockSource()
+{
+	return "layout(std140) uniform FrameBlock { mat4 view; mat4 projection; vec4 viewport; float time; vec4 textureLevels["
+		+ to_string(TEXTURE_MAX_LAYERS / 4) + "]; vec4 clusterGrid; vec4 clusterDepth; };";
+}
+
+// Plain uniforms a program uses between draws, looked up once when it links
+struct ShaderUniforms
+{
+	GLint objectIndex = -1;
+	GLint instanced = -1;
+	GLint positionScale = -1;
+	GLint positionBias = -1;
+	GLint textureLayer = -1;
+	GLint uvPlaneU = -1;
+	GLint uvPlaneV = -1;
+};
+
+// GPU buffers behind FrameBlock and ObjectBlock
+struct UniformBuffers
+{
+	GpuBuffer frameBuffer;
+	GpuBuffer objectBuffer;
+	GLuint objectRangeStride = 0;		// Bytes between ObjectBlock ranges, a multiple of the offset alignment
+	GLuint boundObjectRange = 0;
+	BufferRange objectRanges = {};		// This frame's ranges: objectBuffer or a stream slice
+	vector<glm::mat4> objectStaging;	// Matrices laid out range by range
+};
+
+UniformBuffers sceneUniforms;
+
+bool CreateUniformBuffers(UniformBuffers& uniforms)
+{
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	GLuint rangeBytes = OBJECT_BLOCK_CAPACITY * sizeof(glm::mat4);
+	uniforms.objectRangeStride = (rangeBytes + alignment - 1) / alignment * alignment;
+
+	CreateGpuObject(uniforms.frameBuffer, "FrameBlock");
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms.frameBuffer);
+	bool created = GpuBufferData(uniforms.frameBuffer, GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+	CreateGpuObject(uniforms.objectBuffer, "ObjectBlock ranges");
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	return created;
+}
+
+void UploadFrameUniforms(const UniformBuffers& uniforms, const FrameUniforms& frame, StreamBuffer& stream)
+{
+	StreamSlice slice = AllocateStream(stream, sizeof(FrameUniforms));
+	if (slice.data)
+	{
+		memcpy(slice.data, &frame, sizeof(FrameUniforms));
+		glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, slice.range.buffer, slice.range.offset, sizeof(FrameUniforms));
+		return;
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms.frameBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, uniforms.frameBuffer);
+}
+
+// Upload model matrices as consecutive ObjectBlock ranges of OBJECT_BLOCK_CAPACITY, then bind the first
+void UploadObjectUniforms(UniformBuffers& uniforms, const glm::mat4* matrices, GLuint count, StreamBuffer& stream)
+{
+	GLuint matricesPerStride = uniforms.objectRangeStride / sizeof(glm::mat4);
+	GLuint rangeCount = max(1u, (count + OBJECT_BLOCK_CAPACITY - 1) / OBJECT_BLOCK_CAPACITY);
+	GLsizeiptr bytes = (GLsizeiptr)rangeCount * uniforms.objectRangeStride;
+	uniforms.objectStaging.resize((size_t)rangeCount * matricesPerStride);
+	glm::mat4* ranges = uniforms.objectStaging.data();
+	for (GLuint range = 0; range < rangeCount; range++)
+	{
+		GLuint first = range * OBJECT_BLOCK_CAPACITY;
+		GLuint rangeCountUsed = min(OBJECT_BLOCK_CAPACITY, count - min(count, first));
+		copy(matrices + first, matrices + first + rangeCountUsed, ranges + (size_t)range * matricesPerStride);
+	}
+
+	uniforms.objectRanges = StreamOrOrphan(stream, GL_UNIFORM_BUFFER, uniforms.objectBuffer, ranges, bytes);
+
+	uniforms.boundObjectRange = 0;
+	glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, uniforms.objectRanges.buffer, uniforms.objectRanges.offset, OBJECT_BLOCK_CAPACITY * sizeof(glm::mat4));
+}
+
+// Make the range holding an object current, returning the object's index within the block
+GLint BindObjectUniforms(UniformBuffers& uniforms, GLuint object)
+{
+	GLuint range = object / OBJECT_BLOCK_CAPACITY;
+	if (range != uniforms.boundObjectRange)
+	{
+		glBindBufferRange(GL_UNIFORM_BUFFER, OBJECT_BLOCK_BINDING, uniforms.objectRanges.buffer, uniforms.objectRanges.offset + (GLintptr)range * uniforms.objectRangeStride, OBJECT_BLOCK_CAPACITY * sizeof(glm::mat4));
+		uniforms.boundObjectRange = range;
+	}
+	return (GLint)(object % OBJECT_BLOCK_CAPACITY);
+}
+
+void DeleteUniformBuffers(UniformBuffers& uniforms)
+{
+	ReleaseGpuObject(uniforms.frameBuffer);
+	ReleaseGpuObject(uniforms.objectBuffer);
+}
+
+/* Uniform Block Definitions End Here */
+
+/* Shader Cache Definitions */
+
+// Linked program binaries are kept in shaderCacheDirectory, one file per program, named by a
+// hash of both sources and the driver's vendor, renderer and version strings. A driver update
+// changes the hash, and a binary the driver rejects falls back to a normal compile.
+const GLuint SHADER_CACHE_MAGIC = 0x48435350;	// "PSCH"
+
+struct ShaderCacheHeader
+{
+	GLuint magic;
+	GLenum binaryFormat;
+	GLuint binaryLength;
+	GLuint padding;
+	uint64_t key;				// Guards against hash-named files being swapped
+};
+
+string shaderCacheDirectory = "ShaderCache";
+bool shaderCacheEnabled = true;
+GLuint shaderCacheHits = 0, shaderCacheMisses = 0;
+
+// 64-bit FNV-1a
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+uint64_t ShaderCacheKey(const string& vertexShader, const string& fragmentShader)
+{
+	const char* driverStrings[3] = { (const char*)glGetString(GL_VENDOR), (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION) };
+	uint64_t hash = HashBytes(vertexShader.data(), vertexShader.size() + 1);		// Terminators separate the parts
+	hash = HashBytes(fragmentShader.data(), fragmentShader.size() + 1, hash);
+	for (GLuint i = 0; i < 3; i++)
+		if (driverStrings[i] != nullptr)
+			hash = HashBytes(driverStrings[i], strlen(driverStrings[i]) + 1, hash);
+	return hash;
+}
+
+string ShaderCachePath(uint64_t key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+	return shaderCacheDirectory + "/" + name;
+}
+
+bool IsProgramBinarySupported()
+{
+	if (!shaderCacheEnabled || !(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary))
+		return false;
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+// Create a program from a cached binary, or return 0 when there is none or the driver rejects it
+GLuint LoadCachedProgram(uint64_t key)
+{
+	ifstream in(ShaderCachePath(key), ios::binary);
+	ShaderCacheHeader header;
+	if (!in.read((char*)&header, sizeof(header)) || header.magic != SHADER_CACHE_MAGIC || header.key != key)
+		return 0;
+	vector<char> binary(header.binaryLength);
+	if (!in.read(binary.data(), binary.size()))
+		return 0;
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header.binaryFormat, binary.data(), (GLsizei)binary.size());
+	GLint linked = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (linked != GL_TRUE)
+	{
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+void StoreCachedProgram(uint64_t key, GLuint program)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	ShaderCacheHeader header = { SHADER_CACHE_MAGIC, 0, 0, 0, key };
+	vector<char> binary(length);
+	GLsizei written = 0;
+	glGetProgramBinary(program, length, &written, &header.binaryFormat, binary.data());
+	header.binaryLength = (GLuint)written;
+
+#ifdef _WIN32
+	_mkdir(shaderCacheDirectory.c_str());
+#else
+	mkdir(shaderCacheDirectory.c_str(), 0755);
+#endif
+	ofstream out(ShaderCachePath(key), ios::binary | ios::trunc);
+	out.write((const char*)&header, sizeof(header));
+	out.write(binary.data(), written);
+	if (!out)
+		cout << "Shader Cache Error: cannot write " << ShaderCachePath(key) << endl;
+}
+
+/* Shader Cache Definitions End Here */
+
+// Create and Compile Shaders
+static GLuint CompileShader(const string& source, GLuint shaderType)
+{
+	// Create Shader object
+	GLuint shaderID = glCreateShader(shaderType);
+	const char* src = source.c_str();
+
+	// Attach source code to Shader object
+	glShaderSource(shaderID, 1, &src, nullptr);
+
+	// Compile Shader
+	glCompileShader(shaderID);
+
+	/* Shader Compile Error Check */
+	GLint compiled;
+	glGetShaderiv(shaderID, GL_COMPILE_STATUS, &compiled);
+	if (compiled != GL_TRUE)
+	{
+		cout << "Shader Compile Failed!" << endl;
+		PrintShaderCompileError(shaderID);
+	}
+	/* End here */
+
+	// Return ID of Compiled shader
+	return shaderID;
+
+}
+
+// Create Program Object, optionally returning the locations of its per-draw uniforms.
+// Uses the on-disk binary cache when the driver supports it.
+static GLuint CreateShaderProgram(const string& vertexShader, const string& fragmentShader, ShaderUniforms* uniforms = nullptr)
+{
+	bool useCache = IsProgramBinarySupported();
+	uint64_t cacheKey = useCache ? ShaderCacheKey(vertexShader, fragmentShader) : 0;
+	GLuint shaderProgram = useCache ? LoadCachedProgram(cacheKey) : 0;
+
+	if (shaderProgram != 0)
+		shaderCacheHits++;
+	else
+	{
+		if (useCache)
+			shaderCacheMisses++;
+
+		// Compile vertex shader
+		GLuint vertexShaderComp = CompileShader(vertexShader, GL_VERTEX_SHADER);
+
+		// Compile fragment shader
+		GLuint fragmentShaderComp = CompileShader(fragmentShader, GL_FRAGMENT_SHADER);
+
+		// Create program object
+		shaderProgram = glCreateProgram();
+
+		// Attach vertex and fragment shaders to program object
+		glAttachShader(shaderProgram, vertexShaderComp);
+		glAttachShader(shaderProgram, fragmentShaderComp);
+
+		// Link shaders to create executable
+		if (useCache)
+			glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		glLinkProgram(shaderProgram);
+
+		/* Shader Linking Error Check */
+		GLint linked;
+		glGetProgramiv(shaderProgram, GL_LINK_STATUS, &linked);
+		if (linked != GL_TRUE)
+		{
+			cout << "Shader Linking Failed!" << endl;
+			PrintShaderLinkingError(shaderProgram);
+		}
+		else if (useCache)
+			StoreCachedProgram(cacheKey, shaderProgram);
+		/* End here */
+
+		// Delete compiled vertex and fragment shaders
+		glDeleteShader(vertexShaderComp);
+		glDeleteShader(fragmentShaderComp);
+	}
+
+	// Attach the uniform blocks to the shared binding points (not part of a saved binary)
+	GLuint frameBlock = glGetUniformBlockIndex(shaderProgram, "FrameBlock");
+	if (frameBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(shaderProgram, frameBlock, FRAME_BLOCK_BINDING);
+	GLuint objectBlock = glGetUniformBlockIndex(shaderProgram, "ObjectBlock");
+	if (objectBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(shaderProgram, objectBlock, OBJECT_BLOCK_BINDING);
+
+	if (uniforms != nullptr)
+	{
+		uniforms->objectIndex = glGetUniformLocation(shaderProgram, "objectIndex");
+		uniforms->instanced = glGetUniformLocation(shaderProgram, "instanced");
+		uniforms->positionScale = glGetUniformLocation(shaderProgram, "positionScale");
+		uniforms->positionBias = glGetUniformLocation(shaderProgram, "positionBias");
+		uniforms->textureLayer = glGetUniformLocation(shaderProgram, "textureLayer");
+		uniforms->uvPlaneU = glGetUniformLocation(shaderProgram, "uvPlaneU");
+		uniforms->uvPlaneV = glGetUniformLocation(shaderProgram, "uvPlaneV");
+	}
+
+	// Return Shader Program
+	return shaderProgram;
+
+}
+
+
+/* Profiler Definitions */
+
+// Samples from named CPU scopes and GPU passes go into one lock-free ring and are exported as a
+// Chrome trace (chrome://tracing or Perfetto). GPU passes are timed with GL_TIME_ELAPSED queries
+// that are read back GPU_QUERY_FRAMES frames later, so the profiler never waits on the GPU.
+const GLuint PROFILE_RING_CAPACITY = 1 << 16;
+const GLuint GPU_QUERY_FRAMES = 4;
+const GLuint GPU_QUERIES_PER_FRAME = 64;
+const uint32_t GPU_PROFILE_THREAD = 0;	// Thread ID used for GPU samples in the trace
+
+struct ProfileSample
+{
+	const char* name;			// Must outlive the profiler: literals or mesh names
+	double startMicroseconds;	// Since profileEpoch
+	double durationMicroseconds;
+	uint32_t thread;
+	uint32_t frame;
+};
+
+// Multi-producer ring: writers claim a slot with one atomic add and publish it through the slot's
+// sequence number, so readers can skip slots that are still being written. Old samples are overwritten.
+struct ProfileRing
+{
+	ProfileSample samples[PROFILE_RING_CAPACITY];
+	atomic<uint64_t> sequences[PROFILE_RING_CAPACITY];
+	atomic<uint64_t> writeIndex;
+};
+
+bool profilerEnabled = false;
+ProfileRing profileRing;
+chrono::steady_clock::time_point profileEpoch = chrono::steady_clock::now();
+uint32_t profileFrame = 0;
+atomic<uint32_t> profileThreadCount(1);
+
+double ProfileMicroseconds()
+{
+	return chrono::duration<double, micro>(chrono::steady_clock::now() - profileEpoch).count();
+}
+
+// Small per-thread number for the trace, 1 for the first thread that records a sample
+uint32_t ProfileThreadId()
+{
+	thread_local uint32_t id = profileThreadCount.fetch_add(1);
+	return id;
+}
+
+void PushProfileSample(const ProfileSample& sample)
+{
+	uint64_t index = profileRing.writeIndex.fetch_add(1, memory_order_relaxed);
+	GLuint slot = (GLuint)(index % PROFILE_RING_CAPACITY);
+	profileRing.sequences[slot].store(0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	profileRing.samples[slot] = sample;
+	profileRing.sequences[slot].store(index + 1, memory_order_release);
+}
+
+// Times the enclosing block on the calling thread
+struct ProfileScope
+{
+	const char* name;
+	double start;
+
+	explicit ProfileScope(const char* scopeName) : name(scopeName), start(profilerEnabled ? ProfileMicroseconds() : 0.0) {}
+	~ProfileScope()
+	{
+		if (!profilerEnabled)
+			return;
+		ProfileSample sample = { name, start, ProfileMicroseconds() - start, ProfileThreadId(), profileFrame };
+		PushProfileSample(sample);
+	}
+};
+
+// One frame's worth of GL_TIME_ELAPSED queries
+struct GpuQueryFrame
+{
+	GLuint queries[GPU_QUERIES_PER_FRAME];
+	const char* names[GPU_QUERIES_PER_FRAME];
+	double submitMicroseconds[GPU_QUERIES_PER_FRAME];	// CPU time the pass was issued, used to place it in the trace
+	GLuint count;
+	uint32_t frame;
+};
+
+struct GpuProfiler
+{
+	GpuQueryFrame frames[GPU_QUERY_FRAMES];
+	GLuint current = 0;
+	bool passOpen = false;
+	bool supported = false;
+	GLuint droppedFrames = 0;	// Results still pending when their frame slot came around again
+};
+
+GpuProfiler gpuProfiler;
+
+void CreateGpuProfiler(GpuProfiler& profiler)
+{
+	profiler.supported = profilerEnabled && (GLEW_VERSION_3_3 || GLEW_ARB_timer_query);
+	if (!profiler.supported)
+		return;
+	for (GLuint i = 0; i < GPU_QUERY_FRAMES; i++)
+	{
+		glGenQueries(GPU_QUERIES_PER_FRAME, profiler.frames[i].queries);
+		profiler.frames[i].count = 0;
+	}
+}
+
+// Turn a frame's finished queries into samples. Without wait, a frame whose last query has not
+// finished is dropped rather than stalling; queries finish in order, so the last one decides.
+void CollectGpuQueries(GpuProfiler& profiler, GpuQueryFrame& frame, bool wait)
+{
+	if (frame.count == 0)
+		return;
+
+	GLuint available = GL_FALSE;
+	glGetQueryObjectuiv(frame.queries[frame.count - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (available == GL_TRUE || wait)
+	{
+		for (GLuint i = 0; i < frame.count; i++)
+		{
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &elapsed);
+			ProfileSample sample = { frame.names[i], frame.submitMicroseconds[i], elapsed / 1000.0, GPU_PROFILE_THREAD, frame.frame };
+			PushProfileSample(sample);
+		}
+	}
+	else
+		profiler.droppedFrames++;
+	frame.count = 0;
+}
+
+// Move to the next query frame, first harvesting the results it held GPU_QUERY_FRAMES frames ago
+void BeginGpuFrame(GpuProfiler& profiler)
+{
+	if (!profiler.supported)
+		return;
+	profiler.current = (profiler.current + 1) % GPU_QUERY_FRAMES;
+	GpuQueryFrame& frame = profiler.frames[profiler.current];
+	CollectGpuQueries(profiler, frame, false);
+	frame.frame = profileFrame;
+}
+
+// Time the GL work issued until EndGpuPass. Passes cannot nest.
+void BeginGpuPass(GpuProfiler& profiler, const char* name)
+{
+	GpuQueryFrame& frame = profiler.frames[profiler.current];
+	if (!profiler.supported || profiler.passOpen || frame.count == GPU_QUERIES_PER_FRAME)
+		return;
+	frame.names[frame.count] = name;
+	frame.submitMicroseconds[frame.count] = ProfileMicroseconds();
+	glBeginQuery(GL_TIME_ELAPSED, frame.queries[frame.count]);
+	profiler.passOpen = true;
+}
+
+void EndGpuPass(GpuProfiler& profiler)
+{
+	if (!profiler.passOpen)
+		return;
+	glEndQuery(GL_TIME_ELAPSED);
+	profiler.frames[profiler.current].count++;
+	profiler.passOpen = false;
+}
+
+// Wait for every outstanding query and release them
+void DeleteGpuProfiler(GpuProfiler& profiler)
+{
+	if (!profiler.supported)
+		return;
+	for (GLuint i = 1; i <= GPU_QUERY_FRAMES; i++)	// Oldest first
+		CollectGpuQueries(profiler, profiler.frames[(profiler.current + i) % GPU_QUERY_FRAMES], true);
+	for (GLuint i = 0; i < GPU_QUERY_FRAMES; i++)
+		glDeleteQueries(GPU_QUERIES_PER_FRAME, profiler.frames[i].queries);
+	profiler.supported = false;
+}
+
+// Write every published sample still in the ring as Chrome trace JSON
+bool ExportChromeTrace(const string& path)
+{
+	ofstream out(path, ios::trunc);
+	if (!out)
+	{
+		cout << "Profiler Error: cannot write " << path << endl;
+		return false;
+	}
+
+	uint64_t end = profileRing.writeIndex.load(memory_order_acquire);
+	uint64_t begin = end > PROFILE_RING_CAPACITY ? end - PROFILE_RING_CAPACITY : 0;
+	uint32_t threadCount = profileThreadCount.load();
+
+	out << fixed << setprecision(3);	// Microseconds with nanosecond digits, never scientific
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << GPU_PROFILE_THREAD << ",\"args\":{\"name\":\"GPU\"}}";
+	for (uint32_t thread = 1; thread < threadCount; thread++)
+		out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread << ",\"args\":{\"name\":\"CPU " << thread << "\"}}";
+
+	for (uint64_t index = begin; index < end; index++)
+	{
+		GLuint slot = (GLuint)(index % PROFILE_RING_CAPACITY);
+		if (profileRing.sequences[slot].load(memory_order_acquire) != index + 1)
+			continue;
+		const ProfileSample& sample = profileRing.samples[slot];
+		out << ",\n{\"name\":\"";
+		for (const char* c = sample.name; *c != '\0'; c++)
+		{
+			if (*c == '"' || *c == '\\')
+				out << '\\';
+			out << *c;
+		}
+		out << "\",\"cat\":\"" << (sample.thread == GPU_PROFILE_THREAD ? "gpu" : "cpu") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << sample.thread
+			<< ",\"ts\":" << sample.startMicroseconds << ",\"dur\":" << sample.durationMicroseconds << ",\"args\":{\"frame\":" << sample.frame << "}}";
+	}
+	out << "\n]}\n";
+
+	cout << "Wrote " << (end - begin) << " profile samples to " << path;
+	if (gpuProfiler.droppedFrames > 0)
+		cout << " (" << gpuProfiler.droppedFrames << " GPU frames dropped while pending)";
+	cout << endl;
+	return (bool)out;
+}
+
+/* Profiler Definitions End Here */
+
+/* Render Queue Definitions */
+
+// Every draw goes through a queue sorted by a 64-bit key, most significant bits first:
+// program (4) | vertex layout (8) | material (20) | depth (32). Sorted order groups draws by the
+// state they need and runs front to back within a group.
+enum RenderProgramSlot
+{
+	RENDER_PROGRAM_OBJECT,		// shaderProgram, model matrix from ObjectBlock
+	RENDER_PROGRAM_INSTANCED,	// shaderProgram, model matrix from instance attributes
+	RENDER_PROGRAM_INDIRECT		// indirectShaderProgram
+};
+
+enum RenderItemKind
+{
+	RENDER_ITEM_OBJECT,			// One placement
+	RENDER_ITEM_BATCH,			// Every placement of a batch, instanced
+	RENDER_ITEM_INDIRECT		// The whole indirect draw list
+};
+
+struct RenderItem
+{
+	uint64_t key;
+	GLuint kind;
+	GLuint batch;				// Index into the frame's batches
+	GLuint object;				// Index into the frame's matrices, RENDER_ITEM_OBJECT only
+	GLuint padding;
+};
+
+struct RenderQueue
+{
+	vector<RenderItem> items;
+	vector<RenderItem> scratch;	// Radix sort ping-pong buffer
+};
+
+RenderQueue renderQueue;
+
+uint64_t MakeSortKey(GLuint program, GLuint layout, GLuint material, GLfloat depth)
+{
+	// Non-negative floats order the same as their bit patterns
+	uint32_t depthBits;
+	depth = max(depth, 0.0f);
+	memcpy(&depthBits, &depth, sizeof(depthBits));
+	return ((uint64_t)(program & 0xF) << 60) | ((uint64_t)(layout & 0xFF) << 52) | ((uint64_t)(material & 0xFFFFF) << 32) | depthBits;
+}
+
+// Least-significant-digit radix sort on 8-bit digits. Digits every key shares are skipped, so a
+// frame without depth or material variety costs a few histogram passes.
+void SortRenderQueue(RenderQueue& queue)
+{
+	size_t count = queue.items.size();
+	queue.scratch.resize(count);
+	for (GLuint shift = 0; shift < 64 && count > 1; shift += 8)
+	{
+		size_t histogram[256] = {};
+		for (size_t i = 0; i < count; i++)
+			histogram[(queue.items[i].key >> shift) & 0xFF]++;
+		if (histogram[(queue.items[0].key >> shift) & 0xFF] == count)
+			continue;
+
+		size_t offset = 0;
+		for (GLuint digit = 0; digit < 256; digit++)
+		{
+			size_t digitCount = histogram[digit];
+			histogram[digit] = offset;
+			offset += digitCount;
+		}
+		for (size_t i = 0; i < count; i++)
+			queue.scratch[histogram[(queue.items[i].key >> shift) & 0xFF]++] = queue.items[i];
+		queue.items.swap(queue.scratch);
+	}
+}
+
+// Last GL state the submitter set, so binds that would change nothing are skipped
+struct GLStateCache
+{
+	GLuint program = 0;
+	GLuint vertexArray = 0;
+	GLint material = -1;		// Mesh whose dequantization is loaded into program's uniforms
+	GLint instanced = -1;
+	GLuint skippedChanges = 0;
+};
+
+GLStateCache glStateCache;
+
+// Forget everything after code outside the submitter changes bindings
+void InvalidateGLStateCache(GLStateCache& cache)
+{
+	cache = GLStateCache();
+}
+
+void UseProgramCached(GLStateCache& cache, GLuint program)
+{
+	if (cache.program == program)
+	{
+		cache.skippedChanges++;
+		return;
+	}
+	glUseProgram(program);
+	cache.program = program;
+	cache.material = -1;		// Uniform values are per program
+	cache.instanced = -1;
+}
+
+void BindVertexArrayCached(GLStateCache& cache, GLuint vertexArray)
+{
+	if (cache.vertexArray == vertexArray)
+	{
+		cache.skippedChanges++;
+		return;
+	}
+	glBindVertexArray(vertexArray);
+	cache.vertexArray = vertexArray;
+}
+
+void SetInstancedCached(GLStateCache& cache, const ShaderUniforms& uniforms, bool instanced)
+{
+	if (cache.instanced == (GLint)instanced)
+	{
+		cache.skippedChanges++;
+		return;
+	}
+	glUniform1i(uniforms.instanced, instanced);
+	cache.instanced = instanced;
+}
+
+void SetMaterialCached(GLStateCache& cache, const ShaderUniforms& uniforms, const GeometryArena& arena, GLuint mesh)
+{
+	if (cache.material == (GLint)mesh)
+	{
+		cache.skippedChanges++;
+		return;
+	}
+	glUniform3fv(uniforms.positionScale, 1, glm::value_ptr(arena.meshes[mesh].positionScale));
+	glUniform3fv(uniforms.positionBias, 1, glm::value_ptr(arena.meshes[mesh].positionBias));
+	glUniform1i(uniforms.textureLayer, arena.meshes[mesh].textureLayer);
+	glUniform4fv(uniforms.uvPlaneU, 1, glm::value_ptr(arena.meshes[mesh].uvPlanes[0]));
+	glUniform4fv(uniforms.uvPlaneV, 1, glm::value_ptr(arena.meshes[mesh].uvPlanes[1]));
+	cache.material = mesh;
+}
+
+// Queue the frame's draws for one render path. Per-object items are recorded by the job workers,
+// each into its own slice of the queue (batches are contiguous, so an object's slot is its index);
+// only SubmitRenderQueue touches GL.
+void BuildRenderQueue(RenderQueue& queue, RenderPath path, const vector<DrawBatch>& batches, const glm::mat4* matrices, const glm::vec3& eye, JobSystem& jobs)
+{
+	queue.items.clear();
+	if (path == RENDER_INDIRECT)
+	{
+		RenderItem item = { MakeSortKey(RENDER_PROGRAM_INDIRECT, 0, 0, 0.0f), RENDER_ITEM_INDIRECT, 0, 0, 0 };
+		queue.items.push_back(item);
+		return;
+	}
+	if (path == RENDER_INSTANCED)
+	{
+		for (GLuint i = 0; i < (GLuint)batches.size(); i++)
+		{
+			RenderItem item = { MakeSortKey(RENDER_PROGRAM_INSTANCED, 0, batches[i].mesh, 0.0f), RENDER_ITEM_BATCH, i, 0, 0 };
+			queue.items.push_back(item);
+		}
+		return;
+	}
+
+	GLuint objectCount = batches.empty() ? 0 : batches.back().firstTransform + batches.back().instanceCount;
+	queue.items.resize(objectCount);
+	ParallelFor(jobs, (GLuint)batches.size(), 1, [&](GLuint begin, GLuint end) {
+		for (GLuint i = begin; i < end; i++)
+		{
+			for (GLsizei j = 0; j < batches[i].instanceCount; j++)
+			{
+				GLuint object = batches[i].firstTransform + j;
+				GLfloat depth = glm::length(glm::vec3(matrices[object][3]) - eye);
+				RenderItem item = { MakeSortKey(RENDER_PROGRAM_OBJECT, 0, batches[i].mesh, depth), RENDER_ITEM_OBJECT, i, object, 0 };
+				queue.items[object] = item;
+			}
+		}
+	});
+}
+
+// GL programs behind each RenderProgramSlot, plus the uniforms of the shared one
+struct RenderPrograms
+{
+	GLuint programs[3];
+	ShaderUniforms uniforms;
+};
+
+// Work submitted by the last RenderFrame
+struct FrameStats
+{
+	GLuint drawCalls;		// GL draw submissions
+	uint64_t triangles;
+};
+
+// Draw the sorted queue. Each run of items sharing program and material is one profiled group.
+void SubmitRenderQueue(const RenderQueue& queue, GLStateCache& cache, const RenderPrograms& programs, const GeometryArena& arena,
+	const vector<DrawBatch>& batches, const BufferRange& batchTransforms, const IndirectDrawList& indirectList, FrameStats& stats)
+{
+	size_t count = queue.items.size();
+	for (size_t first = 0; first < count;)
+	{
+		size_t end = first + 1;
+		while (end < count && (queue.items[end].key >> 32) == (queue.items[first].key >> 32))
+			end++;
+
+		const RenderItem& lead = queue.items[first];
+		GLuint slot = (GLuint)(lead.key >> 60);
+		UseProgramCached(cache, programs.programs[slot]);
+		BindVertexArrayCached(cache, arena.vao); // One VAO for the whole scene
+		if (slot != RENDER_PROGRAM_INDIRECT)
+		{
+			SetInstancedCached(cache, programs.uniforms, slot == RENDER_PROGRAM_INSTANCED);
+			SetMaterialCached(cache, programs.uniforms, arena, batches[lead.batch].mesh);
+		}
+
+		const char* groupName = lead.kind == RENDER_ITEM_INDIRECT ? "Draw indirect" : arena.meshNames[batches[lead.batch].mesh].c_str();
+		ProfileScope drawScope(groupName);
+		BeginGpuPass(gpuProfiler, groupName);
+		for (size_t i = first; i < end; i++)
+		{
+			const RenderItem& item = queue.items[i];
+			if (item.kind == RENDER_ITEM_INDIRECT)
+			{
+				// Whole scene in one call, per-draw data indexed by gl_DrawIDARB
+				drawIndirect(indirectList, batchTransforms);
+				stats.drawCalls += indirectList.commandCount > 0 ? 1 : 0;
+				for (size_t j = 0; j < batches.size(); j++)
+					stats.triangles += (uint64_t)arena.meshes[batches[j].mesh].indexCount / 3 * batches[j].instanceCount;
+			}
+			else if (item.kind == RENDER_ITEM_BATCH)
+			{
+				// Model matrices come from the transform buffer
+				drawInstanced(arena, batches[item.batch], batchTransforms);
+				stats.drawCalls++;
+				stats.triangles += (uint64_t)arena.meshes[batches[item.batch].mesh].indexCount / 3 * batches[item.batch].instanceCount;
+			}
+			else
+			{
+				// Model matrix picked out of ObjectBlock by index
+				const MeshRange& mesh = arena.meshes[batches[item.batch].mesh];
+				glUniform1i(programs.uniforms.objectIndex, BindObjectUniforms(sceneUniforms, item.object));
+				// Draw primitive(s)
+				draw(mesh);
+				stats.drawCalls++;
+				stats.triangles += mesh.indexCount / 3;
+			}
+		}
+		EndGpuPass(gpuProfiler);
+		first = end;
+	}
+}
+
+/* Render Queue Definitions End Here */
+
+/* Software Rasterizer Definitions */
+
+// CPU backend for hosts without a GPU. It draws the same sorted RenderQueue that SubmitRenderQueue
+// replays, reproducing the scene's shaders: projection * view * model * position, the vertex color
+// times the mesh's texture layer, and the clustered lights when the scene has any. Job chunks of
+// queue items transform, clip and bin triangles into tiles; then one job per tile rasterizes its
+// bins in submission order with exact fixed-point edge functions, four pixels at a time, against a
+// 24-bit GL_LESS depth buffer like the GL path's.
+const int RASTER_TILE_SIZE = 64;
+const double RASTER_SUBPIXELS = 256.0;			// 8 bits of subpixel precision
+const GLuint RASTER_ITEMS_PER_CHUNK = 32;
+const GLfloat RASTER_GUARD_BAND = 4.0f;			// x and y are clipped at 4x the viewport; the tile bounds trim the rest
+const uint32_t RASTER_DEPTH_MAX = 0xFFFFFF;
+
+struct RasterVertex
+{
+	glm::vec4 clip;
+	glm::vec4 color;
+	glm::vec2 uv;
+	glm::vec3 viewPosition, viewNormal;	// Only read for lit scenes
+};
+
+// A triangle snapped to the subpixel grid. Edge i is E(p) = A * px + B * py + C over pixel
+// centers in subpixels, positive inside and exact in doubles.
+struct RasterTriangle
+{
+	double edgeA[3], edgeB[3], edgeC[3];
+	double edgeBias[3];			// 0 when the edge owns pixel centers lying on it, 1 when its neighbour does
+	double area;				// E of the opposite vertex, the same for all three edges
+	GLfloat depth[3];			// Window z
+	GLfloat inverseW[3];		// Perspective-correct interpolation, like a smooth varying
+	glm::vec4 color[3];
+	glm::vec2 uv[3];
+	glm::vec3 viewPosition[3], viewNormal[3];
+	GLint textureLayer;			// -1 for vertex colors only
+	int minX, minY, maxX, maxY;	// Inclusive pixel bounds inside the target
+};
+
+// Triangles set up by one job, binned by the tiles they touch
+struct RasterChunk
+{
+	vector<RasterTriangle> triangles;
+	vector<vector<GLuint>> bins;	// Triangle indices per tile, in submission order
+	uint64_t submitted;				// Triangles before clipping, for FrameStats
+};
+
+struct SoftwareTarget
+{
+	int width = 0, height = 0, tilesX = 0, tilesY = 0;
+	vector<unsigned char> color;	// RGB8, rows from the bottom like glReadPixels
+	vector<uint32_t> depth;			// 24-bit window depth
+	vector<RasterChunk> chunks;
+};
+
+SoftwareTarget softwareTarget;
+
+// Scene texture layers decoded to RGBA8, levels back to back, with the texels a GL driver samples:
+// the BC1 blocks unless texture compression is off
+struct SoftwareTextures
+{
+	vector<vector<unsigned char>> layers;	// Empty for a layer that could be neither opened nor baked
+	size_t levelOffsets[TEXTURE_LEVELS];
+	TextureFileFormat format = TEXTURE_FORMAT_RGBA8;
+	GLuint failedLayers = 0;
+};
+
+// What the fragment stage reads besides its triangle
+struct RasterShading
+{
+	glm::mat4 view;
+	const SoftwareTextures* textures;		// Null when textures are off
+	const ClusterLighting* lighting;		// Null for unlit frames
+};
+
+SoftwareTextures softwareTextures;
+
+// Load and decode every layer up front, across the job workers
+void LoadSoftwareTextures(SoftwareTextures& textures, const SceneFile& scene, JobSystem& jobs)
+{
+	textures.format = textureCompressionEnabled ? TEXTURE_FORMAT_BC1 : TEXTURE_FORMAT_RGBA8;
+	size_t bytes = 0;
+	for (GLint level = 0; level < TEXTURE_LEVELS; level++)
+	{
+		textures.levelOffsets[level] = bytes;
+		bytes += (size_t)TextureLevelBytes(TEXTURE_FORMAT_RGBA8, level);
+	}
+	GLuint layerCount = min(scene.header->textureCount, TEXTURE_MAX_LAYERS);
+	textures.layers.assign(layerCount, vector<unsigned char>());
+
+	ParallelFor(jobs, layerCount, 1, [&](GLuint begin, GLuint end) {
+		for (GLuint layer = begin; layer < end; layer++)
+		{
+			TextureFile file;
+			if (!LoadTextureFile(scene.directory + scene.textures[layer].path, file))
+				continue;
+			vector<unsigned char>& texels = textures.layers[layer];
+			texels.resize(bytes);
+			for (GLint level = 0; level < TEXTURE_LEVELS; level++)
+			{
+				const unsigned char* source = file.mapping.data + file.header->levels[textures.format][level].offset;
+				unsigned char* target = &texels[textures.levelOffsets[level]];
+				int size = max(TEXTURE_LAYER_SIZE >> level, 1);
+				if (textures.format == TEXTURE_FORMAT_RGBA8)
+				{
+					memcpy(target, source, (size_t)size * size * 4);
+					continue;
+				}
+				// Levels under 4 x 4 keep the top left of their single block
+				int blocks = (size + 3) / 4;
+				for (int blockY = 0; blockY < blocks; blockY++)
+					for (int blockX = 0; blockX < blocks; blockX++)
+					{
+						unsigned char tile[16][4];
+						DecodeBC1Block(source + ((size_t)blockY * blocks + blockX) * 8, tile);
+						for (int y = 0; y < 4 && blockY * 4 + y < size; y++)
+							for (int x = 0; x < 4 && blockX * 4 + x < size; x++)
+								memcpy(&target[((size_t)(blockY * 4 + y) * size + blockX * 4 + x) * 4], tile[y * 4 + x], 4);
+					}
+			}
+			UnmapFile(file.mapping);
+		}
+	});
+
+	textures.failedLayers = 0;
+	for (GLuint layer = 0; layer < layerCount; layer++)
+		if (textures.layers[layer].empty())
+			textures.failedLayers++;
+}
+
+// Bilinear sample of one level with GL_REPEAT; every level is a power of two
+static glm::vec4 SampleSoftwareTextureLevel(const SoftwareTextures& textures, const vector<unsigned char>& texels, GLint level, const glm::vec2& uv)
+{
+	int size = max(TEXTURE_LAYER_SIZE >> level, 1);
+	const unsigned char* data = &texels[textures.levelOffsets[level]];
+	GLfloat u = uv.x * size - 0.5f, v = uv.y * size - 0.5f;
+	GLfloat floorU = floorf(u), floorV = floorf(v);
+	GLfloat fractionU = u - floorU, fractionV = v - floorV;
+	int x0 = (int)floorU & (size - 1), y0 = (int)floorV & (size - 1);
+	int x1 = (x0 + 1) & (size - 1), y1 = (y0 + 1) & (size - 1);
+	glm::vec4 texel;
+	for (int channel = 0; channel < 4; channel++)
+	{
+		GLfloat row0 = data[(y0 * size + x0) * 4 + channel] * (1.0f - fractionU) + data[(y0 * size + x1) * 4 + channel] * fractionU;
+		GLfloat row1 = data[(y1 * size + x0) * 4 + channel] * (1.0f - fractionU) + data[(y1 * size + x1) * 4 + channel] * fractionU;
+		texel[channel] = (row0 * (1.0f - fractionV) + row1 * fractionV) / 255.0f;
+	}
+	return texel;
+}
+
+// textureLod with the scene sampler: GL_LINEAR when magnified, GL_LINEAR_MIPMAP_LINEAR when minified
+static glm::vec4 SampleSoftwareTexture(const SoftwareTextures& textures, const vector<unsigned char>& texels, const glm::vec2& uv, GLfloat lod)
+{
+	if (!(lod > 0.0f))
+		return SampleSoftwareTextureLevel(textures, texels, 0, uv);
+	if (lod >= (GLfloat)(TEXTURE_LEVELS - 1))
+		return SampleSoftwareTextureLevel(textures, texels, TEXTURE_LEVELS - 1, uv);
+	GLint level = (GLint)lod;
+	GLfloat blend = lod - level;
+	glm::vec4 fine = SampleSoftwareTextureLevel(textures, texels, level, uv), coarse = SampleSoftwareTextureLevel(textures, texels, level + 1, uv);
+	return fine + blend * (coarse - fine);
+}
+
+void ResizeSoftwareTarget(SoftwareTarget& target, int targetWidth, int targetHeight)
+{
+	if (target.width == targetWidth && target.height == targetHeight)
+		return;
+	target.width = targetWidth;
+	target.height = targetHeight;
+	target.tilesX = (targetWidth + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+	target.tilesY = (targetHeight + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+	target.color.assign((size_t)targetWidth * targetHeight * 3, 0);
+	target.depth.assign((size_t)targetWidth * targetHeight, RASTER_DEPTH_MAX);
+	target.chunks.clear();
+}
 
-		-0.5f, -0.866f, 0.0f, // vert 12
-		1.0f, 0.65f, 0.0f, // orange
-//          ----------------
-		0.0f, 0.0f, 0.3f,  // vert 13				
-		1.0f, 0.6f, 0.0f, // orange
+// Signed distances to the planes GL clips against (near, far) and to the guard band
+static inline GLfloat RasterClipDistance(const glm::vec4& clip, GLuint plane)
+{
+	switch (plane)
+	{
+	case 0: return clip.w + clip.z;
+	case 1: return clip.w - clip.z;
+	case 2: return RASTER_GUARD_BAND * clip.w - clip.x;
+	case 3: return RASTER_GUARD_BAND * clip.w + clip.x;
+	case 4: return RASTER_GUARD_BAND * clip.w - clip.y;
+	default: return RASTER_GUARD_BAND * clip.w + clip.y;
+	}
+}
 
-		-0.5f, -0.866f, 0.0f, // vert 14
-		1.0f, 0.6f, 0.0f, // orange
+// Clip a triangle into polygon (room for 9 vertices) and return its vertex count
+GLuint ClipRasterTriangle(const RasterVertex triangle[3], RasterVertex polygon[9])
+{
+	bool inside = true;
+	for (GLuint plane = 0; plane < 6 && inside; plane++)
+		for (GLuint i = 0; i < 3 && inside; i++)
+			inside = RasterClipDistance(triangle[i].clip, plane) >= 0.0f;
+	for (GLuint i = 0; i < 3; i++)
+		polygon[i] = triangle[i];
+	if (inside)
+		return 3;
+
+	RasterVertex scratch[9];
+	GLuint count = 3;
+	for (GLuint plane = 0; plane < 6 && count > 0; plane++)
+	{
+		GLuint kept = 0;
+		for (GLuint i = 0; i < count; i++)
+		{
+			const RasterVertex& a = polygon[i];
+			const RasterVertex& b = polygon[(i + 1) % count];
+			GLfloat distanceA = RasterClipDistance(a.clip, plane), distanceB = RasterClipDistance(b.clip, plane);
+			if (distanceA >= 0.0f)
+				scratch[kept++] = a;
+			if ((distanceA >= 0.0f) != (distanceB >= 0.0f))
+			{
+				GLfloat t = distanceA / (distanceA - distanceB);
+				RasterVertex crossing = { glm::mix(a.clip, b.clip, t), glm::mix(a.color, b.color, t), glm::mix(a.uv, b.uv, t),
+					glm::mix(a.viewPosition, b.viewPosition, t), glm::mix(a.viewNormal, b.viewNormal, t) };
+				scratch[kept++] = crossing;
+			}
+		}
+		count = kept;
+		for (GLuint i = 0; i < count; i++)
+			polygon[i] = scratch[i];
+	}
+	return count;
+}
 
-		0.5f, -0.866f, 0.0f, // vert 15
-		1.0f, 0.55f, 0.0f, // orange
-//          ----------------
-		0.0f, 0.0f, 0.3f,  // vert 16				
-		1.0f, 0.62f, 0.0f, // orange
+// Project, snap and build edge functions. Returns false for triangles without area or pixels.
+bool SetupRasterTriangle(const RasterVertex& v0, const RasterVertex& v1, const RasterVertex& v2, int targetWidth, int targetHeight, RasterTriangle& triangle)
+{
+	const RasterVertex* vertices[3] = { &v0, &v1, &v2 };
+	double x[3], y[3];
+	for (GLuint i = 0; i < 3; i++)
+	{
+		GLfloat inverseW = 1.0f / vertices[i]->clip.w;
+		glm::vec3 ndc = glm::vec3(vertices[i]->clip) * inverseW;
+		x[i] = (double)llround((ndc.x * 0.5 + 0.5) * targetWidth * RASTER_SUBPIXELS);
+		y[i] = (double)llround((ndc.y * 0.5 + 0.5) * targetHeight * RASTER_SUBPIXELS);
+		triangle.depth[i] = ndc.z * 0.5f + 0.5f;
+		triangle.inverseW[i] = inverseW;
+		triangle.color[i] = vertices[i]->color;
+		triangle.uv[i] = vertices[i]->uv;
+		triangle.viewPosition[i] = vertices[i]->viewPosition;
+		triangle.viewNormal[i] = vertices[i]->viewNormal;
+	}
 
-		0.5f, -0.866f, 0.0f, // vert 17
-		1.0f, 0.55f, 0.0f, // orange
+	double area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	if (area == 0.0)
+		return false;
+	if (area < 0.0)
+	{
+		// No face culling in the GL path, so wind every triangle counter-clockwise
+		swap(x[1], x[2]);
+		swap(y[1], y[2]);
+		swap(triangle.depth[1], triangle.depth[2]);
+		swap(triangle.inverseW[1], triangle.inverseW[2]);
+		swap(triangle.color[1], triangle.color[2]);
+		swap(triangle.uv[1], triangle.uv[2]);
+		swap(triangle.viewPosition[1], triangle.viewPosition[2]);
+		swap(triangle.viewNormal[1], triangle.viewNormal[2]);
+		area = -area;
+	}
+	triangle.area = area;
 
-		1.0f, 0.0f, 0.0f, // vert 18
-		1.0f, 0.62f, 0.0f, // orange
+	for (GLuint i = 0; i < 3; i++)
+	{
+		GLuint a = (i + 1) % 3, b = (i + 2) % 3;
+		triangle.edgeA[i] = y[a] - y[b];
+		triangle.edgeB[i] = x[b] - x[a];
+		triangle.edgeC[i] = -(triangle.edgeA[i] * x[a] + triangle.edgeB[i] * y[a]);
+		// A shared edge appears with opposite signs in its two triangles, so exactly one owns it
+		bool owner = triangle.edgeA[i] > 0.0 || (triangle.edgeA[i] == 0.0 && triangle.edgeB[i] < 0.0);
+		triangle.edgeBias[i] = owner ? 0.0 : 1.0;
+	}
 
-	};
-	glm::vec3 tennisBallSpherePositions[] = {		// top middle shelf
-		glm::vec3(0.0f,  7.5f,  0.5f), // front
-		glm::vec3(0.5f,  7.5f,  0.0f), // right
-		glm::vec3(0.0f,  7.5f,  -0.5f), // back
-		glm::vec3(-0.5f,  7.5f,  0.0f), // left
-		glm::vec3(0.0f,  8.0f,  0.0f),	// top
-		glm::vec3(0.0f,  7.0f,  0.0f) // bottom
-	};
+	// Pixels whose centers fall inside the snapped bounds
+	double half = RASTER_SUBPIXELS * 0.5;
+	triangle.minX = max(0, (int)ceil((min(x[0], min(x[1], x[2])) - half) / RASTER_SUBPIXELS));
+	triangle.minY = max(0, (int)ceil((min(y[0], min(y[1], y[2])) - half) / RASTER_SUBPIXELS));
+	triangle.maxX = min(targetWidth - 1, (int)floor((max(x[0], max(x[1], x[2])) - half) / RASTER_SUBPIXELS));
+	triangle.maxY = min(targetHeight - 1, (int)floor((max(y[0], max(y[1], y[2])) - half) / RASTER_SUBPIXELS));
+	return triangle.minX <= triangle.maxX && triangle.minY <= triangle.maxY;
+}
 
-	glm::float32 tennisBallSphereRotations[] = {
+// Perspective-correct weights of vertices 1 and 2 at a pixel center with the given edge values.
+// Pixels outside the triangle extrapolate, like the helper pixels GL shades for derivatives.
+static inline void RasterPerspectiveWeights(const RasterTriangle& triangle, const double edges[3], GLfloat& weight1, GLfloat& weight2)
+{
+	GLfloat weights[3];
+	for (GLuint i = 0; i < 3; i++)
+		weights[i] = (GLfloat)(edges[i] / triangle.area);
+	GLfloat inverseW = weights[0] * triangle.inverseW[0] + weights[1] * triangle.inverseW[1] + weights[2] * triangle.inverseW[2];
+	weight1 = weights[1] * triangle.inverseW[1] / inverseW;
+	weight2 = weights[2] * triangle.inverseW[2] / inverseW;
+}
 
-		0.0f, 90.0f, 180.0f, -90.0f, -90.0f, 90.0f	// front, right, back, left, top, bottom, respectively
+// Offsets from vertex 0, so a value shared by all three vertices comes out exact
+template <typename T>
+static inline T InterpolateRasterVarying(const T values[3], GLfloat weight1, GLfloat weight2)
+{
+	return values[0] + weight1 * (values[1] - values[0]) + weight2 * (values[2] - values[0]);
+}
 
-	};
+// Texture coordinates at another pixel center, dx and dy pixels away
+static inline glm::vec2 RasterUVAt(const RasterTriangle& triangle, const double edges[3], int dx, int dy)
+{
+	double moved[3];
+	for (GLuint i = 0; i < 3; i++)
+		moved[i] = edges[i] + (triangle.edgeA[i] * dx + triangle.edgeB[i] * dy) * RASTER_SUBPIXELS;
+	GLfloat weight1, weight2;
+	RasterPerspectiveWeights(triangle, moved, weight1, weight2);
+	return InterpolateRasterVarying(triangle.uv, weight1, weight2);
+}
+
+// Shade one covered pixel if it passes the depth test
+static inline void ShadeRasterPixel(SoftwareTarget& target, const RasterShading& shading, const RasterTriangle& triangle, int x, int y, const double edges[3])
+{
+	GLfloat weights[3];
+	for (GLuint i = 0; i < 3; i++)
+		weights[i] = (GLfloat)(edges[i] / triangle.area);
+	// Offsets from vertex 0, so a value shared by all three vertices comes out exact
+	GLfloat depth = triangle.depth[0] + weights[1] * (triangle.depth[1] - triangle.depth[0]) + weights[2] * (triangle.depth[2] - triangle.depth[0]);
+	uint32_t storedDepth = (uint32_t)lroundf(glm::clamp(depth, 0.0f, 1.0f) * RASTER_DEPTH_MAX);
+	size_t pixel = (size_t)y * target.width + x;
+	if (!(storedDepth < target.depth[pixel]))	// GL_LESS
+		return;
+	target.depth[pixel] = storedDepth;
+
+	GLfloat perspective1, perspective2;
+	RasterPerspectiveWeights(triangle, edges, perspective1, perspective2);
+	glm::vec4 color = InterpolateRasterVarying(triangle.color, perspective1, perspective2);
+
+	// The texture layer, at the level of detail the fragment shader derives from its 2 x 2 quad
+	const SoftwareTextures* textures = shading.textures;
+	if (textures && triangle.textureLayer >= 0 && triangle.textureLayer < (GLint)textures->layers.size() && !textures->layers[triangle.textureLayer].empty())
+	{
+		int quadX = x & ~1, quadY = y & ~1;
+		glm::vec2 texelX = (RasterUVAt(triangle, edges, quadX + 1 - x, 0) - RasterUVAt(triangle, edges, quadX - x, 0)) * (GLfloat)TEXTURE_LAYER_SIZE;
+		glm::vec2 texelY = (RasterUVAt(triangle, edges, 0, quadY + 1 - y) - RasterUVAt(triangle, edges, 0, quadY - y)) * (GLfloat)TEXTURE_LAYER_SIZE;
+		GLfloat lod = 0.5f * log2f(max(max(glm::dot(texelX, texelX), glm::dot(texelY, texelY)), 1e-8f));
+		glm::vec2 uv = InterpolateRasterVarying(triangle.uv, perspective1, perspective2);
+		glm::vec4 texel = SampleSoftwareTexture(*textures, textures->layers[triangle.textureLayer], uv, lod);
+		for (GLuint channel = 0; channel < 4; channel++)
+			color[channel] *= texel[channel];
+	}
+
+	// Lit from whichever side of the surface faces the camera
+	if (shading.lighting)
+	{
+		glm::vec3 position = InterpolateRasterVarying(triangle.viewPosition, perspective1, perspective2);
+		glm::vec3 normal = glm::normalize(InterpolateRasterVarying(triangle.viewNormal, perspective1, perspective2));
+		if (glm::dot(normal, position) > 0.0f)
+			normal = -normal;
+		glm::vec3 light = ClusterLightAt(*shading.lighting, position, normal, glm::vec2(x + 0.5f, y + 0.5f), glm::vec2((GLfloat)target.width, (GLfloat)target.height));
+		for (GLuint channel = 0; channel < 3; channel++)
+			color[channel] *= light[channel];
+	}
+
+	for (GLuint channel = 0; channel < 3; channel++)
+		target.color[pixel * 3 + channel] = (unsigned char)lrintf(glm::clamp(color[channel], 0.0f, 1.0f) * 255.0f); // Ties to even, like Mesa
+}
+
+// Rasterize the part of a triangle inside one tile, testing four pixel centers per step
+void RasterizeTriangleInTile(SoftwareTarget& target, const RasterShading& shading, const RasterTriangle& triangle, int tileX0, int tileY0, int tileX1, int tileY1)
+{
+	int minX = max(triangle.minX, tileX0), maxX = min(triangle.maxX, tileX1 - 1);
+	int minY = max(triangle.minY, tileY0), maxY = min(triangle.maxY, tileY1 - 1);
+	if (minX > maxX || minY > maxY)
+		return;
+
+	double half = RASTER_SUBPIXELS * 0.5;
+	double step[3];
+	for (GLuint i = 0; i < 3; i++)
+		step[i] = triangle.edgeA[i] * RASTER_SUBPIXELS;
+
+	for (int y = minY; y <= maxY; y++)
+	{
+		double centerY = y * RASTER_SUBPIXELS + half;
+		double rowEdges[3];
+		for (GLuint i = 0; i < 3; i++)
+			rowEdges[i] = triangle.edgeA[i] * (minX * RASTER_SUBPIXELS + half) + triangle.edgeB[i] * centerY + triangle.edgeC[i];
+
+		for (int x = minX; x <= maxX; x += 4)
+		{
+			int mask = 0xF;
+#ifdef SCENE_HAS_X86_SIMD
+			for (GLuint i = 0; i < 3; i++)
+			{
+				__m128d low = _mm_add_pd(_mm_set1_pd(rowEdges[i]), _mm_set_pd(step[i], 0.0));
+				__m128d high = _mm_add_pd(_mm_set1_pd(rowEdges[i]), _mm_set_pd(3.0 * step[i], 2.0 * step[i]));
+				__m128d bias = _mm_set1_pd(triangle.edgeBias[i]);
+				mask &= _mm_movemask_pd(_mm_cmpge_pd(low, bias)) | (_mm_movemask_pd(_mm_cmpge_pd(high, bias)) << 2);
+			}
+#else
+			for (GLuint lane = 0; lane < 4; lane++)
+				for (GLuint i = 0; i < 3; i++)
+					if (rowEdges[i] + lane * step[i] < triangle.edgeBias[i])
+						mask &= ~(1 << lane);
+#endif
+			mask &= (1 << min(4, maxX - x + 1)) - 1;
+			for (GLuint lane = 0; mask != 0; lane++, mask >>= 1)
+			{
+				if (!(mask & 1))
+					continue;
+				double edges[3] = { rowEdges[0] + lane * step[0], rowEdges[1] + lane * step[1], rowEdges[2] + lane * step[2] };
+				ShadeRasterPixel(target, shading, triangle, x + lane, y, edges);
+			}
+			for (GLuint i = 0; i < 3; i++)
+				rowEdges[i] += 4.0 * step[i];
+		}
+	}
+}
+
+// Vertex stage for a range of queue items: transform, clip, set up and bin every triangle
+void BinRasterChunk(SoftwareTarget& target, RasterChunk& chunk, const RenderQueue& queue, size_t firstItem, size_t endItem,
+	const GeometryArena& arena, const vector<DrawBatch>& batches, const glm::mat4* matrices, const glm::mat4& viewProjection, const RasterShading& shading)
+{
+	chunk.triangles.clear();
+	chunk.bins.resize((size_t)target.tilesX * target.tilesY);
+	for (size_t i = 0; i < chunk.bins.size(); i++)
+		chunk.bins[i].clear();
+	chunk.submitted = 0;
+
+	for (size_t item = firstItem; item < endItem; item++)
+	{
+		GLuint meshIndex = batches[queue.items[item].batch].mesh;
+		const MeshRange& mesh = arena.meshes[meshIndex];
+		glm::mat4 modelViewProjection = viewProjection * matrices[queue.items[item].object];
+		glm::mat4 modelView = shading.view * matrices[queue.items[item].object];
+		chunk.submitted += mesh.indexCount / 3;
+
+		for (GLuint index = mesh.firstIndex; index + 2 < mesh.firstIndex + mesh.indexCount; index += 3)
+		{
+			RasterVertex corners[3];
+			for (GLuint corner = 0; corner < 3; corner++)
+			{
+				GLuint vertex = mesh.baseVertex + arena.indexData[index + corner];
+				glm::vec3 position = ReadVertexPosition(arena, vertex) * mesh.positionScale + mesh.positionBias;
+				corners[corner].clip = modelViewProjection * glm::vec4(position, 1.0f);
+				corners[corner].color = ReadVertexAttribute(arena, vertex, 1);
+				corners[corner].uv = glm::vec2(glm::dot(mesh.uvPlanes[0], glm::vec4(position, 1.0f)), glm::dot(mesh.uvPlanes[1], glm::vec4(position, 1.0f)));
+				if (shading.lighting)
+				{
+					corners[corner].viewPosition = glm::vec3(modelView * glm::vec4(position, 1.0f));
+					corners[corner].viewNormal = glm::vec3(modelView * glm::vec4(glm::vec3(ReadVertexAttribute(arena, vertex, NormalRole::location)), 0.0f));
+				}
+			}
+
+			RasterVertex polygon[9];
+			GLuint count = ClipRasterTriangle(corners, polygon);
+			for (GLuint k = 1; k + 1 < count; k++)
+			{
+				RasterTriangle triangle;
+				if (!SetupRasterTriangle(polygon[0], polygon[k], polygon[k + 1], target.width, target.height, triangle))
+					continue;
+				triangle.textureLayer = mesh.textureLayer;
+				GLuint triangleIndex = (GLuint)chunk.triangles.size();
+				chunk.triangles.push_back(triangle);
+				for (int tileY = triangle.minY / RASTER_TILE_SIZE; tileY <= triangle.maxY / RASTER_TILE_SIZE; tileY++)
+					for (int tileX = triangle.minX / RASTER_TILE_SIZE; tileX <= triangle.maxX / RASTER_TILE_SIZE; tileX++)
+						chunk.bins[(size_t)tileY * target.tilesX + tileX].push_back(triangleIndex);
+			}
+		}
+	}
+}
+
+// Draw a sorted queue of RENDER_ITEM_OBJECT items into the target
+void RasterizeRenderQueue(SoftwareTarget& target, int targetWidth, int targetHeight, const RenderQueue& queue, const GeometryArena& arena,
+	const vector<DrawBatch>& batches, const glm::mat4* matrices, const glm::mat4& viewProjection, const RasterShading& shading, FrameStats& stats, JobSystem& jobs)
+{
+	ResizeSoftwareTarget(target, targetWidth, targetHeight);
+	GLuint chunkCount = (GLuint)((queue.items.size() + RASTER_ITEMS_PER_CHUNK - 1) / RASTER_ITEMS_PER_CHUNK);
+	if (target.chunks.size() < chunkCount)
+		target.chunks.resize(chunkCount);
+
+	{
+		ProfileScope binScope("Raster binning");
+		ParallelFor(jobs, chunkCount, 1, [&](GLuint begin, GLuint end) {
+			for (GLuint c = begin; c < end; c++)
+				BinRasterChunk(target, target.chunks[c], queue, (size_t)c * RASTER_ITEMS_PER_CHUNK,
+					min(queue.items.size(), (size_t)(c + 1) * RASTER_ITEMS_PER_CHUNK), arena, batches, matrices, viewProjection, shading);
+		});
+	}
+
+	// Chunks are visited in order, so each tile sees triangles in queue order like the GL path
+	ProfileScope tileScope("Raster tiles");
+	ParallelFor(jobs, (GLuint)(target.tilesX * target.tilesY), 1, [&](GLuint begin, GLuint end) {
+		for (GLuint tile = begin; tile < end; tile++)
+		{
+			int tileX0 = (tile % target.tilesX) * RASTER_TILE_SIZE, tileY0 = (tile / target.tilesX) * RASTER_TILE_SIZE;
+			int tileX1 = min(target.width, tileX0 + RASTER_TILE_SIZE), tileY1 = min(target.height, tileY0 + RASTER_TILE_SIZE);
+			for (int y = tileY0; y < tileY1; y++)
+			{
+				size_t row = (size_t)y * target.width;
+				memset(&target.color[(row + tileX0) * 3], 0, (size_t)(tileX1 - tileX0) * 3);
+				fill(target.depth.begin() + row + tileX0, target.depth.begin() + row + tileX1, RASTER_DEPTH_MAX);
+			}
+			for (GLuint c = 0; c < chunkCount; c++)
+			{
+				const RasterChunk& chunk = target.chunks[c];
+				const vector<GLuint>& bin = chunk.bins[tile];
+				for (size_t i = 0; i < bin.size(); i++)
+					RasterizeTriangleInTile(target, shading, chunk.triangles[bin[i]], tileX0, tileY0, tileX1, tileY1);
+			}
+		}
+	});
+
+	stats.drawCalls += (GLuint)queue.items.size();
+	for (GLuint c = 0; c < chunkCount; c++)
+		stats.triangles += target.chunks[c].submitted;
+}
+
+/* Software Rasterizer Definitions End Here */
+
+/* Scene Rendering Definitions */
+
+// GPU objects shared by the interactive and headless loops
+GpuBuffer transformBuffer;
+GpuProgram shaderProgram;
+GpuProgram indirectShaderProgram;
+ShaderUniforms shaderUniforms;
+chrono::steady_clock::time_point sceneStartTime;
+IndirectDrawList indirectDrawList;
+bool indirectListCulled = false;	// indirectDrawList holds last frame's visible batches
+vector<DrawBatch> drawBatches;
+
+FrameStats frameStats;	// Work submitted by the last RenderFrame
+
+// Create every GL object the scene needs; a context must be current. Fails when the scene does not
+// fit the GPU memory budget, after which ShutdownScene releases what was created.
+bool InitScene(const SceneFile& sceneFile)
+{
+	// Scene update, culling and queue recording run on every core; GL stays on this thread
+	StartJobSystem(sceneJobs, jobThreadCount);
+
+	// Every mesh shares one vertex buffer, one index buffer and one VAO, read straight from the mapped scene
+	AttachSceneGeometry(sceneGeometry, sceneFile);
+	LoadSceneTransforms(sceneTransforms, sceneFile);
+	LoadSceneGraph(sceneGraph, sceneFile);
+	drawBatches = BuildDrawBatches(sceneFile);
+	BuildCullingHierarchy(sceneBVH, sceneGeometry, sceneTransforms, drawBatches);
+	sceneStartTime = chrono::steady_clock::now();
+
+	// The software backend reads everything from the mapped scene and needs no GL objects. It shades
+	// like the GL programs, from the same texels decoded up front and the same light clusters.
+	if (renderBackend == RENDER_BACKEND_SOFTWARE)
+	{
+		if (texturesEnabled)
+			LoadSoftwareTextures(softwareTextures, sceneFile, sceneJobs);
+		if (lightingEnabled && sceneFile.header->lightCount > 0)
+			LoadClusterLights(sceneLighting, sceneFile);
+		return true;
+	}
 
 	// Setup some OpenGL options
 	glEnable(GL_DEPTH_TEST);
@@ -625,602 +5526,1674 @@ int main(void)
 	// Wireframe mode
 	//glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-	GLuint brickRectangleTBVBO, brickRectangleTBEBO, brickRectangleTBVAO;
-	glGenBuffers(1, &brickRectangleTBVBO); // Create VBO
-	glGenBuffers(1, &brickRectangleTBEBO); // Create EBO
-	glGenVertexArrays(1, &brickRectangleTBVAO); // Create VOA
-
-	glBindVertexArray(brickRectangleTBVAO);
-		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, brickRectangleTBVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, brickRectangleTBEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(brickRectangleVerticesTB), brickRectangleVerticesTB, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(squareIndices), squareIndices, GL_STATIC_DRAW); // Load indices 
-		// Specify attribute location and layout to GPU
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
-
-	GLuint brickRectangleLRVBO, brickRectangleLREBO, brickRectangleLRVAO;
-	glGenBuffers(1, &brickRectangleLRVBO); // Create VBO
-	glGenBuffers(1, &brickRectangleTBEBO); // Create EBO
-	glGenVertexArrays(1, &brickRectangleLRVAO); // Create VOA
-
-	glBindVertexArray(brickRectangleLRVAO);
-		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, brickRectangleLRVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, brickRectangleTBEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(brickRectangleVerticesLR), brickRectangleVerticesLR, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(squareIndices), squareIndices, GL_STATIC_DRAW); // Load indices 
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-	glBindVertexArray(0); // Unbind VOA or close off (Must call VOA explicitly in loop)
-
-	GLuint brickRectangleCapVBO, brickRectangleCapEBO, brickRectangleCapVAO; // Left Right
-	glGenBuffers(1, &brickRectangleCapVBO); // Create VBO
-	glGenBuffers(1, &brickRectangleCapEBO); // Create EBO
-	glGenVertexArrays(1, &brickRectangleCapVAO); // Create VOA
-
-	glBindVertexArray(brickRectangleCapVAO);
-		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, brickRectangleCapVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, brickRectangleCapEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(brickRectangleCapVertices), brickRectangleCapVertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(squareIndices), squareIndices, GL_STATIC_DRAW); // Load indices 
-		// Specify attribute location and layout to GPU
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-	glBindVertexArray(0);
-
-	GLuint floorVBO, floorEBO, floorVAO;
-	glGenBuffers(1, &floorVBO); // Create VBO
-	glGenBuffers(1, &floorEBO); // Create EBO
-
-	glGenVertexArrays(1, &floorVAO); // Create VOA
-		glBindVertexArray(floorVAO);
-		glBindBuffer(GL_ARRAY_BUFFER, floorVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, floorEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(floorVertices), floorVertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(squareIndices), squareIndices, GL_STATIC_DRAW); // Load indices 
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-	glBindVertexArray(0);
-
-	GLuint wallVBO, wallEBO, wallVAO;
-	glGenBuffers(1, &wallVBO); // Create VBO
-	glGenBuffers(1, &wallEBO); // Create EBO
-
-	glGenVertexArrays(1, &wallVAO); // Create VOA
-		glBindVertexArray(wallVAO);
-		glBindBuffer(GL_ARRAY_BUFFER, wallVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, wallEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(wallVertices), wallVertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(squareIndices), squareIndices, GL_STATIC_DRAW); // Load indices 
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-	glBindVertexArray(0);
-
-	GLuint shelfRectangleTBVBO, shelfRectangleTBEBO, shelfRectangleTBVAO; // Shelf Top Bottom
-	glGenBuffers(1, &shelfRectangleTBVBO); // Create VBO
-	glGenBuffers(1, &shelfRectangleTBEBO); // Create EBO
-	glGenVertexArrays(1, &shelfRectangleTBVAO); // Create VOA
-
-	glBindVertexArray(shelfRectangleTBVAO);
-		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, shelfRectangleTBVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, shelfRectangleTBEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(shelfRectangleVerticesTB), shelfRectangleVerticesTB, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(squareIndices), squareIndices, GL_STATIC_DRAW); // Load indices 
-		// Specify attribute location and layout to GPU
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-	glBindVertexArray(0);
-
-	GLuint shelfRectangleFBVBO, shelfRectangleFBEBO, shelfRectangleFBVAO; // Front Back
-	glGenBuffers(1, &shelfRectangleFBVBO); // Create VBO
-	glGenBuffers(1, &shelfRectangleFBEBO); // Create EBO
-	glGenVertexArrays(1, &shelfRectangleFBVAO); // Create VOA
-
-	glBindVertexArray(shelfRectangleFBVAO);
-		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, shelfRectangleFBVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, shelfRectangleFBEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(shelfRectangleVerticesFB), shelfRectangleVerticesFB, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(squareIndices), squareIndices, GL_STATIC_DRAW); // Load indices 
-		// Specify attribute location and layout to GPU
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-	glBindVertexArray(0);
-
-	GLuint shelfRectangleCapVBO, shelfRectangleCapEBO, shelfRectangleCapVAO; // Left Right
-	glGenBuffers(1, &shelfRectangleCapVBO); // Create VBO
-	glGenBuffers(1, &shelfRectangleCapEBO); // Create EBO
-	glGenVertexArrays(1, &shelfRectangleCapVAO); // Create VOA
-
-	glBindVertexArray(shelfRectangleCapVAO);
-		// VBO and EBO Placed in User-Defined VAO
-		glBindBuffer(GL_ARRAY_BUFFER, shelfRectangleCapVBO); // Select VBO
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, shelfRectangleCapEBO); // Select EBO
-		glBufferData(GL_ARRAY_BUFFER, sizeof(shelfRectangleCapVertices), shelfRectangleCapVertices, GL_STATIC_DRAW); // Load vertex attributes
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(squareIndices), squareIndices, GL_STATIC_DRAW); // Load indices 
-		// Specify attribute location and layout to GPU
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-		glEnableVertexAttribArray(1);
-	glBindVertexArray(0);
-
-
-	GLuint toiletPaperCylinderVBO, toiletPaperCylinderVAO; // triangle VAO variables
-	glGenVertexArrays(1, &toiletPaperCylinderVAO); // Create VAO
-	glGenBuffers(1, &toiletPaperCylinderVBO); // Create VBO
-
-	glBindVertexArray(toiletPaperCylinderVAO); // Activate VAO for VBO association
-		glBindBuffer(GL_ARRAY_BUFFER, toiletPaperCylinderVBO); // Enable VBO	
-		glBufferData(GL_ARRAY_BUFFER, sizeof(toiletPaperCylinderVertices), toiletPaperCylinderVertices, GL_STATIC_DRAW); // Copy Vertex data to VBO
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0); // Associate VBO with VA (Vertex Attribute)
-		glEnableVertexAttribArray(0); // Enable VA
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat))); // Associate VBO with VA
-		glEnableVertexAttribArray(1); // Enable VA
-	glBindVertexArray(0); // Unbind VAO (Optional but recommended)
-
-	GLuint tennisBallSphereVBO, tennisBallSphereVAO; // triangle VAO variables
-	glGenVertexArrays(1, &tennisBallSphereVAO); // Create VAO
-	glGenBuffers(1, &tennisBallSphereVBO); // Create VBO
-
-	glBindVertexArray(tennisBallSphereVAO); // Activate VAO for VBO association
-		glBindBuffer(GL_ARRAY_BUFFER, tennisBallSphereVBO); // Enable VBO	
-		glBufferData(GL_ARRAY_BUFFER, sizeof(tennisBallSphereVertices), tennisBallSphereVertices, GL_STATIC_DRAW); // Copy Vertex data to VBO
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)0); // Associate VBO with VA (Vertex Attribute)
-		glEnableVertexAttribArray(0); // Enable VA
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat))); // Associate VBO with VA
-		glEnableVertexAttribArray(1); // Enable VA
-	glBindVertexArray(0); // Unbind VAO (Optional but recommended)
+	// Placements are uploaded once; later edits re-upload only what changed
+	CreateGpuObject(transformBuffer, "placements");
+	glBindBuffer(GL_ARRAY_BUFFER, transformBuffer);
+	bool placed = GpuBufferData(transformBuffer, GL_ARRAY_BUFFER, sceneTransforms.worldMatrices.size() * sizeof(glm::mat4), sceneTransforms.worldMatrices.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	sceneTransforms.changed.assign(sceneTransforms.changed.size(), false);
+
+	if (!placed || !UploadGeometryArena(sceneGeometry, transformBuffer) || !CreateUniformBuffers(sceneUniforms))
+		return false;
+
+	CreateGpuProfiler(gpuProfiler);
+	UploadObjectUniforms(sceneUniforms, nullptr, 0, sceneStream); // ObjectBlock always has storage, even on the instanced path
+	CreateGpuObject(sceneVisible.transformBuffer, "visible placements");
+
+	// Per-frame data goes through a persistently mapped ring sized for a few copies of the placements.
+	// Regions grow on their own if a frame needs more.
+	if (streamingEnabled && IsStreamingSupported())
+		CreateStreamBuffer(sceneStream, (GLsizeiptr)(2 * sceneTransforms.worldMatrices.size() * sizeof(glm::mat4)));
+
+	// Images load in the background; until a layer arrives its meshes show their vertex colors
+	if (texturesEnabled)
+		StartTextureStreaming(sceneTextures, sceneFile);
+
+	// Lit scenes shade from per-cluster light lists; without shader storage they stay unlit
+	bool clusteredLighting = lightingEnabled && sceneFile.header->lightCount > 0 && IsClusteredLightingSupported();
+	if (clusteredLighting)
+		CreateClusterLighting(sceneLighting, sceneFile);
+
+	// Without culling the indirect commands only change when batches do, so they are built once
+	indirectSupported = IsIndirectSupported();
+	if (indirectSupported)
+		BuildIndirectDrawList(indirectDrawList, sceneGeometry, drawBatches.data(), (GLuint)drawBatches.size());
+	else if (renderPath == RENDER_INDIRECT)
+		renderPath = RENDER_INSTANCED;
 
 	// Vertex shader source code
 	string vertexShaderSource =
 		"#version 330 core\n"
-		"layout(location = 0) in vec4 vPosition;"
-		"layout(location = 1) in vec4 aColor;"
+		+ FloatVertexFormat::ShaderInputs() +
+		"layout(location = 2) in mat4 instanceModel;"
 		"out vec4 oColor;"
-		"uniform mat4 model;"
-		"uniform mat4 view;"
-		"uniform mat4 projection;"
+		"out vec2 oUV;"
+		"flat out int oLayer;"
+		"out vec3 oViewPosition;"
+		"out vec3 oViewNormal;"
+		+ FrameBlockSource() +
+		"layout(std140) uniform ObjectBlock { mat4 models[256]; };"
+		"uniform int objectIndex;"
+		"uniform bool instanced;"
+		"uniform vec3 positionScale;"
+		"uniform vec3 positionBias;"
+		"uniform int textureLayer;"
+		"uniform vec4 uvPlaneU;"
+		"uniform vec4 uvPlaneV;"
 		"void main()\n"
 		"{\n"
-		"gl_Position = projection * view * model * vPosition;"
+		"mat4 modelMatrix = instanced ? instanceModel : models[objectIndex];"
+		"vec4 position = vec4(vPosition.xyz * positionScale + positionBias, 1.0);"
+		"gl_Position = projection * view * modelMatrix * position;"
 		"oColor = aColor;"
+		"oUV = vec2(dot(uvPlaneU, position), dot(uvPlaneV, position));"
+		"oLayer = textureLayer;"
+		"oViewPosition = vec3(view * modelMatrix * position);"
+		"oViewNormal = mat3(view * modelMatrix) * aNormal.xyz;"
 		"}\n";
 
-	// Fragment shader source code
-	string fragmentShaderSource =
-		"#version 330 core\n"
-		"in vec4 oColor;"
-		"out vec4 fragColor;"
-		"void main()\n"
-		"{\n"
-		"fragColor = oColor;"
-		"}\n";
+	// Fragment shader source code: vertex color, modulated by the mesh's texture layer once any of it is resident.
+	// The level of detail never goes finer than the finest level uploaded so far. Lit scenes then
+	// scale it by the ambient level plus the lights of the fragment's cluster, on whichever side of
+	// the surface faces the camera.
+	string fragmentShaderSource =
+		string(clusteredLighting ? "#version 430 core\n" : "#version 330 core\n") +
+		"in vec4 oColor;"
+		"in vec2 oUV;"
+		"flat in int oLayer;"
+		"in vec3 oViewPosition;"
+		"in vec3 oViewNormal;"
+		"out vec4 fragColor;"
+		+ FrameBlockSource()
+		+ (clusteredLighting ? ClusterLightingSource() : string()) +
+		"uniform sampler2DArray sceneTextures;"
+		"void main()\n"
+		"{\n"
+		"vec2 texelX = dFdx(oUV) * " + to_string(TEXTURE_LAYER_SIZE) + ".0;"
+		"vec2 texelY = dFdy(oUV) * " + to_string(TEXTURE_LAYER_SIZE) + ".0;"
+		"float lod = 0.5 * log2(max(max(dot(texelX, texelX), dot(texelY, texelY)), 1e-8));"
+		"float resident = oLayer < 0 || oLayer >= " + to_string(TEXTURE_MAX_LAYERS) + " ? " + to_string(TEXTURE_LEVELS) + ".0 : textureLevels[oLayer / 4][oLayer % 4];"
+		"fragColor = oColor;"
+		"if (resident < " + to_string(TEXTURE_LEVELS) + ".0)"
+		"fragColor *= textureLod(sceneTextures, vec3(oUV, float(oLayer)), max(lod, resident));"
+		+ (clusteredLighting ?
+		"if (clusterGrid.w > 0.0)"
+		"{"
+		"vec3 normal = normalize(oViewNormal);"
+		"fragColor.rgb *= ClusterLight(oViewPosition, dot(normal, oViewPosition) > 0.0 ? -normal : normal);"
+		"}" : "") +
+		"}\n";
+
+	// Indirect vertex shader: model matrix found through the per-draw data of gl_DrawIDARB
+	string indirectVertexShaderSource =
+		"#version 430 core\n"
+		"#extension GL_ARB_shader_draw_parameters : require\n"
+		+ FloatVertexFormat::ShaderInputs() +
+		"struct DrawData { uint firstTransform; uint mesh; int textureLayer; uint pad0; vec4 positionScale; vec4 positionBias; vec4 uvPlaneU; vec4 uvPlaneV; };"
+		"layout(std430, binding = 0) readonly buffer DrawDataBuffer { DrawData draws[]; };"
+		"layout(std430, binding = 1) readonly buffer TransformBuffer { mat4 transforms[]; };"
+		"out vec4 oColor;"
+		"out vec2 oUV;"
+		"flat out int oLayer;"
+		"out vec3 oViewPosition;"
+		"out vec3 oViewNormal;"
+		+ FrameBlockSource() +
+		"void main()\n"
+		"{\n"
+		"DrawData draw = draws[gl_DrawIDARB];"
+		"mat4 modelMatrix = transforms[draw.firstTransform + uint(gl_InstanceID)];"
+		"vec4 position = vec4(vPosition.xyz * draw.positionScale.xyz + draw.positionBias.xyz, 1.0);"
+		"gl_Position = projection * view * modelMatrix * position;"
+		"oColor = aColor;"
+		"oUV = vec2(dot(draw.uvPlaneU, position), dot(draw.uvPlaneV, position));"
+		"oLayer = draw.textureLayer;"
+		"oViewPosition = vec3(view * modelMatrix * position);"
+		"oViewNormal = mat3(view * modelMatrix) * aNormal.xyz;"
+		"}\n";
+
+	// Creating Shader Program
+	AdoptGpuObject(shaderProgram, CreateShaderProgram(vertexShaderSource, fragmentShaderSource, &shaderUniforms), "scene program");
+	if (indirectSupported)
+		AdoptGpuObject(indirectShaderProgram, CreateShaderProgram(indirectVertexShaderSource, fragmentShaderSource), "indirect program");
+	return true;
+}
+
+// Draw one frame of the scene into the bound framebuffer, seen from the given camera
+void RenderFrame(int frameWidth, int frameHeight, const CameraState& camera)
+{
+	ProfileScope frameScope("RenderFrame");
+	bool software = renderBackend == RENDER_BACKEND_SOFTWARE;
+	frameStats.drawCalls = 0;
+	frameStats.triangles = 0;
+
+	if (!software)
+	{
+		BeginGpuFrame(gpuProfiler);
+		BeginStreamFrame(sceneStream);
+		glViewport(0, 0, frameWidth, frameHeight);
+
+		/* Render here */
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
+
+	// Declare transformations (can be initialized outside loop)
+	glm::mat4 projectionMatrix;
+	{
+		ProfileScope matrixScope("Matrix setup");
+
+		// Rebuild only the world matrices of objects edited since the last frame, or below moved nodes
+		PropagateSceneGraph(sceneGraph, sceneTransforms);
+		UpdateTransforms(sceneTransforms, sceneJobs, &sceneGraph);
+		if (!software)
+			UploadChangedTransforms(transformBuffer, sceneTransforms, sceneStream);
+
+		viewMatrix = glm::lookAt(camera.position, camera.position + camera.front, worldUp);
+
+		// Culling, LOD selection and lighting all read this matrix, so both modes must set it
+		if (isOrtho == true) {
+			GLfloat orthoHalfWidth = orthoHalfHeight * (GLfloat)frameWidth / (GLfloat)frameHeight;
+			projectionMatrix = glm::ortho(-orthoHalfWidth, orthoHalfWidth, -orthoHalfHeight, orthoHalfHeight, NEAR_PLANE, FAR_PLANE);
+			//		cout << "We're Ortho" << endl;
+		}
+		else {
+			projectionMatrix = glm::perspective(fov, (GLfloat)frameWidth / (GLfloat)frameHeight, NEAR_PLANE, FAR_PLANE);
+			//		cout << "We're Projection" << endl;
+		}
+	}
+
+	// Draw only what the frustum can see, from a compacted copy of the visible matrices.
+	// Cylinders and spheres also drop to coarser levels as they shrink on screen.
+	const vector<DrawBatch>* batches = &drawBatches;
+	const glm::mat4* batchMatrices = sceneTransforms.worldMatrices.data();
+	BufferRange batchTransforms = { transformBuffer, 0, (GLsizeiptr)(sceneTransforms.worldMatrices.size() * sizeof(glm::mat4)) };
+	if (cullingEnabled)
+	{
+		ProfileScope cullScope("Cull");
+		RefitCullingHierarchy(sceneBVH, sceneGeometry, sceneTransforms, sceneJobs);
+		CullScene(sceneBVH, ExtractFrustum(projectionMatrix * viewMatrix), sceneVisible.objectVisible, cullStats, sceneJobs);
+		SelectLevelsOfDetail(sceneVisible, sceneBVH, sceneGeometry, projectionMatrix, camera.position, frameHeight, sceneJobs);
+		CompactVisibleSet(sceneVisible, sceneGeometry, drawBatches, sceneTransforms, sceneJobs);
+		if (!software)
+			UploadVisibleTransforms(sceneVisible, sceneStream);
+		batches = &sceneVisible.batches;
+		batchMatrices = sceneVisible.worldMatrices.data();
+		batchTransforms = sceneVisible.transforms;
+	}
+
+	// Light lists are rebuilt every frame, so lights follow their nodes and the camera for free.
+	// Cluster tiles and slices assume a perspective frustum, so ortho views draw unlit.
+	bool lit = !sceneLighting.lights.empty() && !isOrtho;
+	if (lit)
+	{
+		ProfileScope lightScope("Assign lights");
+		AssignLightClusters(sceneLighting, sceneGraph, viewMatrix, projectionMatrix, sceneJobs);
+		if (!software)
+			UploadLightClusters(sceneLighting, sceneStream);
+	}
+
+	// The software backend draws every path's items one placement at a time, front to back
+	if (software)
+	{
+		{
+			ProfileScope queueScope("Build render queue");
+			BuildRenderQueue(renderQueue, RENDER_PER_OBJECT, *batches, batchMatrices, camera.position, sceneJobs);
+			SortRenderQueue(renderQueue);
+		}
+		RasterShading shading = { viewMatrix, texturesEnabled ? &softwareTextures : nullptr, lit ? &sceneLighting : nullptr };
+		RasterizeRenderQueue(softwareTarget, frameWidth, frameHeight, renderQueue, sceneGeometry, *batches, batchMatrices,
+			projectionMatrix * viewMatrix, shading, frameStats, sceneJobs);
+		profileFrame++;
+		return;
+	}
+
+	if (renderPath == RENDER_INDIRECT && (cullingEnabled || indirectListCulled))
+	{
+		// A culled list only lives for this frame; the unculled one is kept until culling comes back on
+		BuildIndirectDrawList(indirectDrawList, sceneGeometry, batches->data(), (GLuint)batches->size(), cullingEnabled ? &sceneStream : nullptr);
+		indirectListCulled = cullingEnabled;
+	}
+
+	// Camera and viewport go to every program through FrameBlock, written once per frame
+	FrameUniforms frame = {};
+	frame.view = viewMatrix;
+	frame.projection = projectionMatrix;
+	frame.viewport = glm::vec4(0.0f, 0.0f, (GLfloat)frameWidth, (GLfloat)frameHeight);
+	frame.time = chrono::duration<GLfloat>(chrono::steady_clock::now() - sceneStartTime).count();
+	for (GLuint layer = 0; layer < TEXTURE_MAX_LAYERS; layer++)
+		frame.textureLevels[layer / 4][layer % 4] = (GLfloat)(layer < sceneTextures.residentLevel.size() ? sceneTextures.residentLevel[layer] : TEXTURE_LEVELS);
+	glm::vec2 depthMapping = ClusterDepthMapping();
+	frame.clusterGrid = glm::vec4((GLfloat)CLUSTER_TILES_X, (GLfloat)CLUSTER_TILES_Y, (GLfloat)CLUSTER_SLICES, lit ? (GLfloat)sceneLighting.lights.size() : 0.0f);
+	frame.clusterDepth = glm::vec4(depthMapping.x, depthMapping.y, LIGHT_AMBIENT, 0.0f);
+	UploadFrameUniforms(sceneUniforms, frame, sceneStream);
+
+	// Queue, sort and submit the frame's draws. The state cache keeps the program and VAO bound
+	// between frames, so an unchanged scene rebinds nothing.
+	if (renderPath == RENDER_PER_OBJECT)
+	{
+		GLuint objectCount = batches->empty() ? 0 : batches->back().firstTransform + batches->back().instanceCount;
+		UploadObjectUniforms(sceneUniforms, batchMatrices, objectCount, sceneStream);
+	}
+	{
+		ProfileScope queueScope("Build render queue");
+		BuildRenderQueue(renderQueue, renderPath, *batches, batchMatrices, camera.position, sceneJobs);
+		SortRenderQueue(renderQueue);
+	}
+	RenderPrograms programs = { { shaderProgram, shaderProgram, indirectShaderProgram }, shaderUniforms };
+	SubmitRenderQueue(renderQueue, glStateCache, programs, sceneGeometry, *batches, batchTransforms, indirectDrawList, frameStats);
+
+	// Texture levels take whatever stream room the frame left; they show from the next frame on
+	PumpTextureStreaming(sceneTextures, sceneStream);
+	EndStreamFrame(sceneStream);
+	profileFrame++;
+}
+
+// Release everything InitScene created
+void ShutdownScene()
+{
+	if (renderBackend == RENDER_BACKEND_SOFTWARE)
+	{
+		softwareTextures.layers.clear();
+		sceneLighting.lights.clear();
+		StopJobSystem(sceneJobs);
+		return;
+	}
+
+	//Clear GPU resources
+
+	ReleaseGpuObject(sceneGeometry.vao);
+	ReleaseGpuObject(sceneGeometry.vbo);
+	ReleaseGpuObject(sceneGeometry.ebo);
+	ReleaseGpuObject(transformBuffer);
+	ReleaseGpuObject(sceneVisible.transformBuffer);
+	StopTextureStreaming(sceneTextures);
+	DestroyClusterLighting(sceneLighting);
+	DestroyStreamBuffer(sceneStream);
+	DeleteUniformBuffers(sceneUniforms);
+	DeleteGpuProfiler(gpuProfiler);
+	InvalidateGLStateCache(glStateCache); // Its program and VAO names are about to be freed
+
+	ReleaseGpuObject(indirectDrawList.commandBuffer);
+	ReleaseGpuObject(indirectDrawList.drawDataBuffer);
+	ReleaseGpuObject(indirectShaderProgram);
+	ReleaseGpuObject(shaderProgram);
+	StopJobSystem(sceneJobs);
+
+	// Anything still registered was created without a matching release above
+	ReportGpuLeaks();
+}
+
+const char* RenderPathName(RenderPath path)
+{
+	if (path == RENDER_PER_OBJECT)
+		return "per-object";
+	if (path == RENDER_INSTANCED)
+		return "instanced";
+	return "indirect";
+}
+
+/* Scene Rendering Definitions End Here */
+
+/* Headless Benchmark Definitions */
+
+// Framebuffer object with color and depth renderbuffers for rendering without a window
+struct OffscreenTarget
+{
+	GpuFramebuffer framebuffer;
+	GpuRenderbuffer colorBuffer, depthBuffer;
+	int width = 0, height = 0;
+};
+
+bool CreateOffscreenTarget(OffscreenTarget& target, int targetWidth, int targetHeight)
+{
+	target.width = targetWidth;
+	target.height = targetHeight;
+
+	// Both formats are padded to 4 bytes a pixel by every driver we know of
+	GLsizeiptr bytes = (GLsizeiptr)targetWidth * targetHeight * 4;
+	CreateGpuObject(target.colorBuffer, "offscreen color");
+	CreateGpuObject(target.depthBuffer, "offscreen depth");
+	if (!TrackGpuObjectBytes(GPU_RENDERBUFFER, target.colorBuffer, bytes, 0) || !TrackGpuObjectBytes(GPU_RENDERBUFFER, target.depthBuffer, bytes, 0))
+		return false;
+
+	glBindRenderbuffer(GL_RENDERBUFFER, target.colorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, targetWidth, targetHeight);
+	LabelGpuObject(target.colorBuffer);
+
+	glBindRenderbuffer(GL_RENDERBUFFER, target.depthBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, targetWidth, targetHeight);
+	LabelGpuObject(target.depthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	CreateGpuObject(target.framebuffer, "offscreen target");
+	glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+	LabelGpuObject(target.framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.colorBuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depthBuffer);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		cout << "Headless Error: offscreen framebuffer is incomplete" << endl;
+		return false;
+	}
+	return true;
+}
+
+void DestroyOffscreenTarget(OffscreenTarget& target)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	ReleaseGpuObject(target.framebuffer);
+	ReleaseGpuObject(target.colorBuffer);
+	ReleaseGpuObject(target.depthBuffer);
+}
+
+// Write RGB8 pixels whose rows start at the bottom, as GL and the software target store them
+bool WritePPM(const string& path, int imageWidth, int imageHeight, const vector<unsigned char>& pixels)
+{
+	ofstream out(path, ios::binary | ios::trunc);
+	out << "P6\n" << imageWidth << " " << imageHeight << "\n255\n";
+	for (int row = imageHeight - 1; row >= 0; row--) // GL rows start at the bottom
+		out.write((const char*)&pixels[(size_t)row * imageWidth * 3], imageWidth * 3);
+	return (bool)out;
+}
+
+// Read a P6 PPM back into rows that start at the bottom
+bool ReadPPM(const string& path, int& imageWidth, int& imageHeight, vector<unsigned char>& pixels)
+{
+	ifstream in(path, ios::binary);
+	string magic;
+	int maxValue = 0;
+	if (!(in >> magic >> imageWidth >> imageHeight >> maxValue) || magic != "P6" || maxValue != 255 || imageWidth <= 0 || imageHeight <= 0)
+		return false;
+	in.get(); // The single whitespace before the pixels
+
+	pixels.resize((size_t)imageWidth * imageHeight * 3);
+	for (int row = imageHeight - 1; row >= 0; row--)
+		in.read((char*)&pixels[(size_t)row * imageWidth * 3], imageWidth * 3);
+	return (bool)in;
+}
+
+// Last rendered frame as RGB8 rows from the bottom, from whichever backend drew it
+void ReadFramebufferPixels(int imageWidth, int imageHeight, vector<unsigned char>& pixels)
+{
+	if (renderBackend == RENDER_BACKEND_SOFTWARE)
+	{
+		pixels = softwareTarget.color;
+		return;
+	}
+	pixels.resize((size_t)imageWidth * imageHeight * 3);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, imageWidth, imageHeight, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+}
+
+bool WriteFramebufferPPM(const string& path, int imageWidth, int imageHeight)
+{
+	vector<unsigned char> pixels;
+	ReadFramebufferPixels(imageWidth, imageHeight, pixels);
+	return WritePPM(path, imageWidth, imageHeight, pixels);
+}
+
+// Scripted camera: one orbit around the bookshelf over the run, bobbing up and down
+void SetScriptedCamera(GLuint frame, GLuint frameCount)
+{
+	GLfloat angle = 2.0f * (GLfloat)PI * frame / frameCount;
+	glm::vec3 shelfCenter = glm::vec3(0.0f, 5.0f, 0.0f);
+	cameraPosition = glm::vec3(14.0f * sinf(angle), 5.0f + 3.0f * sinf(2.0f * angle), 14.0f * cosf(angle));
+	cameraFront = glm::normalize(shelfCenter - cameraPosition);
+}
+
+// Nearest-rank percentile of sorted samples
+double Percentile(const vector<double>& sorted, double percent)
+{
+	size_t rank = (size_t)ceil(percent / 100.0 * sorted.size());
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+#ifdef SCENE_HAS_EGL
+// EGL context with no window: surfaceless where Mesa offers it, a 1x1 pbuffer otherwise.
+// Works on llvmpipe with no display and no GPU.
+struct HeadlessContext
+{
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLSurface surface = EGL_NO_SURFACE;
+	EGLContext context = EGL_NO_CONTEXT;
+};
+
+bool CreateHeadlessContext(HeadlessContext& headless)
+{
+	const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	bool surfaceless = getPlatformDisplay != nullptr && clientExtensions != nullptr && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") != nullptr;
+
+	if (surfaceless)
+		headless.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	else
+		headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if (headless.display == EGL_NO_DISPLAY || !eglInitialize(headless.display, &major, &minor))
+	{
+		cout << "Headless Error: no EGL display" << endl;
+		return false;
+	}
+
+	EGLint configAttributes[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+		EGL_NONE
+	};
+	EGLConfig config;
+	EGLint configCount = 0;
+	if (!eglChooseConfig(headless.display, configAttributes, &config, 1, &configCount) || configCount == 0 || !eglBindAPI(EGL_OPENGL_API))
+	{
+		cout << "Headless Error: no desktop OpenGL EGL config" << endl;
+		return false;
+	}
+
+	headless.context = eglCreateContext(headless.display, config, EGL_NO_CONTEXT, nullptr);
+	if (headless.context == EGL_NO_CONTEXT)
+	{
+		cout << "Headless Error: eglCreateContext failed (0x" << hex << eglGetError() << dec << ")" << endl;
+		return false;
+	}
+
+	if (!surfaceless)
+	{
+		EGLint pbufferAttributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		headless.surface = eglCreatePbufferSurface(headless.display, config, pbufferAttributes);
+	}
+
+	if (!eglMakeCurrent(headless.display, headless.surface, headless.surface, headless.context))
+	{
+		cout << "Headless Error: eglMakeCurrent failed (0x" << hex << eglGetError() << dec << ")" << endl;
+		return false;
+	}
+	return true;
+}
+
+void DestroyHeadlessContext(HeadlessContext& headless)
+{
+	if (headless.display == EGL_NO_DISPLAY)
+		return;
+	eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (headless.surface != EGL_NO_SURFACE)
+		eglDestroySurface(headless.display, headless.surface);
+	if (headless.context != EGL_NO_CONTEXT)
+		eglDestroyContext(headless.display, headless.context);
+	eglTerminate(headless.display);
+	headless.display = EGL_NO_DISPLAY;
+}
+#endif
+
+// Load GL entry points for the current context. GLEW builds for GLX report a missing GLX display
+// under EGL after the core entry points are already loaded, so that result counts as success.
+bool InitGLEW()
+{
+	glewExperimental = GL_TRUE;
+	GLenum status = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	if (status == GLEW_ERROR_NO_GLX_DISPLAY)
+		status = GLEW_OK;
+#endif
+	glGetError(); // GLEW can leave GL_INVALID_ENUM behind on core contexts
+	return status == GLEW_OK;
+}
+
+// What a headless run owns besides the scene: the context and offscreen target of the GL backend
+struct HeadlessRenderer
+{
+#ifdef SCENE_HAS_EGL
+	HeadlessContext context;
+#endif
+	OffscreenTarget target;
+	bool software = false;
+	double initMilliseconds = 0.0;
+};
+
+// Create the context (GL backend only), initialize the scene and bind a frameWidth x frameHeight target
+bool OpenHeadlessRenderer(HeadlessRenderer& renderer, const SceneFile& sceneFile, int frameWidth, int frameHeight)
+{
+	// The software backend needs no context at all
+	renderer.software = renderBackend == RENDER_BACKEND_SOFTWARE;
+#ifdef SCENE_HAS_EGL
+	if (!renderer.software && !CreateHeadlessContext(renderer.context))
+	{
+		DestroyHeadlessContext(renderer.context);
+		return false;
+	}
+	if (!renderer.software && !InitGLEW())
+	{
+		cout << "Headless Error: GLEW failed to initialize" << endl;
+		DestroyHeadlessContext(renderer.context);
+		return false;
+	}
+#else
+	if (!renderer.software)
+	{
+		cout << "Headless Error: headless GL needs EGL, which this build does not have (try --backend software)" << endl;
+		return false;
+	}
+#endif
+
+	chrono::steady_clock::time_point initStart = chrono::steady_clock::now();
+	bool initialized = InitScene(sceneFile);
+	if (!renderer.software)
+		glFinish();
+	renderer.initMilliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - initStart).count();
+
+	// Measured frames and golden images want every texture level in place, not whatever arrived first
+	if (initialized && !renderer.software)
+		FinishTextureStreaming(sceneTextures, sceneStream);
+
+	if (!initialized || (!renderer.software && !CreateOffscreenTarget(renderer.target, frameWidth, frameHeight)))
+	{
+		if (!renderer.software)
+			DestroyOffscreenTarget(renderer.target);
+		ShutdownScene();
+#ifdef SCENE_HAS_EGL
+		DestroyHeadlessContext(renderer.context);
+#endif
+		return false;
+	}
+	return true;
+}
+
+// Wait until the frame is really drawn, so timings count the GPU (or llvmpipe) work, not just submission
+void FinishHeadlessFrame(const HeadlessRenderer& renderer)
+{
+	if (renderer.software)
+		return;
+	ProfileScope finishScope("glFinish");
+	glFinish();
+}
+
+// Tear everything down; returns false if GL reported an error along the way
+bool CloseHeadlessRenderer(HeadlessRenderer& renderer)
+{
+	bool glError = !renderer.software && IsOpenGLError();
+	if (!renderer.software)
+		DestroyOffscreenTarget(renderer.target);
+	ShutdownScene();
+#ifdef SCENE_HAS_EGL
+	if (!renderer.software)
+		DestroyHeadlessContext(renderer.context);
+#endif
+	return !glError;
+}
+
+const char* HeadlessRendererName(const HeadlessRenderer& renderer)
+{
+	return renderer.software ? "software rasterizer" : (const char*)glGetString(GL_RENDERER);
+}
+
+// Render frameCount frames along the scripted camera path into an FBO and report frame-time
+// percentiles, draw calls and triangles
+int RunHeadlessBenchmark(const SceneFile& sceneFile, GLuint frameCount, int frameWidth, int frameHeight, const string& outputPath)
+{
+	HeadlessRenderer renderer;
+	if (!OpenHeadlessRenderer(renderer, sceneFile, frameWidth, frameHeight))
+		return -1;
+
+	// Warm up shader compilation and buffer uploads before timing
+	const GLuint warmupFrames = 5;
+	for (GLuint frame = 0; frame < warmupFrames; frame++)
+	{
+		SetScriptedCamera(frame, frameCount);
+		RenderFrame(frameWidth, frameHeight, CurrentCamera());
+	}
+	FinishHeadlessFrame(renderer);
+
+	GLuint skippedBefore = glStateCache.skippedChanges;
+	vector<double> frameTimes;
+	for (GLuint frame = 0; frame < frameCount; frame++)
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		SetScriptedCamera(frame, frameCount);
+		RenderFrame(frameWidth, frameHeight, CurrentCamera());
+		FinishHeadlessFrame(renderer);
+		frameTimes.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+	}
+
+	vector<double> sorted = frameTimes;
+	sort(sorted.begin(), sorted.end());
+	double total = 0.0;
+	for (size_t i = 0; i < sorted.size(); i++)
+		total += sorted[i];
 
-	// Creating Shader Program
-	GLuint shaderProgram = CreateShaderProgram(vertexShaderSource, fragmentShaderSource);
+	cout << "Headless benchmark: " << frameCount << " frames at " << frameWidth << "x" << frameHeight << ", "
+		<< (renderer.software ? "software" : RenderPathName(renderPath)) << " path" << endl;
+	if (renderer.software)
+		cout << "Renderer: software rasterizer (" << softwareTarget.tilesX * softwareTarget.tilesY << " tiles of " << RASTER_TILE_SIZE << " pixels)" << endl;
+	else
+		cout << "Renderer: " << glGetString(GL_RENDERER) << " (" << glGetString(GL_VERSION) << ")" << endl;
+	cout << "Job workers: " << sceneJobs.workerCount << endl;
+	cout << "Scene init ms: " << renderer.initMilliseconds << " (shader cache: " << shaderCacheHits << " hits, " << shaderCacheMisses << " misses)" << endl;
+	cout << "Frame time ms: p50 " << Percentile(sorted, 50.0) << "  p95 " << Percentile(sorted, 95.0) << "  p99 " << Percentile(sorted, 99.0)
+		<< "  mean " << total / sorted.size() << "  max " << sorted.back() << endl;
+	cout << "Draw calls per frame: " << frameStats.drawCalls << endl;
+	cout << "Triangles per frame: " << frameStats.triangles << endl;
+	cout << "Redundant state changes skipped per frame: " << (glStateCache.skippedChanges - skippedBefore) / max(frameCount, 1u) << endl;
+	if (cullingEnabled)
+		cout << "Culling: " << cullStats.nodesTested << " nodes and " << cullStats.objectsTested << " objects tested, "
+			<< cullStats.visible << " visible, " << cullStats.culled << " culled" << endl;
+	else
+		cout << "Culling: off" << endl;
+	if (sceneStream.buffer)
+		cout << "Stream buffer: " << STREAM_FRAME_REGIONS << " x " << sceneStream.regionSize / 1024 << " KB, " << sceneStream.waits << " frames waited, "
+			<< sceneStream.overflows << " uploads fell back to orphaning" << endl;
+	else if (!renderer.software)
+		cout << "Stream buffer: off" << endl;
+	if (sceneTextures.array)
+		cout << "Texture streaming: " << sceneTextures.residentLevel.size() << " layers (" << (sceneTextures.format == TEXTURE_FORMAT_BC1 ? "BC1" : "RGBA8") << "), "
+			<< sceneTextures.failedLayers << " failed, " << sceneTextures.uploadedBytes / 1024 << " KB uploaded, placeholders after "
+			<< sceneTextures.placeholderMilliseconds << " ms, complete after " << sceneTextures.completeMilliseconds << " ms" << endl;
+	else if (renderer.software && !softwareTextures.layers.empty())
+		cout << "Software textures: " << softwareTextures.layers.size() << " layers (" << (softwareTextures.format == TEXTURE_FORMAT_BC1 ? "BC1" : "RGBA8") << "), "
+			<< softwareTextures.failedLayers << " failed" << endl;
+	else
+		cout << "Texture streaming: off" << endl;
+	if (!sceneLighting.lights.empty())
+		cout << "Clustered lighting: " << sceneLighting.lights.size() << " lights, " << sceneLighting.assignedLights << " light-cluster pairs, max "
+			<< sceneLighting.busiestCluster << " per cluster, " << sceneLighting.droppedLights << " dropped" << endl;
+	else if (!renderer.software)
+		cout << "Clustered lighting: off" << endl;
+	if (!renderer.software)
+		PrintGpuMemoryReport(gpuReportObjects);
+
+	if (!outputPath.empty() && !WriteFramebufferPPM(outputPath, frameWidth, frameHeight))
+		cout << "Headless Error: cannot write " << outputPath << endl;
+
+	return CloseHeadlessRenderer(renderer) ? 0 : -1;
+}
+
+// Time one way of rebuilding every world matrix and print its median and best pass
+template <typename Pass>
+double TimeTransformPass(const char* name, GLuint iterations, Pass pass)
+{
+	vector<double> times;
+	for (GLuint i = 0; i < iterations; i++)
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		pass();
+		times.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+	}
+	sort(times.begin(), times.end());
+	cout << "  " << left << setw(16) << name << right << " median " << fixed << setprecision(3) << Percentile(times, 50.0)
+		<< " ms  best " << times.front() << " ms" << endl;
+	cout.unsetf(ios::floatfield);
+	cout << setprecision(6);
+	return Percentile(times, 50.0);
+}
 
+// Largest difference between the kernels' matrices and glm's
+GLfloat MaxMatrixError(const vector<glm::mat4>& a, const vector<glm::mat4>& b)
+{
+	GLfloat error = 0.0f;
+	for (size_t i = 0; i < a.size(); i++)
+		for (GLuint j = 0; j < 16; j++)
+			error = max(error, fabsf(glm::value_ptr(a[i])[j] - glm::value_ptr(b[i])[j]));
+	return error;
+}
 
-	/* Loop until the user closes the window */
-	while (!glfwWindowShouldClose(window))
+// --bench-transforms: rebuild the matrices of count randomly placed objects through the glm chain,
+// each kernel this CPU supports, and the job workers. Needs no GL context.
+int RunTransformBenchmark(GLuint count)
+{
+	const GLuint iterations = 50;
+	TransformStore store;
+	vector<glm::vec3> positions, rotations, scales;
+	uint32_t seed = 12345;
+	auto random = [&seed](GLfloat low, GLfloat high) {
+		seed = seed * 1664525u + 1013904223u;
+		return low + (high - low) * (seed >> 8) / 16777216.0f;
+	};
+	for (GLuint i = 0; i < count; i++)
 	{
-		// Set deltaTime
-		GLfloat currentFrame = glfwGetTime();
-		deltaTime = currentFrame - lastFrame;
-		lastFrame = currentFrame;
+		positions.push_back(glm::vec3(random(-100.0f, 100.0f), random(0.0f, 20.0f), random(-100.0f, 100.0f)));
+		rotations.push_back(glm::vec3(random(-180.0f, 180.0f), random(-180.0f, 180.0f), random(-180.0f, 180.0f)));
+		scales.push_back(glm::vec3(random(0.5f, 2.0f), random(0.5f, 2.0f), random(0.5f, 2.0f)));
+		AddTransform(store, positions.back(), rotations.back(), scales.back());
+	}
 
-		// Resize window and graphics simultaneously
-		glfwGetFramebufferSize(window, &width, &height);
-		glViewport(0, 0, width, height);
+	cout << "Transform benchmark: " << count << " objects, " << iterations << " passes, detected kernel " << TransformKernelName(transformKernel) << endl;
+	vector<glm::mat4> reference(count);
+	TimeTransformPass("glm", iterations, [&]() {
+		for (GLuint i = 0; i < count; i++)
+			reference[i] = ComposeTransform(positions[i], rotations[i], scales[i]);
+	});
 
-		/* Render here */
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	for (GLuint kernel = TRANSFORM_KERNEL_SCALAR; kernel <= (GLuint)transformKernel; kernel++)
+	{
+		TimeTransformPass(TransformKernelName((TransformKernel)kernel), iterations, [&]() {
+			ComposeTransforms((TransformKernel)kernel, store, 0, count);
+		});
+		cout << "  " << setw(16) << "" << " max difference from glm " << MaxMatrixError(store.worldMatrices, reference) << endl;
+	}
 
-		// Use Shader Program exe and select VAO before drawing 
-		glUseProgram(shaderProgram); // Call Shader per-frame when updating attributes
+	// The frame path: dirty flags, blocks and the job workers
+	StartJobSystem(sceneJobs, jobThreadCount);
+	string jobsName = string(TransformKernelName(transformKernel)) + " jobs x" + to_string(sceneJobs.workerCount);
+	TimeTransformPass(jobsName.c_str(), iterations, [&]() {
+		store.dirty.assign(count, 1);
+		store.anyDirty = true;
+		UpdateTransforms(store, sceneJobs);
+	});
+	StopJobSystem(sceneJobs);
+	return 0;
+}
 
+/* Headless Benchmark Definitions End Here */
 
-		// Declare transformations (can be initialized outside loop)
-		glm::mat4 projectionMatrix;
+/* Regression Harness Definitions */
 
-		viewMatrix = glm::lookAt(cameraPosition, getTarget(), worldUp);
+// --regress renders fixed camera poses offscreen, compares them with golden images within a
+// per-pixel tolerance, and checks draw calls and triangles against a baseline file.
+// --regress-update rewrites the goldens and the baseline. Runs force Mesa's software GL, so the
+// goldens reproduce on any Linux machine, GPU or not. Frame times only compare on one host, so
+// they live in an uncommitted timings file that the first run on a machine records.
+const int REGRESSION_WIDTH = 240, REGRESSION_HEIGHT = 180;
+const GLuint REGRESSION_WARMUP_FRAMES = 3;
+const GLuint REGRESSION_TIMED_FRAMES = 20;
+const char* const REGRESSION_TIMINGS_FILE = "timings.local.txt";
 
-		if (isOrtho == true) {
-			glm::ortho(-1.0f, 600.0f, 1.0f, 600.0f, -1.0f, 100.0f);
-			//		cout << "We're Ortho" << endl;
+struct RegressionPose
+{
+	const char* name;
+	glm::vec3 position;
+	glm::vec3 target;
+};
+
+const RegressionPose REGRESSION_POSES[] = {
+	{ "front", glm::vec3(0.0f, 5.0f, 16.0f), glm::vec3(0.0f, 5.0f, 0.0f) },
+	{ "corner", glm::vec3(12.0f, 9.0f, 12.0f), glm::vec3(0.0f, 5.0f, 0.0f) },
+	{ "top", glm::vec3(0.0f, 18.0f, 6.0f), glm::vec3(0.0f, 6.0f, 0.0f) },
+	{ "brick", glm::vec3(6.0f, 6.0f, 6.0f), glm::vec3(3.0f, 4.25f, 0.0f) },
+	{ "tennis-ball", glm::vec3(1.5f, 8.5f, 3.5f), glm::vec3(0.0f, 7.5f, 0.0f) },
+	{ "toilet-paper", glm::vec3(-1.0f, 5.5f, 5.0f), glm::vec3(-3.0f, 4.65f, 0.0f) }
+};
+const GLuint REGRESSION_POSE_COUNT = sizeof(REGRESSION_POSES) / sizeof(REGRESSION_POSES[0]);
+
+// Limits stored at the top of the baseline file, where they can be edited by hand
+struct RegressionThresholds
+{
+	int pixelTolerance = 2;				// Largest per-channel difference that still counts as a match
+	double mismatchFraction = 0.002;	// Share of pixels allowed past pixelTolerance
+	double frameTimeRatio = 1.5;		// Median frame time may grow by this factor...
+	double frameTimeSlack = 0.5;		// ...and must also grow by this many ms, so sub-ms noise never fails a run
+	double drawCallRatio = 1.0;
+	double triangleRatio = 1.0;
+};
+
+struct RegressionMetrics
+{
+	string pose;
+	double frameMilliseconds = -1.0;	// Median of REGRESSION_TIMED_FRAMES, negative when not recorded
+	GLuint drawCalls = 0;
+	uint64_t triangles = 0;
+};
+
+// Baseline and timings format, one record per line: 'threshold <name> <value>', 'render_path <name>'
+// and 'pose <name>' followed by any of 'frame_ms <ms>', 'draw_calls <n>', 'triangles <n>'.
+// '#' starts a comment.
+bool ReadRegressionBaseline(const string& path, RegressionThresholds& thresholds, string& pathName, vector<RegressionMetrics>& metrics)
+{
+	ifstream in(path);
+	if (!in)
+		return false;
+
+	string line;
+	while (getline(in, line))
+	{
+		istringstream fields(line.substr(0, line.find('#')));
+		string keyword, name;
+		if (!(fields >> keyword))
+			continue;
+		if (keyword == "threshold" && fields >> name)
+		{
+			if (name == "pixel_tolerance")
+				fields >> thresholds.pixelTolerance;
+			else if (name == "mismatch_fraction")
+				fields >> thresholds.mismatchFraction;
+			else if (name == "frame_time_ratio")
+				fields >> thresholds.frameTimeRatio;
+			else if (name == "frame_time_slack_ms")
+				fields >> thresholds.frameTimeSlack;
+			else if (name == "draw_call_ratio")
+				fields >> thresholds.drawCallRatio;
+			else if (name == "triangle_ratio")
+				fields >> thresholds.triangleRatio;
 		}
-		else {
-			projectionMatrix = glm::perspective(fov, (GLfloat)width / (GLfloat)height, 0.1f, 100.0f);
-			//		cout << "We're Projection" << endl;
+		else if (keyword == "render_path")
+			fields >> pathName;
+		else if (keyword == "pose")
+		{
+			RegressionMetrics record;
+			if (!(fields >> record.pose))
+				continue;
+			while (fields >> name)
+			{
+				if (name == "frame_ms")
+					fields >> record.frameMilliseconds;
+				else if (name == "draw_calls")
+					fields >> record.drawCalls;
+				else if (name == "triangles")
+					fields >> record.triangles;
+			}
+			metrics.push_back(record);
 		}
+	}
+	return true;
+}
 
-		// Get matrix's uniform location and set matrix
-		GLint modelLoc = glGetUniformLocation(shaderProgram, "model");
-		GLint viewLoc = glGetUniformLocation(shaderProgram, "view");
-		GLint projLoc = glGetUniformLocation(shaderProgram, "projection");
+bool WriteRegressionBaseline(const string& path, const RegressionThresholds& thresholds, const string& pathName, const vector<RegressionMetrics>& metrics)
+{
+	ofstream out(path, ios::trunc);
+	out << "# Regression baseline, written by --regress-update and checked by --regress." << endl;
+	out << "# Frame times are kept per machine in " << REGRESSION_TIMINGS_FILE << ", which is not committed." << endl;
+	out << "threshold pixel_tolerance " << thresholds.pixelTolerance << endl;
+	out << "threshold mismatch_fraction " << thresholds.mismatchFraction << endl;
+	out << "threshold frame_time_ratio " << thresholds.frameTimeRatio << endl;
+	out << "threshold frame_time_slack_ms " << thresholds.frameTimeSlack << endl;
+	out << "threshold draw_call_ratio " << thresholds.drawCallRatio << endl;
+	out << "threshold triangle_ratio " << thresholds.triangleRatio << endl;
+	out << "render_path " << pathName << endl;
+	for (size_t i = 0; i < metrics.size(); i++)
+		out << "pose " << metrics[i].pose << " draw_calls " << metrics[i].drawCalls << " triangles " << metrics[i].triangles << endl;
+	return (bool)out;
+}
 
-		glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(viewMatrix));
-		glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
+bool WriteRegressionTimings(const string& path, const string& pathName, const vector<RegressionMetrics>& metrics)
+{
+	ofstream out(path, ios::trunc);
+	out << "# Median frame times on this machine, recorded by the first --regress run and by --regress-update." << endl;
+	out << "# Delete this file to re-record them." << endl;
+	out << "render_path " << pathName << endl;
+	for (size_t i = 0; i < metrics.size(); i++)
+		out << "pose " << metrics[i].pose << " frame_ms " << fixed << setprecision(3) << metrics[i].frameMilliseconds << endl;
+	return (bool)out;
+}
 
-		glBindVertexArray(brickRectangleTBVAO); // User-defined VAO must be called before draw. 
-			for (GLuint i = 2; i < 4; i++)	// Top Bottom
-			{
-				glm::mat4 modelMatrix;
-				modelMatrix = glm::translate(modelMatrix, brickPlanePositions[i]);
-				modelMatrix = glm::rotate(modelMatrix, brickPlaneRotations[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
-				modelMatrix = glm::rotate(modelMatrix, brickPlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-				glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-				// Draw primitive(s)
-				draw();
-			}
-		glBindVertexArray(0); //Incase different VAO wll be used after
+// Entry for pose in records, or nullptr
+const RegressionMetrics* FindRegressionMetrics(const vector<RegressionMetrics>& records, const string& pose)
+{
+	for (size_t i = 0; i < records.size(); i++)
+		if (records[i].pose == pose)
+			return &records[i];
+	return nullptr;
+}
+
+// Count pixels whose largest channel difference exceeds tolerance, and mark them red in diff
+GLuint CompareImages(const vector<unsigned char>& actual, const vector<unsigned char>& golden, int tolerance, vector<unsigned char>& diff)
+{
+	GLuint mismatched = 0;
+	diff.resize(actual.size());
+	for (size_t pixel = 0; pixel + 2 < actual.size(); pixel += 3)
+	{
+		int largest = 0;
+		for (GLuint channel = 0; channel < 3; channel++)
+			largest = max(largest, abs((int)actual[pixel + channel] - (int)golden[pixel + channel]));
+		bool mismatch = largest > tolerance;
+		mismatched += mismatch ? 1 : 0;
+		// Mismatches in red over a dimmed copy of the frame
+		unsigned char gray = (unsigned char)((actual[pixel] + actual[pixel + 1] + actual[pixel + 2]) / 12);
+		diff[pixel] = mismatch ? 255 : gray;
+		diff[pixel + 1] = mismatch ? 0 : gray;
+		diff[pixel + 2] = mismatch ? 0 : gray;
+	}
+	return mismatched;
+}
+
+// Render every pose; compare with (or, when update is set, rewrite) the goldens and baseline in directory
+int RunRegression(const SceneFile& sceneFile, const string& directory, bool update)
+{
+#ifdef __linux__
+	setenv("LIBGL_ALWAYS_SOFTWARE", "1", 0);	// llvmpipe, unless the caller chose otherwise
+#endif
+	// Goldens are only comparable within one path, and the software backend is a path of its own
+	string pathName = renderBackend == RENDER_BACKEND_SOFTWARE ? "software" : RenderPathName(renderPath);
+	string baselinePath = directory + "/baseline.txt";
+	RegressionThresholds thresholds;
+	string baselinePathName;
+	vector<RegressionMetrics> baseline;
+	bool haveBaseline = ReadRegressionBaseline(baselinePath, thresholds, baselinePathName, baseline);
+	if (!update && !haveBaseline)
+	{
+		cout << "Regression Error: no baseline at " << baselinePath << " (create one with --regress-update)" << endl;
+		return -1;
+	}
+	if (!update && baselinePathName != pathName)
+	{
+		cout << "Regression Error: the baseline was recorded on the " << baselinePathName << " path, this run uses " << pathName << endl;
+		return -1;
+	}
+	// Timings from another path, or from no earlier run on this machine, are recorded rather than checked
+	string timingsPath = directory + "/" + REGRESSION_TIMINGS_FILE;
+	RegressionThresholds timingsThresholds;
+	string timingsPathName;
+	vector<RegressionMetrics> timings;
+	bool haveTimings = !update && ReadRegressionBaseline(timingsPath, timingsThresholds, timingsPathName, timings) && timingsPathName == pathName;
+
+	if (update)
+#ifdef _WIN32
+		_mkdir(directory.c_str());
+#else
+		mkdir(directory.c_str(), 0755);
+#endif
+
+	HeadlessRenderer renderer;
+	if (!OpenHeadlessRenderer(renderer, sceneFile, REGRESSION_WIDTH, REGRESSION_HEIGHT))
+		return -1;
+	cout << "Regression " << (update ? "update" : "check") << ": " << REGRESSION_POSE_COUNT << " poses at " << REGRESSION_WIDTH << "x" << REGRESSION_HEIGHT
+		<< ", " << pathName << " path, " << HeadlessRendererName(renderer) << endl;
 
-			glBindVertexArray(brickRectangleLRVAO); // User-defined VAO must be called before draw. 
-			for (GLuint i = 0; i < 2; i++)	// Brick left right
+	GLuint failures = 0;
+	vector<RegressionMetrics> measured;
+	for (GLuint i = 0; i < REGRESSION_POSE_COUNT; i++)
+	{
+		const RegressionPose& pose = REGRESSION_POSES[i];
+		cameraPosition = pose.position;
+		cameraFront = glm::normalize(pose.target - pose.position);
+
+		for (GLuint frame = 0; frame < REGRESSION_WARMUP_FRAMES; frame++)
+			RenderFrame(REGRESSION_WIDTH, REGRESSION_HEIGHT, CurrentCamera());
+		FinishHeadlessFrame(renderer);
+		vector<double> frameTimes;
+		for (GLuint frame = 0; frame < REGRESSION_TIMED_FRAMES; frame++)
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			RenderFrame(REGRESSION_WIDTH, REGRESSION_HEIGHT, CurrentCamera());
+			FinishHeadlessFrame(renderer);
+			frameTimes.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+		}
+		sort(frameTimes.begin(), frameTimes.end());
+		RegressionMetrics metrics = { pose.name, Percentile(frameTimes, 50.0), frameStats.drawCalls, frameStats.triangles };
+		measured.push_back(metrics);
+
+		vector<unsigned char> pixels;
+		ReadFramebufferPixels(REGRESSION_WIDTH, REGRESSION_HEIGHT, pixels);
+		string goldenPath = directory + "/" + pose.name + ".ppm";
+		if (update)
+		{
+			if (!WritePPM(goldenPath, REGRESSION_WIDTH, REGRESSION_HEIGHT, pixels))
 			{
-				glm::mat4 modelMatrix;
-				modelMatrix = glm::translate(modelMatrix, brickPlanePositions[i]);
-				modelMatrix = glm::rotate(modelMatrix, brickPlaneRotations[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
-				glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-				// Draw primitive(s)
-				draw();
+				cout << "Regression Error: cannot write " << goldenPath << endl;
+				failures++;
 			}
-		// Unbind Shader exe and VOA after drawing per frame
-		glBindVertexArray(0); //Incase different VAO will be used after
+			continue;
+		}
 
-		glBindVertexArray(brickRectangleCapVAO); // User-defined VAO must be called before draw.
-			for (GLuint i = 0; i < 2; i++)		// Brick front back
+		// Image against its golden
+		vector<string> problems;
+		int goldenWidth = 0, goldenHeight = 0;
+		vector<unsigned char> golden, diff;
+		if (!ReadPPM(goldenPath, goldenWidth, goldenHeight, golden) || goldenWidth != REGRESSION_WIDTH || goldenHeight != REGRESSION_HEIGHT)
+			problems.push_back("missing or mis-sized golden " + goldenPath);
+		else
+		{
+			GLuint mismatched = CompareImages(pixels, golden, thresholds.pixelTolerance, diff);
+			double fraction = (double)mismatched / (REGRESSION_WIDTH * REGRESSION_HEIGHT);
+			if (fraction > thresholds.mismatchFraction)
 			{
-				glm::mat4 modelMatrix;
-				modelMatrix = glm::translate(modelMatrix, brickRectangleCapPlanePositions[i]);
-				glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-				// Draw primitive(s)
-				draw();
+				ostringstream problem;
+				problem << mismatched << " pixels differ by more than " << thresholds.pixelTolerance << " (" << fraction * 100.0 << "%)";
+				problems.push_back(problem.str());
+				WritePPM(directory + "/" + pose.name + ".actual.ppm", REGRESSION_WIDTH, REGRESSION_HEIGHT, pixels);
+				WritePPM(directory + "/" + pose.name + ".diff.ppm", REGRESSION_WIDTH, REGRESSION_HEIGHT, diff);
 			}
-		// Unbind Shader exe and VOA after drawing per frame
-		glBindVertexArray(0); //Incase different VAO wii be used after
-
-		glBindVertexArray(floorVAO);  // floor square
-			glm::mat4 modelMatrix;
-			modelMatrix = glm::rotate(modelMatrix, 90.f * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-			modelMatrix = glm::scale(modelMatrix, glm::vec3(15.0f, 15.0f, 15.0f));
-			glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-			draw();
-		glBindVertexArray(0); //Incase different VAO will be used after
-
-		glBindVertexArray(wallVAO);  // Wall square
-			glm::mat4 wallModelMatrix;
-			glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(wallModelMatrix));
-			draw();
-		glBindVertexArray(0); //Incase different VAO will be used after
-
-
-		glBindVertexArray(shelfRectangleTBVAO); // User-defined VAO must be called before draw. 
-			for (GLuint i = 0; i < 32; i++)	{
-				// Create shelf top and bottoms
-				if (i >= 2 && i < 4) {		// Bottom shelf
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+		}
 
-				if (i >= 6 && i < 8) {
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+		// Counts against the baseline, frame time against this machine's timings
+		const RegressionMetrics* expected = FindRegressionMetrics(baseline, pose.name);
+		const RegressionMetrics* timed = haveTimings ? FindRegressionMetrics(timings, pose.name) : nullptr;
+		if (expected == nullptr)
+			problems.push_back("no baseline metrics");
+		else
+		{
+			ostringstream problem;
+			if (timed != nullptr && timed->frameMilliseconds >= 0.0
+				&& metrics.frameMilliseconds > timed->frameMilliseconds * thresholds.frameTimeRatio
+				&& metrics.frameMilliseconds > timed->frameMilliseconds + thresholds.frameTimeSlack)
+				problem << "frame time " << metrics.frameMilliseconds << " ms vs " << timed->frameMilliseconds << " ms; ";
+			if (metrics.drawCalls > expected->drawCalls * thresholds.drawCallRatio)
+				problem << "draw calls " << metrics.drawCalls << " vs " << expected->drawCalls << "; ";
+			if (metrics.triangles > expected->triangles * thresholds.triangleRatio)
+				problem << "triangles " << metrics.triangles << " vs " << expected->triangles << "; ";
+			if (!problem.str().empty())
+				problems.push_back(problem.str().substr(0, problem.str().size() - 2));
+		}
 
-				if (i >= 10 && i < 12) {
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+		cout << "  " << left << setw(14) << pose.name << right << (problems.empty() ? "PASS" : "FAIL") << "  " << fixed << setprecision(3)
+			<< metrics.frameMilliseconds << " ms, " << metrics.drawCalls << " draws, " << metrics.triangles << " triangles" << endl;
+		cout.unsetf(ios::floatfield);
+		cout << setprecision(6);
+		for (size_t j = 0; j < problems.size(); j++)
+			cout << "      " << problems[j] << endl;
+		failures += problems.empty() ? 0 : 1;
+	}
 
-				if (i >= 14 && i < 16) {		// top shelf
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
-			
-				// Create Pillar Left and Rights
-				if (i >= 18 && i < 20) {		// leftmost pillar
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+	if (update && !WriteRegressionBaseline(baselinePath, thresholds, pathName, measured))
+	{
+		cout << "Regression Error: cannot write " << baselinePath << endl;
+		failures++;
+	}
+	if (!haveTimings && failures == 0)
+	{
+		if (WriteRegressionTimings(timingsPath, pathName, measured))
+			cout << "Frame times recorded to " << timingsPath << "; later runs on this machine check against them" << endl;
+		else
+			cout << "Regression Error: cannot write " << timingsPath << endl;
+	}
+	if (!CloseHeadlessRenderer(renderer))
+	{
+		cout << "Regression Error: GL reported errors" << endl;
+		failures++;
+	}
 
-				if (i >= 22 && i < 24) {
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+	if (update)
+		cout << (failures == 0 ? "Goldens and baseline written to " + directory : string("Regression update failed")) << endl;
+	else
+		cout << (failures == 0 ? "Regression passed" : "Regression FAILED: " + to_string(failures) + " problem pose(s)") << endl;
+	return failures == 0 ? 0 : 1;
+}
 
-				if (i >= 26 && i < 28) {
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+/* Regression Harness Definitions End Here */
 
-				if (i >= 30 && i < 32) {		// rightmost pillar
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+/* Microbenchmark Definitions */
 
-			}
-		// Unbind Shader exe and VOA after drawing per frame
-	glBindVertexArray(0); //Incase different VAO wll be used after
+// --bench-micro times the code that runs every tick, every frame or every input event, Google
+// Benchmark style: each case repeats until it has run MICRO_MIN_SECONDS, then reports time and
+// heap allocations per iteration. Scene-sized cases tile the loaded scene up to a million placements.
+const double MICRO_MIN_SECONDS = 0.25;
+const GLuint MICRO_GRID_SIZES[] = { 1, 4, 13, 41, 131 };	// Copies per side: 58 to ~1M bookshelf placements
 
-		glBindVertexArray(shelfRectangleFBVAO); // User-defined VAO must be called before draw. 
-			for (GLuint i = 0; i < 32; i++)	
-			{
-				// Create shelf front and back
-				if (i >= 0 && i < 2) {	 // Bottom Shelf
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+// Builds with SCENE_COUNT_ALLOCATIONS defined replace the global operator new to count every allocation
+// in the process (one relaxed add), so benchmarks can report allocations; other builds keep the standard
+// allocator and print '-' in that column. New and delete stay out of line: inlined into callers, GCC
+// mistakes their malloc() and free() for a mismatch.
+atomic<uint64_t> allocationCount(0);
 
-				if (i >= 4 && i < 6) {
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+#ifdef SCENE_COUNT_ALLOCATIONS
+const bool ALLOCATIONS_COUNTED = true;
 
-				if (i >= 8 && i < 10) {
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+#ifdef _MSC_VER
+#define SCENE_NO_INLINE __declspec(noinline)
+#else
+#define SCENE_NO_INLINE __attribute__((noinline))
+#endif
 
-				if (i >= 12 && i < 14) {		// Top shelf
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+SCENE_NO_INLINE void* operator new(size_t size)
+{
+	allocationCount.fetch_add(1, memory_order_relaxed);
+	if (void* block = malloc(size > 0 ? size : 1))
+		return block;
+	throw bad_alloc();
+}
 
-				// Create Pillar Fronts and Backs
-				if (i >= 16 && i < 18) {	// Leftmost pillar
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
-	
-				if (i >= 20 && i < 22) {
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}				
-
-				if (i >= 24 && i < 26) {
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-					}
+SCENE_NO_INLINE void operator delete(void* block) noexcept
+{
+	free(block);
+}
 
-				if (i >= 28 && i < 30) {	// Rightmost pillar
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectanglePlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectanglePlaneRotations[i] * toRadians, glm::vec3(0.0f, 0.0f, 1.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
-			}
+SCENE_NO_INLINE void operator delete(void* block, size_t) noexcept
+{
+	free(block);
+}
+#else
+const bool ALLOCATIONS_COUNTED = false;
+#endif
+
+// Make the optimizer assume the object is read, so work producing it is not removed or hoisted
+static inline void KeepBenchmarkResult(const void* result)
+{
+#ifdef _MSC_VER
+	static const void* volatile escape;
+	escape = result;
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "r"(result) : "memory");
+#endif
+}
 
-		// Unbind Shader exe and VOA after drawing per frame
-		glBindVertexArray(0); //Incase different VAO wll be used after
+// Run body until it has taken MICRO_MIN_SECONDS and print ns and allocations per iteration, plus
+// ns per item when an iteration covers several
+template <typename Body>
+void RunMicroBenchmark(const string& name, uint64_t items, Body body)
+{
+	uint64_t iterations = 1;
+	for (;;)
+	{
+		uint64_t allocationsBefore = allocationCount.load(memory_order_relaxed);
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for (uint64_t i = 0; i < iterations; i++)
+			body();
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		uint64_t allocations = allocationCount.load(memory_order_relaxed) - allocationsBefore;
+
+		if (seconds >= MICRO_MIN_SECONDS || iterations >= (1ull << 32))
+		{
+			double nanoseconds = seconds * 1e9 / iterations;
+			cout << "  " << left << setw(36) << name << right << fixed << setprecision(1) << setw(14) << nanoseconds << setw(12) << iterations
+				<< setprecision(2) << setw(12);
+			if (ALLOCATIONS_COUNTED)
+				cout << (double)allocations / iterations;
+			else
+				cout << "-";
+			if (items > 1)
+				cout << setprecision(2) << setw(10) << nanoseconds / items;
+			cout << endl;
+			cout.unsetf(ios::floatfield);
+			cout << setprecision(6);
+			return;
+		}
+		// Aim 40% past the minimum from the last run, growing at most 10x per step
+		double growth = seconds > 0.0 ? min(10.0, MICRO_MIN_SECONDS * 1.4 / seconds) : 10.0;
+		iterations = max(iterations + 1, (uint64_t)(iterations * growth));
+	}
+}
 
-		glBindVertexArray(shelfRectangleCapVAO); // User-defined VAO must be called before draw. 
-			for (GLuint i = 0; i < 16; i++)
+// The scene's nodes and placements repeated on a gridSize x gridSize grid like --convert-scene
+// --grid, but kept grouped by mesh so each mesh stays one batch
+void BuildSyntheticScene(TransformStore& store, SceneGraph& graph, vector<DrawBatch>& batches, const SceneFile& scene, GLuint gridSize)
+{
+	GLuint sourceNodes = scene.header->nodeCount;
+	for (GLuint row = 0; row < gridSize; row++)
+		for (GLuint column = 0; column < gridSize; column++)
+		{
+			GLuint firstNode = (GLuint)graph.parent.size();
+			for (GLuint i = 0; i < sourceNodes; i++)
 			{
-				if (i >= 0 && i < 8) {
-					// Create shelf lefts and rights
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectangleCapPlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectangleCapPlaneRotations[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
-				}
+				const SceneNodeRecord& node = scene.nodes[i];
+				bool root = node.parent == SCENE_NO_NODE;
+				glm::vec3 offset = root ? glm::vec3(column * SCENE_GRID_SPACING, 0.0f, -(GLfloat)row * SCENE_GRID_SPACING) : glm::vec3(0.0f);
+				AddSceneNode(graph, node.name, root ? SCENE_NO_NODE : node.parent + firstNode,
+					glm::vec3(node.position[0], node.position[1], node.position[2]) + offset,
+					glm::vec3(node.rotation[0], node.rotation[1], node.rotation[2]), glm::vec3(node.scale[0], node.scale[1], node.scale[2]));
+			}
+		}
 
-				if (i >= 8 && i < 16) {
-					// Create pillar tops and bottoms
-					glm::mat4 modelMatrix;
-					modelMatrix = glm::translate(modelMatrix, shelfRectangleCapPlanePositions[i]);
-					modelMatrix = glm::rotate(modelMatrix, shelfRectangleCapPlaneRotations[i] * toRadians, glm::vec3(0.0f, 1.0f, 0.0f));
-					modelMatrix = glm::rotate(modelMatrix, shelfRectangleCapPlaneRotations[i] * toRadians, glm::vec3(1.0f, 0.0f, 0.0f));
-					glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-					// Draw primitive(s)
-					draw();
+	vector<DrawBatch> sourceBatches = BuildDrawBatches(scene);
+	for (size_t b = 0; b < sourceBatches.size(); b++)
+	{
+		DrawBatch batch = { sourceBatches[b].mesh, (GLuint)store.worldMatrices.size(), 0 };
+		for (GLuint row = 0; row < gridSize; row++)
+			for (GLuint column = 0; column < gridSize; column++)
+				for (GLsizei j = 0; j < sourceBatches[b].instanceCount; j++)
+				{
+					const SceneInstanceRecord& instance = scene.instances[sourceBatches[b].firstTransform + j];
+					bool root = instance.node == SCENE_NO_NODE;
+					glm::vec3 offset = root ? glm::vec3(column * SCENE_GRID_SPACING, 0.0f, -(GLfloat)row * SCENE_GRID_SPACING) : glm::vec3(0.0f);
+					graph.objectNode.push_back(root ? SCENE_NO_NODE : instance.node + (row * gridSize + column) * sourceNodes);
+					AddTransform(store, glm::vec3(instance.position[0], instance.position[1], instance.position[2]) + offset,
+						glm::vec3(instance.rotation[0], instance.rotation[1], instance.rotation[2]),
+						glm::vec3(instance.scale[0], instance.scale[1], instance.scale[2]));
+					batch.instanceCount++;
 				}
-			}
+		batches.push_back(batch);
+	}
+	FinishSceneGraph(graph);
+}
 
-		glBindVertexArray(0); //Incase different VAO wll be used after
+// Input and camera cases: each touches only the camera globals, which are reset before it runs
+void RunCameraMicroBenchmarks(const SceneFile& sceneFile)
+{
+	memset(keys, 0, sizeof(keys));
+	memset(mouseButtons, 0, sizeof(mouseButtons));
 
-		glBindVertexArray(toiletPaperCylinderVAO); // User-defined VAO must be called before draw.
-			for (int i = 0; i < 6; i++) {
-			
-				modelMatrix = glm::translate(glm::mat4(1.0f), toiletPaperCylinderPositions[i]); // Position strip at 0,0,0
-				modelMatrix = glm::rotate(modelMatrix, glm::radians(360.f), glm::vec3(1.0f, 0.0f, 0.0f)); 
-				modelMatrix = glm::rotate(modelMatrix, glm::radians(toiletPaperCylinderRotations[i]), glm::vec3(0.0f, 0.0f, 1.0f)); // Rotate strip on z by increments in array		
-				glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-				glDrawArrays(GL_TRIANGLES, 0, 9); // Render primitive or execute shader per draw
-			}
-		glBindVertexArray(0); //Incase different VAO wll be used after
+	// Forward and right held, as in a typical fly-through
+	initCamera();
+	keys[GLFW_KEY_W] = keys[GLFW_KEY_D] = true;
+	RunMicroBenchmark("TransformCamera", 1, []() {
+		TransformCamera();
+		KeepBenchmarkResult(&cameraPosition);
+	});
+	keys[GLFW_KEY_W] = keys[GLFW_KEY_D] = false;
+
+	// The input side of a whole tick with no events queued
+	initCamera();
+	RunMicroBenchmark("ProcessInputTick/idle", 1, []() {
+		ProcessInputTick(0.0);
+		KeepBenchmarkResult(&target);
+	});
+
+	// Cursor motion alternates direction so angles and the camera stay in range
+	initCamera();
+	xChange = 3.0f;
+	yChange = 2.0f;
+	RunMicroBenchmark("targetFollowsCursor", 1, []() {
+		xChange = -xChange;
+		targetFollowsCursor();
+		KeepBenchmarkResult(&cameraFront);
+	});
+
+	initCamera();
+	isOrbiting = true;
+	RunMicroBenchmark("ApplyCursorMotion/orbit", 1, []() {
+		xChange = -xChange;
+		ApplyCursorMotion();
+		KeepBenchmarkResult(&cameraPosition);
+	});
+	isOrbiting = false;
+
+	initCamera();
+	isPanning = true;
+	RunMicroBenchmark("ApplyCursorMotion/pan", 1, []() {
+		xChange = -xChange;
+		ApplyCursorMotion();
+		KeepBenchmarkResult(&cameraPosition);
+	});
+	isPanning = false;
+
+	initCamera();
+	RunMicroBenchmark("getTarget", 1, []() {
+		glm::vec3 result = getTarget();
+		KeepBenchmarkResult(&result);
+	});
+
+	RunMicroBenchmark("lookAt + perspective", 1, []() {
+		glm::mat4 view = glm::lookAt(cameraPosition, cameraPosition + cameraFront, worldUp);
+		glm::mat4 projection = glm::perspective(fov, (GLfloat)width / (GLfloat)height, NEAR_PLANE, FAR_PLANE);
+		KeepBenchmarkResult(&view);
+		KeepBenchmarkResult(&projection);
+	});
+
+	// Model matrices of the shelf's boards, one at a time through glm and as a block through the kernel
+	vector<glm::vec3> positions, rotations, scales;
+	TransformStore shelf;
+	for (GLuint i = 0; i < sceneFile.header->instanceCount; i++)
+	{
+		const SceneInstanceRecord& instance = sceneFile.instances[i];
+		if (strncmp(sceneFile.meshes[instance.mesh].name, "shelf", 5) != 0)
+			continue;
+		positions.push_back(glm::vec3(instance.position[0], instance.position[1], instance.position[2]));
+		rotations.push_back(glm::vec3(instance.rotation[0], instance.rotation[1], instance.rotation[2]));
+		scales.push_back(glm::vec3(instance.scale[0], instance.scale[1], instance.scale[2]));
+		AddTransform(shelf, positions.back(), rotations.back(), scales.back());
+	}
+	GLuint shelfCount = (GLuint)positions.size();
+	if (shelfCount == 0)
+		return;
+	vector<glm::mat4> matrices(shelfCount);
+	RunMicroBenchmark("ShelfMatrices/glm/" + to_string(shelfCount), shelfCount, [&]() {
+		for (GLuint i = 0; i < shelfCount; i++)
+			matrices[i] = ComposeTransform(positions[i], rotations[i], scales[i]);
+		KeepBenchmarkResult(matrices.data());
+	});
+	RunMicroBenchmark("ShelfMatrices/" + string(TransformKernelName(transformKernel)) + "/" + to_string(shelfCount), shelfCount, [&]() {
+		ComposeTransforms(transformKernel, shelf, 0, shelfCount);
+		KeepBenchmarkResult(shelf.worldMatrices.data());
+	});
+}
 
-		glBindVertexArray(tennisBallSphereVAO); // User-defined VAO must be called before draw.
-			for (int i = 0; i < 6; i++) {
-				modelMatrix = glm::translate(glm::mat4(1.0f), tennisBallSpherePositions[i]); // Position strip at 0,0,0
-				modelMatrix = glm::scale(modelMatrix, glm::vec3(0.5f, 0.5f, 0.5f));
+// Per-frame CPU passes over the loaded scene tiled up to maxInstances placements, seen from the
+// front pose of the regression harness
+void RunSceneMicroBenchmarks(const SceneFile& sceneFile, const GeometryArena& arena, GLuint maxInstances)
+{
+	glm::vec3 eye = glm::vec3(0.0f, 5.0f, 16.0f);
+	glm::mat4 projection = glm::perspective(fov, (GLfloat)width / (GLfloat)height, NEAR_PLANE, FAR_PLANE);
+	Frustum frustum = ExtractFrustum(projection * glm::lookAt(eye, eye + glm::vec3(0.0f, 0.0f, -1.0f), worldUp));
 
-				if (i >= 0 && i < 4) {
-				modelMatrix = glm::rotate(modelMatrix, glm::radians(tennisBallSphereRotations[i]), glm::vec3(0.0f, 1.0f, 0.0f)); // Rotate strip on y by increments in array	
-				}
+	for (GLuint g = 0; g < sizeof(MICRO_GRID_SIZES) / sizeof(MICRO_GRID_SIZES[0]); g++)
+	{
+		GLuint gridSize = MICRO_GRID_SIZES[g];
+		if ((uint64_t)sceneFile.header->instanceCount * gridSize * gridSize > maxInstances)
+			break;
+
+		TransformStore store;
+		SceneGraph graph;
+		vector<DrawBatch> batches;
+		BoundingVolumeHierarchy bvh;
+		VisibleSet visible;
+		RenderQueue queue;
+		CullStats stats;
+		BuildSyntheticScene(store, graph, batches, sceneFile, gridSize);
+		GLuint count = (GLuint)store.worldMatrices.size();
+		UpdateTransforms(store, sceneJobs, &graph);
+		BuildCullingHierarchy(bvh, arena, store, batches);
+		string suffix = "/" + to_string(count);
+
+		RunMicroBenchmark("UpdateTransforms" + suffix, count, [&]() {
+			store.dirty.assign(count, 1);
+			store.anyDirty = true;
+			UpdateTransforms(store, sceneJobs, &graph);
+		});
+
+		// Nudge the first copy's shelf back and forth: only its subtree and objects are rebuilt
+		GLuint shelf = FindSceneNode(graph, "shelfUnit");
+		GLfloat nudge = 0.01f;
+		if (shelf != SCENE_NO_NODE)
+			RunMicroBenchmark("MoveSceneNode/shelfUnit" + suffix, 1, [&]() {
+				nudge = -nudge;
+				MoveSceneNode(graph, shelf, glm::vec3(nudge, 0.0f, 0.0f));
+				PropagateSceneGraph(graph, store);
+				UpdateTransforms(store, sceneJobs, &graph);
+			});
+		RunMicroBenchmark("CullScene" + suffix, count, [&]() {
+			CullScene(bvh, frustum, visible.objectVisible, stats, sceneJobs);
+		});
+		RunMicroBenchmark("SelectLOD + CompactVisibleSet" + suffix, count, [&]() {
+			SelectLevelsOfDetail(visible, bvh, arena, projection, eye, height, sceneJobs);
+			CompactVisibleSet(visible, arena, batches, store, sceneJobs);
+		});
+		RunMicroBenchmark("BuildRenderQueue + Sort" + suffix, count, [&]() {
+			BuildRenderQueue(queue, RENDER_PER_OBJECT, batches, store.worldMatrices.data(), eye, sceneJobs);
+			SortRenderQueue(queue);
+		});
+	}
+}
+
+// Needs the scene's meshes for bounds and shelf placements, but no GL context
+int RunMicroBenchmarks(const SceneFile& sceneFile, GLuint maxInstances)
+{
+	StartJobSystem(sceneJobs, jobThreadCount);
+	GeometryArena arena;
+	AttachSceneGeometry(arena, sceneFile);
+
+	cout << "Microbenchmarks: " << TransformKernelName(transformKernel) << " transform kernel, " << sceneJobs.workerCount << " job workers, "
+		<< MICRO_MIN_SECONDS << " s minimum per case, scenes up to " << maxInstances << " placements" << endl;
+	if (!ALLOCATIONS_COUNTED)
+		cout << "  Allocations are only counted in builds with SCENE_COUNT_ALLOCATIONS defined" << endl;
+	cout << "  " << left << setw(36) << "Case" << right << setw(14) << "ns/op" << setw(12) << "iterations" << setw(12) << "allocs/op" << setw(10) << "ns/item" << endl;
+	RunCameraMicroBenchmarks(sceneFile);
+	RunSceneMicroBenchmarks(sceneFile, arena, maxInstances);
+
+	StopJobSystem(sceneJobs);
+	return 0;
+}
 
-				if (i >= 4 && i <= 5) {
-					modelMatrix = glm::rotate(modelMatrix, glm::radians(tennisBallSphereRotations[i]), glm::vec3(1.0f, 0.0f, 0.0f)); // Rotate strip on x by increments in array
-				}		
-			glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(modelMatrix));
-			glDrawArrays(GL_TRIANGLES, 0, 18); // Render primitive or execute shader per draw
+/* Microbenchmark Definitions End Here */
+
+int main(int argc, char* argv[])
+{
+	string scenePath = "Scenes/bookshelf.scnb";
+	bool headless = false;
+	GLuint headlessFrames = 300;
+	int headlessWidth = width, headlessHeight = height;
+	string headlessOutput;
+	string tracePath;
+	GLuint transformBenchmarkCount = 0;
+	string regressionDirectory;
+	bool regressionUpdate = false;
+	GLuint microBenchmarkLimit = 0;
+
+	// Command line options
+	for (int i = 1; i < argc; i++)
+	{
+		string option = argv[i];
+		if (option == "--convert-scene" && i + 2 < argc)		// Offline: text description to binary scene
+		{
+			GLuint gridSize = 1;
+			SceneVertexFormat format = VERTEX_FORMAT_FLOAT;
+			for (int j = i + 3; j + 1 < argc; j += 2)
+			{
+				string convertOption = argv[j], value = argv[j + 1];
+				if (convertOption == "--grid")
+					gridSize = (GLuint)max(1, atoi(value.c_str()));
+				else if (convertOption == "--vertex-format")
+					format = value == "snorm16" ? VERTEX_FORMAT_SNORM16 : value == "half" ? VERTEX_FORMAT_HALF : VERTEX_FORMAT_FLOAT;
 			}
+			return ConvertSceneText(argv[i + 1], argv[i + 2], gridSize, format) ? 0 : -1;
+		}
+		else if (option == "--bake-texture" && i + 1 < argc)		// Offline: image to pre-mipmapped texture file
+			return BakeTextureFile(argv[i + 1], i + 2 < argc ? argv[i + 2] : BakedTexturePath(argv[i + 1])) ? 0 : -1;
+		else if (option == "--scene" && i + 1 < argc)
+			scenePath = argv[++i];
+		else if (option == "--headless")
+			headless = true;
+		else if (option == "--frames" && i + 1 < argc)
+			headlessFrames = (GLuint)max(1, atoi(argv[++i]));
+		else if (option == "--size" && i + 2 < argc)
+		{
+			headlessWidth = max(1, atoi(argv[++i]));
+			headlessHeight = max(1, atoi(argv[++i]));
+		}
+		else if (option == "--output" && i + 1 < argc)
+			headlessOutput = argv[++i];
+		else if (option == "--trace" && i + 1 < argc)
+		{
+			tracePath = argv[++i];
+			profilerEnabled = true;
+		}
+		else if (option == "--no-shader-cache")
+			shaderCacheEnabled = false;
+		else if (option == "--shader-cache" && i + 1 < argc)
+			shaderCacheDirectory = argv[++i];
+		else if (option == "--no-cull")
+			cullingEnabled = false;
+		else if (option == "--no-stream")
+			streamingEnabled = false;
+		else if (option == "--no-textures")
+			texturesEnabled = false;
+		else if (option == "--no-texture-compression")
+			textureCompressionEnabled = false;
+		else if (option == "--no-lighting")
+			lightingEnabled = false;
+		else if (option == "--gpu-budget" && i + 1 < argc)
+			gpuResources.budgetBytes = (GLsizeiptr)(atof(argv[++i]) * 1024.0 * 1024.0);
+		else if (option == "--gpu-report")
+			gpuReportObjects = true;
+		else if (option == "--bench-transforms")
+		{
+			transformBenchmarkCount = 100000;
+			if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+				transformBenchmarkCount = (GLuint)max(1, atoi(argv[++i]));
+		}
+		else if (option == "--bench-micro")
+		{
+			microBenchmarkLimit = 1000000;
+			if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+				microBenchmarkLimit = (GLuint)max(1, atoi(argv[++i]));
+		}
+		else if (option == "--backend" && i + 1 < argc)
+		{
+			// The software rasterizer only renders offscreen
+			renderBackend = string(argv[++i]) == "software" ? RENDER_BACKEND_SOFTWARE : RENDER_BACKEND_GL;
+			headless = headless || renderBackend == RENDER_BACKEND_SOFTWARE;
+		}
+		else if (option == "--regress" || option == "--regress-update")
+		{
+			regressionDirectory = "Regression";
+			regressionUpdate = option == "--regress-update";
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				regressionDirectory = argv[++i];
+		}
+		else if (option == "--threads" && i + 1 < argc)
+			jobThreadCount = (GLuint)max(0, atoi(argv[++i]));
+		else if (option == "--render-path" && i + 1 < argc)
+		{
+			string path = argv[++i];
+			renderPath = path == "per-object" ? RENDER_PER_OBJECT : path == "instanced" ? RENDER_INSTANCED : RENDER_INDIRECT;
+		}
+		else
+		{
+			cout << "Usage: " << argv[0] << " [--scene file.scnb] [--render-path per-object|instanced|indirect] [--no-cull] [--no-stream] [--no-textures] [--threads N]" << endl;
+			cout << "           [--shader-cache dir | --no-shader-cache] [--trace trace.json] [--gpu-budget MB] [--gpu-report]" << endl;
+			cout << "           [--no-texture-compression] [--no-lighting]" << endl;
+			cout << "       " << argv[0] << " --headless [--backend gl|software] [--frames N] [--size W H] [--output frame.ppm]" << endl;
+			cout << "       " << argv[0] << " --regress [dir] | --regress-update [dir]" << endl;
+			cout << "       " << argv[0] << " --bench-transforms [N] [--threads N]" << endl;
+			cout << "       " << argv[0] << " --bench-micro [max placements] [--scene file.scnb] [--threads N]" << endl;
+			cout << "       " << argv[0] << " --convert-scene in.scene out.scnb [--grid N] [--vertex-format float|snorm16|half]" << endl;
+			cout << "       " << argv[0] << " --bake-texture image.png [out.texb]" << endl;
+			return -1;
+		}
+	}
+
+	if (transformBenchmarkCount > 0)
+		return RunTransformBenchmark(transformBenchmarkCount);
 
-		glBindVertexArray(0); //Incase different VAO wll be used after
+	// Map the scene before creating the window so a bad path fails fast
+	SceneFile sceneFile;
+	if (!LoadSceneFile(scenePath, sceneFile))
+		return -1;
 
-		glUseProgram(0); // Incase different shader will be used after
+	if (microBenchmarkLimit > 0)
+	{
+		int result = RunMicroBenchmarks(sceneFile, microBenchmarkLimit);
+		CloseSceneFile(sceneFile);
+		return result;
+	}
 
+	if (!regressionDirectory.empty())
+	{
+		int result = RunRegression(sceneFile, regressionDirectory, regressionUpdate);
+		CloseSceneFile(sceneFile);
+		return result;
+	}
 
-		/* Swap front and back buffers */
-		glfwSwapBuffers(window);
+	if (headless)
+	{
+		int result = RunHeadlessBenchmark(sceneFile, headlessFrames, headlessWidth, headlessHeight, headlessOutput);
+		CloseSceneFile(sceneFile);
+		if (!tracePath.empty())
+			ExportChromeTrace(tracePath);
+		return result;
+	}
 
-		/* Poll for and process events */
-		glfwPollEvents();
+	GLFWwindow* window;
 
-		// Poll camera transformations
-		TransformCamera();
+	/* Initialize the library */
+	if (!glfwInit())
+		return -1;
+
+	/* Create a windowed mode window and its OpenGL context */
+	window = glfwCreateWindow(width, height, "Tyler Pruitt Project Milestone", NULL, NULL);
+	if (!window)
+	{
+		glfwTerminate();
+		return -1;
 	}
 
-	//Clear GPU resources
+	// Set input callback functions
+	glfwSetKeyCallback(window, key_callback);
+	glfwSetCursorPosCallback(window, cursor_position_callback);
+	glfwSetMouseButtonCallback(window, mouse_button_callback);
+	glfwSetScrollCallback(window, scroll_callback);
 
-	glDeleteVertexArrays(1, &floorVAO);
-	glDeleteBuffers(1, &floorVBO);
-	glDeleteBuffers(1, &floorEBO);
+	/* Make the window's context current */
+	glfwMakeContextCurrent(window);
 
-	glDeleteVertexArrays(1, &wallVAO);
-	glDeleteBuffers(1, &wallVBO);
-	glDeleteBuffers(1, &wallEBO);
+	// Initialize GLEW
+	if (glewInit() != GLEW_OK)
+		cout << "Error!" << endl;
 
-	glDeleteVertexArrays(1, &brickRectangleTBVAO);
-	glDeleteBuffers(1, &brickRectangleTBVBO);
-	glDeleteBuffers(1, &brickRectangleTBEBO);
+	if (!InitScene(sceneFile))
+	{
+		ShutdownScene();
+		CloseSceneFile(sceneFile);
+		glfwTerminate();
+		return -1;
+	}
+	if (gpuReportObjects)
+		PrintGpuMemoryReport(true);
 
-	glDeleteVertexArrays(1, &brickRectangleLRVAO);
-	glDeleteBuffers(1, &brickRectangleLRVBO);
-	glDeleteBuffers(1, &brickRectangleTBEBO);
+	// The camera advances in fixed ticks on its own clock; frames draw it between the last two ticks
+	double simulationTime = glfwGetTime();
+	previousCamera = CurrentCamera();
 
-	glDeleteVertexArrays(1, &brickRectangleCapVAO);
-	glDeleteBuffers(1, &brickRectangleCapVBO);
-	glDeleteBuffers(1, &brickRectangleCapEBO);
+	/* Loop until the user closes the window */
+	while (!glfwWindowShouldClose(window))
+	{
+		double now;
+		{
+			ProfileScope inputScope("Input");
 
-	glDeleteVertexArrays(1, &shelfRectangleTBVAO);
-	glDeleteBuffers(1, &shelfRectangleTBVBO);
-	glDeleteBuffers(1, &shelfRectangleTBEBO);
+			/* Poll for and process events */
+			glfwPollEvents();
 
-	glDeleteVertexArrays(1, &shelfRectangleFBVAO);
-	glDeleteBuffers(1, &shelfRectangleFBVBO);
-	glDeleteBuffers(1, &shelfRectangleFBEBO);
+			now = glfwGetTime();
+			GLuint ticks = 0;
+			while (simulationTime + SIMULATION_TICK_SECONDS <= now && ticks < MAX_TICKS_PER_FRAME)
+			{
+				previousCamera = CurrentCamera();
+				simulationTime += SIMULATION_TICK_SECONDS;
+				ProcessInputTick(simulationTime);
+				ticks++;
+			}
+			// After a long stall (a breakpoint, a window drag) drop the backlog instead of fast-forwarding
+			if (ticks == MAX_TICKS_PER_FRAME)
+				simulationTime = now;
+		}
 
-	glDeleteVertexArrays(1, &shelfRectangleCapVAO);
-	glDeleteBuffers(1, &shelfRectangleCapVBO);
-	glDeleteBuffers(1, &shelfRectangleCapEBO);
+		// Resize window and graphics simultaneously
+		glfwGetFramebufferSize(window, &width, &height);
+		GLfloat alpha = (GLfloat)glm::clamp((now - simulationTime) / SIMULATION_TICK_SECONDS, 0.0, 1.0);
+		RenderFrame(width, height, InterpolateCamera(previousCamera, CurrentCamera(), alpha));
 
-	glDeleteVertexArrays(1, &toiletPaperCylinderVAO);
-	glDeleteBuffers(1, &toiletPaperCylinderVBO);
+		/* Swap front and back buffers */
+		{
+			ProfileScope swapScope("glfwSwapBuffers");
+			glfwSwapBuffers(window);
+		}
+	}
 
-	glDeleteVertexArrays(1, &tennisBallSphereVAO);
-	glDeleteBuffers(1, &tennisBallSphereVBO);
+	ShutdownScene();
+	CloseSceneFile(sceneFile);
 
 	glfwTerminate();
+	if (!tracePath.empty())
+		ExportChromeTrace(tracePath);
 	return 0;
 }
 
-// Define Input Callback functions
+// Define Input Callback functions. They only queue events; ProcessInputTick applies them.
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
-	if (action == GLFW_PRESS)
-		keys[key] = true;
-	else if (action == GLFW_RELEASE)
-		keys[key] = false;
+	PushInputEvent(inputQueue, INPUT_KEY, key, action, 0.0, 0.0);
 }
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
-	// Default cameraSpeed
-	if (cameraSpeed < 0.01f)
-		cameraSpeed = 0.01f;
-	if (cameraSpeed > 0.3f)
-		cameraSpeed = 0.3f;
-
-	cameraSpeed += yoffset * deltaTime;
+	PushInputEvent(inputQueue, INPUT_SCROLL, 0, 0, xoffset, yoffset);
 }
 void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 {
-	if (firstMouseMove)
+	PushInputEvent(inputQueue, INPUT_CURSOR, 0, 0, xpos, ypos);
+}
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+	PushInputEvent(inputQueue, INPUT_MOUSE_BUTTON, button, action, 0.0, 0.0);
+}
+
+// Apply one key event in the order it happened
+void ApplyKeyEvent(int key, int action)
+{
+	if (key < 0 || key >= 1024)
+		return;
+	if (action == GLFW_PRESS)
+		keys[key] = true;
+	else if (action == GLFW_RELEASE)
+		keys[key] = false;
+	if (action != GLFW_PRESS)
+		return;
+
+	// Cycle render paths once per key press, skipping indirect when unsupported
+	if (key == GLFW_KEY_I)
 	{
-		lastX = xpos;
-		lastY = ypos;
-		firstMouseMove = false;
+		if (renderPath == RENDER_PER_OBJECT)
+			renderPath = RENDER_INSTANCED;
+		else if (renderPath == RENDER_INSTANCED && indirectSupported)
+			renderPath = RENDER_INDIRECT;
+		else
+			renderPath = RENDER_PER_OBJECT;
+	}
+
+	// Toggle frustum culling and report what the last frame kept
+	if (key == GLFW_KEY_C)
+	{
+		cullingEnabled = !cullingEnabled;
+		cout << "Culling " << (cullingEnabled ? "on" : "off") << ", last frame: " << cullStats.visible << " visible, " << cullStats.culled << " culled" << endl;
 	}
 
-	// Calculate cursor offset
-	xChange = xpos - lastX;
-	yChange = lastY - ypos;
-	lastX = xpos;
-	lastY = ypos;
+	// Toggle orthographic view once per key press
+	if (key == GLFW_KEY_P)
+	{
+		glViewport(0.0f, 0.0f, width, height);
+		isOrtho = !isOrtho;
+	}
+}
 
+// Look, pan and orbit by the cursor motion of a whole tick
+void ApplyCursorMotion()
+{
 	// Camera Follows Cursor
 	targetFollowsCursor();
 
@@ -1232,11 +7205,11 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 		else
 			cameraPosition.z = -1.0f;
 
-		cameraSpeed = xChange * deltaTime;
-		cameraPosition += cameraSpeed * cameraRight;
+		GLfloat panSpeed = xChange * SIMULATION_TICK_SECONDS;
+		cameraPosition += panSpeed * cameraRight;
 
-		cameraSpeed = yChange * deltaTime;
-		cameraPosition += cameraSpeed * cameraUp;
+		panSpeed = yChange * SIMULATION_TICK_SECONDS;
+		cameraPosition += panSpeed * cameraUp;
 	}
 
 	// Orbit camera,
@@ -1247,7 +7220,6 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 
 		// Convert Yaw and Pitch to degrees
 		degYaw = glm::radians(rawYaw);
-		degPitch = glm::radians(rawPitch);
 		degPitch = glm::clamp(glm::radians(rawPitch), -glm::pi<float>() /2.0f + 0.1f, glm::pi<float>() / 2.0f - 0.1f);
 
 		// Azimuth Altitude formula
@@ -1255,14 +7227,58 @@ void cursor_position_callback(GLFWwindow* window, double xpos, double ypos)
 		cameraPosition.y = target.y + radius * sinf(degPitch);
 		cameraPosition.z = target.z + radius * cosf(degPitch) * cosf(degYaw);
 	}
-
 }
-void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+
+// Advance the camera one fixed tick using every event queued before tickEnd. Key and button changes
+// apply in order; cursor motion and scrolling are coalesced into one update.
+void ProcessInputTick(double tickEnd)
 {
-	if (action == GLFW_PRESS)
-		mouseButtons[button] = true;
-	else if (action == GLFW_RELEASE)
-		mouseButtons[button] = false;
+	bool cursorMoved = false;
+	double cursorX = 0.0, cursorY = 0.0, scroll = 0.0;
+	InputEvent event;
+	while (PopInputEvent(inputQueue, tickEnd, event))
+	{
+		if (event.type == INPUT_KEY)
+			ApplyKeyEvent(event.code, event.action);
+		else if (event.type == INPUT_MOUSE_BUTTON && event.code >= 0 && event.code < 3)
+			mouseButtons[event.code] = event.action == GLFW_PRESS;
+		else if (event.type == INPUT_SCROLL)
+			scroll += event.y;
+		else if (event.type == INPUT_CURSOR)
+		{
+			if (firstMouseMove)
+			{
+				lastX = event.x;
+				lastY = event.y;
+				firstMouseMove = false;
+			}
+			// Positions are absolute, so the last one of the tick carries all of its motion
+			cursorX = event.x;
+			cursorY = event.y;
+			cursorMoved = true;
+		}
+	}
+
+	if (cursorMoved)
+	{
+		// Calculate cursor offset
+		xChange = cursorX - lastX;
+		yChange = lastY - cursorY;
+		lastX = cursorX;
+		lastY = cursorY;
+		ApplyCursorMotion();
+	}
+
+	if (scroll != 0.0)
+	{
+		// Default cameraSpeed
+		cameraSpeed = glm::clamp(cameraSpeed, 0.01f, 0.3f);
+		cameraSpeed += scroll * SIMULATION_TICK_SECONDS;
+	}
+
+	// Poll camera transformations
+	TransformCamera();
+	getTarget();
 }
 
 // Define getTarget function
@@ -1272,7 +7288,7 @@ glm::vec3 getTarget()
 	return target;
 }
 
-// Define TransformCamera function
+// Define TransformCamera function, called once per simulation tick
 void TransformCamera()
 {
 	// Pan camera
@@ -1311,16 +7327,6 @@ void TransformCamera()
 		cameraPosition -= cameraUp * cameraSpeed;
 	}
 
-	if (keys[GLFW_KEY_P]) {
-		glViewport(0.0f, 0.0f, width, height);
-		if (!isOrtho) {
-			isOrtho = true;
-		}
-		else {
-			isOrtho = false;
-		}
-	}
-
 	// Reset camera
 	if (keys[GLFW_KEY_F])
 		initCamera();